@@ -21,9 +21,12 @@
  * DEALINGS IN THE SOFTWARE.
  */
 #include <fcntl.h>
+#include <math.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
 #include <assert.h>
 #include <gbm.h>
@@ -36,6 +39,10 @@
 #include <EGL/eglext.h>
 
 #include "cube-common.h"
+#include "cube-mesh.h"
+#include "presentation.h"
+#include "program-cache.h"
+#include "startup-trace.h"
 #include "shared/platform.h"
 #include "shared/weston-egl-ext.h"
 
@@ -85,12 +92,31 @@ init_egl(struct display *d, struct window *w)
 	if (w->opaque || w->buffer_size == 16)
 		config_attribs[9] = 0;
 
-	d->egl.dpy =
-		weston_platform_get_egl_display(EGL_PLATFORM_WAYLAND_KHR,
-						d->display, NULL);
+	/* without a Wayland connection, render offscreen (see
+	 * init_offscreen()) in a context bound to no surface at all */
+	if (d->display) {
+		d->egl.dpy =
+			weston_platform_get_egl_display(EGL_PLATFORM_WAYLAND_KHR,
+							d->display, NULL);
+	} else {
+		egl_extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+		if (!egl_extensions ||
+		    !weston_check_egl_extension(egl_extensions,
+						"EGL_MESA_platform_surfaceless")) {
+			fprintf(stderr, "EGL_MESA_platform_surfaceless not supported\n");
+			return -1;
+		}
+		d->egl.dpy =
+			weston_platform_get_egl_display(EGL_PLATFORM_SURFACELESS_MESA,
+							EGL_DEFAULT_DISPLAY, NULL);
+		config_attribs[1] = EGL_PBUFFER_BIT;
+	}
 	assert(d->egl.dpy);
 
-	if (!eglInitialize(d->egl.dpy, &major, &minor)) {
+	startup_trace_begin("eglInitialize");
+	ret = eglInitialize(d->egl.dpy, &major, &minor);
+	startup_trace_end();
+	if (!ret) {
 		printf("failed to initialize\n");
 		return -1;
 	}
@@ -100,6 +126,7 @@ init_egl(struct display *d, struct window *w)
 		return -1;
 	}
 
+	startup_trace_begin("EGL config");
 	if (!eglGetConfigs(d->egl.dpy, NULL, 0, &count) || count < 1)
 		assert(0);
 
@@ -119,6 +146,7 @@ init_egl(struct display *d, struct window *w)
 		}
 	}
 	free(configs);
+	startup_trace_end();
 	if (d->egl.conf == NULL) {
 		fprintf(stderr, "did not find config with buffer size %d\n",
 			w->buffer_size);
@@ -128,14 +156,26 @@ init_egl(struct display *d, struct window *w)
 	egl_extensions = eglQueryString(d->egl.dpy, EGL_EXTENSIONS);
 	assert(egl_extensions != NULL);
 
-	if (!weston_check_egl_extension(egl_extensions,
-                                        "EGL_EXT_image_dma_buf_import")) {
+	d->egl.has_dma_buf_import =
+		weston_check_egl_extension(egl_extensions,
+					   "EGL_EXT_image_dma_buf_import");
+	if (!d->egl.has_dma_buf_import) {
 		fprintf(stderr, "EGL_EXT_image_dma_buf_import not supported\n");
+		/* only the video mode needs it offscreen */
+		if (d->display)
+			return -1;
+	}
+
+	if (!d->display &&
+	    !weston_check_egl_extension(egl_extensions,
+					"EGL_KHR_surfaceless_context")) {
+		fprintf(stderr, "EGL_KHR_surfaceless_context not supported\n");
 		return -1;
 	}
 
 	d->egl.swap_buffers_with_damage = NULL;
-	if (weston_check_egl_extension(egl_extensions, "EGL_EXT_buffer_age")) {
+	if (d->display &&
+	    weston_check_egl_extension(egl_extensions, "EGL_EXT_buffer_age")) {
 		for (i = 0;
 		     i < (int) ARRAY_LENGTH(swap_damage_ext_to_entrypoint);
 		     i++) {
@@ -154,10 +194,22 @@ init_egl(struct display *d, struct window *w)
 		printf("has EGL_EXT_buffer_age and %s\n",
 		       swap_damage_ext_to_entrypoint[i].extension);
 
+	/* lets tiled GPUs load and store only the tiles being redrawn */
+	d->egl.set_damage_region = NULL;
+	if (d->display &&
+	    weston_check_egl_extension(egl_extensions,
+				       "EGL_KHR_partial_update")) {
+		d->egl.set_damage_region = (PFNEGLSETDAMAGEREGIONKHRPROC)
+			eglGetProcAddress("eglSetDamageRegionKHR");
+		if (d->egl.set_damage_region)
+			printf("has EGL_KHR_partial_update\n");
+	}
+
 #define get_proc_gl(ext, name) do { \
 		d->egl.name = (void *)eglGetProcAddress(#name); \
 	} while (0)
 
+	startup_trace_begin("EGL context");
 	d->egl.ctx = eglCreateContext(d->egl.dpy,
 				      d->egl.conf,
 				      EGL_NO_CONTEXT,
@@ -166,6 +218,7 @@ init_egl(struct display *d, struct window *w)
 
 	eglMakeCurrent(d->egl.dpy, EGL_NO_SURFACE, EGL_NO_SURFACE,
 		       d->egl.ctx);
+	startup_trace_end();
 
 	gl_extensions = (const char *) glGetString(GL_EXTENSIONS);
 	if (!gl_extensions) {
@@ -180,6 +233,59 @@ init_egl(struct display *d, struct window *w)
 	}
 	get_proc_gl(GL_OES_EGL_image, glEGLImageTargetTexture2DOES);
 
+	if (weston_check_egl_extension(gl_extensions,
+				       "GL_OES_get_program_binary"))
+		program_cache_init();
+
+	if (weston_check_egl_extension(gl_extensions,
+				       "GL_KHR_parallel_shader_compile")) {
+		PFNGLMAXSHADERCOMPILERTHREADSKHRPROC max_threads;
+
+		/* let the driver use as many threads as it likes */
+		max_threads = (void *)eglGetProcAddress(
+					"glMaxShaderCompilerThreadsKHR");
+		if (max_threads)
+			max_threads(0xffffffff);
+		d->egl.has_parallel_shader_compile = true;
+	}
+
+	if (weston_check_egl_extension(gl_extensions,
+				       "GL_EXT_disjoint_timer_query")) {
+		get_proc_gl(GL_EXT_disjoint_timer_query, glGenQueriesEXT);
+		get_proc_gl(GL_EXT_disjoint_timer_query, glBeginQueryEXT);
+		get_proc_gl(GL_EXT_disjoint_timer_query, glEndQueryEXT);
+		get_proc_gl(GL_EXT_disjoint_timer_query, glGetQueryObjectuivEXT);
+		get_proc_gl(GL_EXT_disjoint_timer_query, glGetQueryObjectui64vEXT);
+	}
+
+	if (weston_check_egl_extension(gl_extensions,
+				       "GL_OES_vertex_array_object")) {
+		get_proc_gl(GL_OES_vertex_array_object, glGenVertexArraysOES);
+		get_proc_gl(GL_OES_vertex_array_object, glBindVertexArrayOES);
+		get_proc_gl(GL_OES_vertex_array_object, glDeleteVertexArraysOES);
+		d->egl.has_vertex_array_object = d->egl.glGenVertexArraysOES &&
+			d->egl.glBindVertexArrayOES &&
+			d->egl.glDeleteVertexArraysOES;
+	}
+
+	/* the ANGLE entry points are the same as the EXT ones */
+	if (weston_check_egl_extension(gl_extensions,
+				       "GL_EXT_instanced_arrays")) {
+		get_proc_gl(GL_EXT_instanced_arrays, glVertexAttribDivisorEXT);
+		get_proc_gl(GL_EXT_instanced_arrays, glDrawElementsInstancedEXT);
+	} else if (weston_check_egl_extension(gl_extensions,
+					      "GL_ANGLE_instanced_arrays")) {
+		d->egl.glVertexAttribDivisorEXT = (void *)
+			eglGetProcAddress("glVertexAttribDivisorANGLE");
+		d->egl.glDrawElementsInstancedEXT = (void *)
+			eglGetProcAddress("glDrawElementsInstancedANGLE");
+	}
+	d->egl.has_instanced_arrays = d->egl.glVertexAttribDivisorEXT &&
+		d->egl.glDrawElementsInstancedEXT;
+
+	d->egl.has_texture_rg = weston_check_egl_extension(gl_extensions,
+							   "GL_EXT_texture_rg");
+
 	if (weston_check_egl_extension(egl_extensions,
 				       "EGL_EXT_image_dma_buf_import_modifiers")
 	    ) {
@@ -221,6 +327,41 @@ init_egl(struct display *d, struct window *w)
 	return 0;
 }
 
+static volatile sig_atomic_t dump_requests;
+
+static void
+signal_dump(int signum)
+{
+	(void)signum;
+
+	dump_requests++;
+}
+
+/* SIGUSR1 asks the telemetry and the frame trace to dump what they
+ * collected: each of them remembers the last request it handled. */
+void
+cube_dump_signal_init(void)
+{
+	static bool installed;
+	struct sigaction sigusr1;
+
+	if (installed)
+		return;
+
+	sigusr1.sa_handler = signal_dump;
+	sigemptyset(&sigusr1.sa_mask);
+	sigusr1.sa_flags = SA_RESTART;
+	sigaction(SIGUSR1, &sigusr1, NULL);
+
+	installed = true;
+}
+
+unsigned
+cube_dump_requests(void)
+{
+	return dump_requests;
+}
+
 void
 fini_egl(struct display *d)
 {
@@ -228,6 +369,279 @@ fini_egl(struct display *d)
 	eglReleaseThread();
 }
 
+EGLint
+window_buffer_age(struct window *w)
+{
+	struct display *d = w->display;
+	EGLint buffer_age = 0;
+
+	/* EGL_BUFFER_AGE_KHR (EGL_KHR_partial_update) is the same query */
+	if (d->egl.swap_buffers_with_damage || d->egl.set_damage_region)
+		eglQuerySurface(d->egl.dpy, w->egl_surface,
+				EGL_BUFFER_AGE_EXT, &buffer_age);
+
+	return buffer_age;
+}
+
+static void
+frame_done(void *data, struct wl_callback *callback, uint32_t time)
+{
+	struct window *w = data;
+
+	(void)time;
+
+	assert(w->callback == callback);
+	w->callback = NULL;
+	wl_callback_destroy(callback);
+}
+
+static const struct wl_callback_listener frame_listener = {
+	frame_done
+};
+
+void
+cube_damage(struct window *w, ESMatrix4x4 *mvp)
+{
+	ESVec3 corner, ndc;
+	ESVec4 clipped;
+	ESVec2 win;
+	float x0 = w->geometry.width, y0 = w->geometry.height, x1 = 0, y1 = 0;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		corner.vec3[0] = i & 1 ? 1.0f : -1.0f;
+		corner.vec3[1] = i & 2 ? 1.0f : -1.0f;
+		corner.vec3[2] = i & 4 ? 1.0f : -1.0f;
+
+		esMatrixClipped(&clipped, mvp, &corner);
+		esMatrixNDC(&ndc, &clipped);
+		esMatrixWindow(&win, &ndc, w->geometry.width,
+			       w->geometry.height);
+
+		if (win.vec2[0] < x0)
+			x0 = win.vec2[0];
+		if (win.vec2[0] > x1)
+			x1 = win.vec2[0];
+		if (win.vec2[1] < y0)
+			y0 = win.vec2[1];
+		if (win.vec2[1] > y1)
+			y1 = win.vec2[1];
+	}
+
+	/* whole pixels covering the edges, inside the window */
+	x0 = floorf(x0) - 1;
+	y0 = floorf(y0) - 1;
+	x1 = ceilf(x1) + 1;
+	y1 = ceilf(y1) + 1;
+	if (x0 < 0)
+		x0 = 0;
+	if (y0 < 0)
+		y0 = 0;
+	if (x1 > w->geometry.width)
+		x1 = w->geometry.width;
+	if (y1 > w->geometry.height)
+		y1 = w->geometry.height;
+
+	w->cube_box[0] = x0;
+	w->cube_box[1] = y0;
+	w->cube_box[2] = x1 > x0 ? x1 - x0 : 0;
+	w->cube_box[3] = y1 > y0 ? y1 - y0 : 0;
+}
+
+/* Remember what frame changed on screen: its cube box or, if it was not
+ * drawn partially, the whole window. */
+static void
+window_damage_push(struct window *w, bool partial)
+{
+	EGLint *rect = w->damage[w->damage_next];
+
+	if (partial) {
+		memcpy(rect, w->cube_box, 4 * sizeof(EGLint));
+	} else {
+		rect[0] = 0;
+		rect[1] = 0;
+		rect[2] = w->geometry.width;
+		rect[3] = w->geometry.height;
+	}
+
+	w->damage_next = (w->damage_next + 1) % MAX_BUFFER_AGE;
+	if (w->damage_count < MAX_BUFFER_AGE)
+		w->damage_count++;
+}
+
+int
+window_damage_region(struct window *w, EGLint buffer_age,
+		     EGLint rects[4 * (MAX_BUFFER_AGE + 1)])
+{
+	int i;
+
+	if (buffer_age <= 0 || buffer_age > MAX_BUFFER_AGE ||
+	    buffer_age > (int)w->damage_count)
+		return 0;
+
+	memcpy(rects, w->cube_box, 4 * sizeof(EGLint));
+	for (i = 1; i <= buffer_age; i++)
+		memcpy(&rects[4 * i],
+		       w->damage[(w->damage_next + MAX_BUFFER_AGE - i) %
+				 MAX_BUFFER_AGE],
+		       4 * sizeof(EGLint));
+
+	return buffer_age + 1;
+}
+
+void
+window_begin_frame(struct window *w, EGLint buffer_age, bool partial)
+{
+	struct display *d = w->display;
+	EGLint rects[4 * (MAX_BUFFER_AGE + 1)], box[4];
+	int i, n = 0;
+
+	if (partial && !w->headless)
+		n = window_damage_region(w, buffer_age, rects);
+	if (!n) {
+		glDisable(GL_SCISSOR_TEST);
+		return;
+	}
+
+	/* a single box: the scissor cannot do better, and nothing may be
+	 * drawn outside of the damage region */
+	memcpy(box, rects, sizeof(box));
+	for (i = 1; i < n; i++) {
+		EGLint *r = &rects[4 * i];
+		EGLint x1 = box[0] + box[2], y1 = box[1] + box[3];
+
+		if (!r[2] || !r[3])
+			continue;
+		if (r[0] + r[2] > x1)
+			x1 = r[0] + r[2];
+		if (r[1] + r[3] > y1)
+			y1 = r[1] + r[3];
+		if (r[0] < box[0])
+			box[0] = r[0];
+		if (r[1] < box[1])
+			box[1] = r[1];
+		box[2] = x1 - box[0];
+		box[3] = y1 - box[1];
+	}
+
+	if (d->egl.set_damage_region)
+		d->egl.set_damage_region(d->egl.dpy, w->egl_surface, box, 1);
+
+	glEnable(GL_SCISSOR_TEST);
+	glScissor(box[0], box[1], box[2], box[3]);
+}
+
+void
+window_present(struct window *w, EGLint buffer_age, bool partial)
+{
+	struct display *d = w->display;
+	struct wl_region *region;
+	EGLint rects[4 * (MAX_BUFFER_AGE + 1)];
+	int i, n = 0;
+
+	/* nobody to show the frame to, just wait for it to be rendered */
+	if (w->headless) {
+		glFinish();
+		startup_trace_swapped();
+		startup_trace_finish();
+		return;
+	}
+
+	/* the next frame is drawn when the compositor is done with this one
+	 * (see the main loop), the request goes with the swap commit */
+	if (w->frame_sync) {
+		w->callback = wl_surface_frame(w->surface);
+		wl_callback_add_listener(w->callback, &frame_listener, w);
+	}
+	presentation_feedback(w->surface);
+
+	if (w->opaque) {
+		region = wl_compositor_create_region(d->compositor);
+		wl_region_add(region, 0, 0,
+			      w->geometry.width,
+			      w->geometry.height);
+		wl_surface_set_opaque_region(w->surface, region);
+		wl_region_destroy(region);
+	} else {
+		wl_surface_set_opaque_region(w->surface, NULL);
+	}
+
+	if (partial && d->egl.swap_buffers_with_damage)
+		n = window_damage_region(w, buffer_age, rects);
+
+	if (n) {
+		d->egl.swap_buffers_with_damage(d->egl.dpy, w->egl_surface,
+						rects, n);
+
+		for (i = 0; i < n; i++) {
+#ifdef DAMAGE_DEBUG
+			printf("[%i] {x,y}[w x h]: {%i,%i}[%i x %i]\n", i,
+			       rects[4 * i], rects[4 * i + 1],
+			       rects[4 * i + 2], rects[4 * i + 3]);
+#endif
+			/* EGL rectangles start from the bottom */
+			wl_surface_damage(w->surface, rects[4 * i],
+					  w->geometry.height - rects[4 * i + 1] -
+					  rects[4 * i + 3],
+					  rects[4 * i + 2], rects[4 * i + 3]);
+		}
+		wl_surface_commit(w->surface);
+	} else {
+		eglSwapBuffers(d->egl.dpy, w->egl_surface);
+	}
+	startup_trace_swapped();
+	/* without wp_presentation, nothing tells when it is on screen */
+	if (!d->presentation)
+		startup_trace_finish();
+
+	window_damage_push(w, partial);
+}
+
+int
+init_offscreen(struct window *w)
+{
+	GLenum status;
+
+	glGenTextures(1, &w->offscreen_tex);
+	glBindTexture(GL_TEXTURE_2D, w->offscreen_tex);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA,
+		     w->geometry.width, w->geometry.height, 0,
+		     GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	glGenFramebuffers(1, &w->offscreen_fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, w->offscreen_fbo);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+			       GL_TEXTURE_2D, w->offscreen_tex, 0);
+
+	status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+	if (status != GL_FRAMEBUFFER_COMPLETE) {
+		fprintf(stderr, "offscreen framebuffer incomplete: 0x%x\n",
+			status);
+		fini_offscreen(w);
+		return -1;
+	}
+
+	w->headless = true;
+	compute_pitch(w);
+
+	return 0;
+}
+
+void
+fini_offscreen(struct window *w)
+{
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	if (w->offscreen_fbo)
+		glDeleteFramebuffers(1, &w->offscreen_fbo);
+	if (w->offscreen_tex)
+		glDeleteTextures(1, &w->offscreen_tex);
+	w->offscreen_fbo = 0;
+	w->offscreen_tex = 0;
+}
+
 int
 init_supported_modifiers_for_egl(struct display *d)
 {
@@ -301,14 +715,17 @@ error:
 int
 int_gbm(struct display *d, char const* drm_render_node)
 {
+	startup_trace_begin("GBM open");
 	d->gbm.drm_fd = open(drm_render_node, O_RDWR);
 	if (d->gbm.drm_fd < 0) {
+		startup_trace_end();
 		fprintf(stderr, "Failed to open drm render node %s\n",
 			drm_render_node);
 		return -1;
 	}
 
 	d->gbm.dev = gbm_create_device(d->gbm.drm_fd);
+	startup_trace_end();
 	if (d->gbm.dev == NULL) {
 		fprintf(stderr, "Failed to create gbm device\n");
 		return -1;
@@ -320,8 +737,19 @@ int_gbm(struct display *d, char const* drm_render_node)
 int create_program(const char *vs_src, const char *fs_src)
 {
 	GLuint vertex_shader, fragment_shader, program;
+	uint64_t start = startup_trace_now();
 	GLint ret;
 
+	program = program_cache_load(vs_src, fs_src);
+	if (program) {
+		startup_trace_add("program cache load", start,
+				  startup_trace_now());
+		return program;
+	}
+
+	program = glCreateProgram();
+	program_cache_build(program, vs_src, fs_src);
+
 	vertex_shader = glCreateShader(GL_VERTEX_SHADER);
 
 	glShaderSource(vertex_shader, 1, &vs_src, NULL);
@@ -363,18 +791,23 @@ int create_program(const char *vs_src, const char *fs_src)
 		return -1;
 	}
 
-	program = glCreateProgram();
-
 	glAttachShader(program, vertex_shader);
 	glAttachShader(program, fragment_shader);
 
+	startup_trace_add("shader compile", start, startup_trace_now());
+
 	return program;
 }
 
 int link_program(unsigned program)
 {
+	uint64_t start = startup_trace_now();
 	GLint ret;
 
+	/* a cached binary is already linked */
+	if (program_cache_loaded(program))
+		return 0;
+
 	glLinkProgram(program);
 
 	glGetProgramiv(program, GL_LINK_STATUS, &ret);
@@ -393,9 +826,115 @@ int link_program(unsigned program)
 		return -1;
 	}
 
+	program_cache_store(program);
+	startup_trace_add("program link", start, startup_trace_now());
+
 	return 0;
 }
 
+/* Start building a program without waiting for the compiler: nothing is
+ * queried before the link has completed. */
+static GLuint
+start_build(const char *vs_src, const char *fs_src)
+{
+	GLuint program, shader;
+
+	program = glCreateProgram();
+	program_cache_build(program, vs_src, fs_src);
+
+	shader = glCreateShader(GL_VERTEX_SHADER);
+	glShaderSource(shader, 1, &vs_src, NULL);
+	glCompileShader(shader);
+	glAttachShader(program, shader);
+	/* only flagged, it is deleted with the program */
+	glDeleteShader(shader);
+
+	shader = glCreateShader(GL_FRAGMENT_SHADER);
+	glShaderSource(shader, 1, &fs_src, NULL);
+	glCompileShader(shader);
+	glAttachShader(program, shader);
+	glDeleteShader(shader);
+
+	cube_bind_attrib_locations(program);
+	glLinkProgram(program);
+
+	return program;
+}
+
+void
+deferred_program_start(struct deferred_program *p, const struct _egl *egl,
+		       const char *vs_src, const char *fs_src)
+{
+	memset(p, 0, sizeof(*p));
+	p->vs_src = vs_src;
+	p->fs_src = fs_src;
+
+	/* a cached binary is already linked: nothing to build */
+	p->program = program_cache_load(vs_src, fs_src);
+	if (p->program && program_cache_loaded(p->program)) {
+		p->ready = true;
+		return;
+	}
+
+	if (egl->has_parallel_shader_compile) {
+		p->start = startup_trace_now();
+		p->program = start_build(vs_src, fs_src);
+	}
+}
+
+bool
+deferred_program_poll(struct deferred_program *p, bool build)
+{
+	GLint ret = 0;
+	char *log;
+
+	if (p->ready || p->failed)
+		return p->ready;
+
+	if (!p->program) {
+		if (!build)
+			return false;
+		p->start = startup_trace_now();
+		p->program = start_build(p->vs_src, p->fs_src);
+	}
+
+	/* the link status is the one query that waits for the compiler */
+	if (!build)
+		glGetProgramiv(p->program, GL_COMPLETION_STATUS_KHR, &ret);
+	if (!build && !ret)
+		return false;
+
+	glGetProgramiv(p->program, GL_LINK_STATUS, &ret);
+	if (!ret) {
+		printf("program linking failed!:\n");
+		glGetProgramiv(p->program, GL_INFO_LOG_LENGTH, &ret);
+		if (ret > 1) {
+			log = malloc(ret);
+			glGetProgramInfoLog(p->program, ret, NULL, log);
+			printf("%s", log);
+			free(log);
+		}
+		p->failed = true;
+		return false;
+	}
+
+	program_cache_store(p->program);
+	p->ready = true;
+	startup_trace_add("deferred program build", p->start,
+			  startup_trace_now());
+
+	return true;
+}
+
+void
+deferred_program_fini(struct deferred_program *p)
+{
+	if (p->program)
+		glDeleteProgram(p->program);
+
+	memset(p, 0, sizeof(*p));
+}
+
 void compute_pitch(struct window *w) {
 	ESVec3  origin = {  { 0.0f, 0.0f,  0.0f } };
 	ESMatrix4x4 modelview, projection, modelviewprojection;
@@ -433,12 +972,6 @@ void compute_pitch(struct window *w) {
 
 	printf("x pitch : %f\nx pitch : %f\n", w->pitch.x, w->pitch.y);
 
-#ifdef DAMAGE_DEBUG
-	w->corner.x = w->geometry.width  * DAMAGE_X_PERCENT;
-	w->corner.y = w->geometry.height * DAMAGE_Y_PERCENT;
-	w->rect.x   = w->geometry.width  * DAMAGE_W_PERCENT;
-	w->rect.y   = w->geometry.height * DAMAGE_H_PERCENT;
-#endif
 }
 
 #ifdef HAVE_GST
@@ -40,12 +40,6 @@
 #define FRUSTRUM_NEAR_Z    5.0f
 #define FRUSTRUM_FAR_Z     10.0f
 
-/* pre-computed value : worse case cube */
-#define DAMAGE_X_PERCENT   (32.0f / 100.0f)
-#define DAMAGE_Y_PERCENT   (19.0f / 100.0f)
-#define DAMAGE_W_PERCENT   (36.0f / 100.0f)
-#define DAMAGE_H_PERCENT   (62.0f / 100.0f)
-
 #define CUBE_STR_HELPER(x) #x
 #define CUBE_STR(x) CUBE_STR_HELPER(x)
 
@@ -95,27 +89,109 @@ static inline int __egl_check(void *ptr, const char *name)
 int  init_egl(struct display *d, struct window *w);
 void fini_egl(struct display *d);
 
+void cube_dump_signal_init(void);
+unsigned cube_dump_requests(void);
+
+/* back buffer age for window_present(), 0 when unknown */
+EGLint window_buffer_age(struct window *w);
+/* screen bounding box of the cube drawn with 'mvp', the area damaged by
+ * window_present() */
+void cube_damage(struct window *w, ESMatrix4x4 *mvp);
+/* the rectangles (x, y, width, height from the bottom left corner) that
+ * differ between the back buffer of age 'buffer_age' and the frame being
+ * drawn; returns their number, 0 if the whole buffer must be redrawn */
+int  window_damage_region(struct window *w, EGLint buffer_age,
+			  EGLint rects[4 * (MAX_BUFFER_AGE + 1)]);
+/* before the first draw of a frame: limit the rendering to the region
+ * returned by window_damage_region(), with the scissor and the
+ * EGL_KHR_partial_update damage region, when 'partial' is set */
+void window_begin_frame(struct window *w, EGLint buffer_age, bool partial);
+/* swap the frame just drawn, damaging only the cube area when 'partial'
+ * is set and the back buffer content is known */
+void window_present(struct window *w, EGLint buffer_age, bool partial);
+
+/* headless rendering: draw into a framebuffer object the size of
+ * w->geometry instead of a window surface */
+int  init_offscreen(struct window *w);
+void fini_offscreen(struct window *w);
+
 int  init_supported_modifiers_for_egl(struct display *d);
 int  int_gbm(struct display *d, char const* drm_render_node);
 
 int  link_program(unsigned program);
 int  create_program(const char *vs_src, const char *fs_src);
 
+/* A program that is not needed for the first frame: with
+ * GL_KHR_parallel_shader_compile the driver builds it in the background
+ * from deferred_program_start(), else it is only built when
+ * deferred_program_poll() is told to, once the first frame is on
+ * screen. The attribute locations are the ones of
+ * cube_bind_attrib_locations().
+ */
+struct deferred_program {
+	const char *vs_src, *fs_src;
+	GLuint program;
+	bool ready, failed;
+	uint64_t start;		/* startup_trace_now() when the build began */
+};
+
+void deferred_program_start(struct deferred_program *p,
+			    const struct _egl *egl,
+			    const char *vs_src, const char *fs_src);
+/* true once p->program is linked and can be used; with 'build' set, the
+ * program is finished now if it is not already, blocking if needed */
+bool deferred_program_poll(struct deferred_program *p, bool build);
+/* delete p->program, built or not */
+void deferred_program_fini(struct deferred_program *p);
+
 void init_cube_smooth(struct window *window);
 void init_cube_tex(struct window *window);
+/* free what init_cube_smooth() and init_cube_tex() created */
+void fini_cube_smooth(struct window *window);
+void fini_cube_tex(struct window *window);
 
 void compute_pitch(struct window *window);
 
 #ifdef HAVE_GST
 struct decoder;
+
+/* video_init() flags: */
+#define VIDEO_FLAG_LOOP     (1 << 0) /* loop the file seamlessly */
+#define VIDEO_FLAG_PREROLL  (1 << 1) /* wait for video_play() to start */
+
 struct decoder * video_init(const struct _egl *egl,
 							const struct _gbm *gbm,
 							const char *filename,
-							char *fps);
-EGLImage video_frame(struct decoder *dec);
+							char *fps,
+							int width, int height,
+							unsigned flags);
+void video_play(struct decoder *dec);
+/* 'fd' (an eventfd) is written to whenever a new frame or the end of the
+ * stream is available, -1 to stop */
+void video_set_wakeup_fd(struct decoder *dec, int fd);
+/* 'target' is the predicted presentation time of the frame being drawn
+ * (CLOCK_MONOTONIC, in ns), 0 if unknown */
+EGLImage video_frame(struct decoder *dec, uint64_t target);
+/* changes whenever video_frame() returns a new frame */
+unsigned video_frame_seq(struct decoder *dec);
+/* size of the frame of video_frame(), 0 x 0 before the first one */
+void video_frame_size(struct decoder *dec, int *width, int *height);
+/* to be called once the draws sampling the current frame are issued: the
+ * resources of a frame are released when the fence created here signals */
+void video_frame_done(struct decoder *dec);
+bool video_eos(struct decoder *dec);
 void video_deinit(struct decoder *dec);
+/* same as video_deinit() but the pipeline is stopped in the background */
+void video_deinit_async(struct decoder *dec);
+/* wait for the pipelines stopped by video_deinit_async(): their buffers
+ * may still hold EGLImages and GBM BOs, to be done before the EGL and
+ * GBM teardown */
+void video_wait_teardown(void);
 void init_cube_video(struct window *w,
 					 const char *filenames);
+/* stop the decoders and free what init_cube_video() created: before the
+ * EGL and GBM teardown, and before the wakeup fd is closed */
+void fini_cube_video(struct window *w);
 
 void cube_next_shader(struct window *w);
 #else
@@ -124,7 +200,9 @@ static inline void init_cube_video(struct window *w,
 {
 	printf("no GStreamer support!\n");
 }
+static inline void fini_cube_video(struct window *w) {};
 static inline void cube_next_shader(struct window *w) {};
+static inline void video_wait_teardown(void) {};
 #endif
 
 #endif
@@ -0,0 +1,318 @@
+/*
+ * Copyright (c) 2019 STMicroelectronics. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cube-common.h"
+#include "cube-grid.h"
+#include "cube-mesh.h"
+#include "shared/helpers.h"
+
+/* distance between the centers of two cubes of the grid, in cube sizes:
+ * a cube spins in a sphere of radius sqrt(3) < GRID_CELL / 2, so that
+ * neighbours never overlap and face culling is enough to draw them */
+#define GRID_CELL		4.0f
+/* half of the visible width at Z_TRANSLATION that the grid covers */
+#define GRID_HALF_WIDTH		4.0f
+
+/* the vertex shaders built for instancing, see cube_grid_vertex_shader() */
+#define GRID_MAX_SHADERS	8
+
+/* per-instance model matrix: its first 3 rows, the last being 0, 0, 0, 1 */
+struct grid_model {
+	GLfloat row[3][4];
+};
+
+static struct {
+	int cols, rows, count;
+	ESMatrix4x4 view, viewprojection;
+
+	/* instanced */
+	GLuint vbo;
+	struct grid_model *models;
+
+	/* batched */
+	ESMatrix4x4 *modelview, *modelviewprojection;
+	GLfloat (*normal)[9];
+
+	struct {
+		const char *src, *instanced;
+	} shaders[GRID_MAX_SHADERS];
+} grid;
+
+static bool
+grid_instanced(const struct window *w)
+{
+	return cube_grid_enabled(w) && w->display->egl.has_instanced_arrays;
+}
+
+const char *
+cube_grid_vertex_shader(const struct window *w, const char *vs_src)
+{
+	static const char define[] = "#define CUBE_INSTANCED\n";
+	char *src;
+	int i;
+
+	if (!grid_instanced(w))
+		return vs_src;
+
+	for (i = 0; i < GRID_MAX_SHADERS && grid.shaders[i].src; i++)
+		if (grid.shaders[i].src == vs_src)
+			return grid.shaders[i].instanced;
+	if (i == GRID_MAX_SHADERS)
+		return vs_src;
+
+	src = malloc(sizeof(define) + strlen(vs_src));
+	if (!src)
+		return vs_src;
+	strcpy(src, define);
+	strcat(src, vs_src);
+
+	grid.shaders[i].src = vs_src;
+	grid.shaders[i].instanced = src;
+
+	return src;
+}
+
+static int
+grid_resize(struct window *w, int count)
+{
+	free(grid.models);
+	free(grid.modelview);
+	free(grid.modelviewprojection);
+	free(grid.normal);
+	grid.models = NULL;
+	grid.modelview = grid.modelviewprojection = NULL;
+	grid.normal = NULL;
+	grid.count = 0;
+
+	if (grid_instanced(w)) {
+		grid.models = calloc(count, sizeof(*grid.models));
+		if (!grid.models)
+			return -1;
+		if (!grid.vbo)
+			glGenBuffers(1, &grid.vbo);
+	} else {
+		grid.modelview = calloc(count, sizeof(*grid.modelview));
+		grid.modelviewprojection =
+			calloc(count, sizeof(*grid.modelviewprojection));
+		grid.normal = calloc(count, sizeof(*grid.normal));
+		if (!grid.modelview || !grid.modelviewprojection ||
+		    !grid.normal)
+			return -1;
+	}
+
+	grid.count = count;
+	printf("Drawing %dx%d cubes, %s\n", w->grid_cols, w->grid_rows,
+	       grid_instanced(w) ? "instanced" : "batched");
+
+	return 0;
+}
+
+/* the model matrix of cube 'i': each cube has its own phase and the odd
+ * ones spin the other way around Y. The angles stay multiples of the
+ * single cube ones, FRAME_CUMUL_RESET_VALUE still applies. */
+static void
+grid_model(struct window *w, int i, ESMatrix4x4 *model)
+{
+	int col = i % w->grid_cols, row = i / w->grid_cols;
+	GLfloat frame = (GLfloat)w->frames_cumul;
+
+	esMatrixLoadIdentity(model);
+	esTranslate(model, GRID_CELL * (col - (w->grid_cols - 1) / 2.0f),
+		    GRID_CELL * ((w->grid_rows - 1) / 2.0f - row), 0.0f);
+
+	esRotate(model, CUBE_X_INIT_ANGLE + (i * 37) % 360 +
+		 CUBE_X_PACE * frame, 1.0f, 0.0f, 0.0f);
+	esRotate(model, CUBE_Y_INIT_ANGLE + (i * 71) % 360 +
+		 (i & 1 ? -1 : 1) * CUBE_Y_PACE * frame, 0.0f, 1.0f, 0.0f);
+	esRotate(model, CUBE_Z_INIT_ANGLE + (i * 113) % 360 +
+		 CUBE_Z_PACE * frame, 0.0f, 0.0f, 1.0f);
+}
+
+void
+cube_grid_update(struct window *w, ESMatrix4x4 *projection)
+{
+	GLfloat aspect = (GLfloat)w->geometry.height / w->geometry.width;
+	GLfloat scale, extent_x, extent_y;
+	ESMatrix4x4 model, box;
+	int i, j, count;
+
+	count = w->grid_cols * w->grid_rows;
+	if (grid.cols != w->grid_cols || grid.rows != w->grid_rows) {
+		grid.cols = w->grid_cols;
+		grid.rows = w->grid_rows;
+		if (grid_resize(w, count)) {
+			printf("cannot allocate %d cubes\n", count);
+			return;
+		}
+	}
+
+	/* fit the grid in the view, the cubes never being bigger than the
+	 * single one */
+	scale = MIN(2.0f * GRID_HALF_WIDTH / w->grid_cols,
+		    2.0f * GRID_HALF_WIDTH * aspect / w->grid_rows) / GRID_CELL;
+	scale = MIN(scale, 1.0f);
+
+	esMatrixLoadIdentity(&grid.view);
+	esTranslate(&grid.view, w->move.x / w->pitch.x,
+		    -w->move.y / w->pitch.y, -Z_TRANSLATION);
+	esScale(&grid.view, scale, scale, scale);
+	esMatrixMultiply(&grid.viewprojection, &grid.view, projection);
+
+	/* the whole grid is damaged, corners included */
+	extent_x = GRID_CELL * (w->grid_cols - 1) / 2.0f + sqrtf(3.0f);
+	extent_y = GRID_CELL * (w->grid_rows - 1) / 2.0f + sqrtf(3.0f);
+	esMatrixLoadIdentity(&box);
+	esScale(&box, extent_x, extent_y, sqrtf(3.0f));
+	esMatrixMultiply(&model, &box, &grid.viewprojection);
+	cube_damage(w, &model);
+
+	for (i = 0; i < grid.count; i++) {
+		grid_model(w, i, &model);
+
+		if (grid.models) {
+			for (j = 0; j < 3; j++) {
+				grid.models[i].row[j][0] = model.m4x4[0][j];
+				grid.models[i].row[j][1] = model.m4x4[1][j];
+				grid.models[i].row[j][2] = model.m4x4[2][j];
+				grid.models[i].row[j][3] = model.m4x4[3][j];
+			}
+			continue;
+		}
+
+		esMatrixMultiply(&grid.modelview[i], &model, &grid.view);
+		esMatrixMultiply(&grid.modelviewprojection[i], &model,
+				 &grid.viewprojection);
+		/* the model matrix is a rotation and a translation: the
+		 * normals are only rotated */
+		for (j = 0; j < 9; j++)
+			grid.normal[i][j] = model.m4x4[j / 3][j % 3];
+	}
+
+	if (grid.models) {
+		/* orphan the buffer of the previous frame, still in use */
+		glBindBuffer(GL_ARRAY_BUFFER, grid.vbo);
+		glBufferData(GL_ARRAY_BUFFER,
+			     grid.count * sizeof(*grid.models), NULL,
+			     GL_STREAM_DRAW);
+		glBufferSubData(GL_ARRAY_BUFFER, 0,
+				grid.count * sizeof(*grid.models),
+				grid.models);
+	}
+}
+
+static void
+draw_instanced(struct window *w, GLint modelview, GLint modelviewprojection,
+	       GLint normal, int first, int count)
+{
+	static const GLfloat identity[9] = { 1, 0, 0, 0, 1, 0, 0, 0, 1 };
+	struct _egl *egl = &w->display->egl;
+	GLuint i;
+
+	glUniformMatrix4fv(modelview, 1, GL_FALSE, &grid.view.m4x4[0][0]);
+	glUniformMatrix4fv(modelviewprojection, 1, GL_FALSE,
+			   &grid.viewprojection.m4x4[0][0]);
+	/* the view has no rotation, and its scale must not dim the light */
+	glUniformMatrix3fv(normal, 1, GL_FALSE, identity);
+
+	/* part of the vertex array object of the mesh, if any */
+	glBindBuffer(GL_ARRAY_BUFFER, grid.vbo);
+	for (i = 0; i < 3; i++) {
+		glVertexAttribPointer(CUBE_ATTR_MODEL + i, 4, GL_FLOAT,
+				      GL_FALSE, sizeof(struct grid_model),
+				      (const GLvoid *)(i * 4 *
+						       sizeof(GLfloat)));
+		glEnableVertexAttribArray(CUBE_ATTR_MODEL + i);
+		egl->glVertexAttribDivisorEXT(CUBE_ATTR_MODEL + i, 1);
+	}
+
+	egl->glDrawElementsInstancedEXT(GL_TRIANGLES, count * 6,
+					GL_UNSIGNED_BYTE,
+					(const GLvoid *)(intptr_t)(first * 6),
+					grid.count);
+
+	/* the other draws read the model matrix from the uniforms */
+	for (i = 0; i < 3; i++) {
+		egl->glVertexAttribDivisorEXT(CUBE_ATTR_MODEL + i, 0);
+		glDisableVertexAttribArray(CUBE_ATTR_MODEL + i);
+	}
+}
+
+void
+cube_grid_draw(struct window *w, GLint modelview, GLint modelviewprojection,
+	       GLint normal, int first, int count)
+{
+	int i;
+
+	if (!cube_grid_enabled(w) || !grid.count) {
+		cube_mesh_draw(first, count);
+		return;
+	}
+
+	if (grid.models) {
+		draw_instanced(w, modelview, modelviewprojection, normal,
+			       first, count);
+		return;
+	}
+
+	for (i = 0; i < grid.count; i++) {
+		glUniformMatrix4fv(modelview, 1, GL_FALSE,
+				   &grid.modelview[i].m4x4[0][0]);
+		glUniformMatrix4fv(modelviewprojection, 1, GL_FALSE,
+				   &grid.modelviewprojection[i].m4x4[0][0]);
+		glUniformMatrix3fv(normal, 1, GL_FALSE, grid.normal[i]);
+		cube_mesh_draw(first, count);
+	}
+}
+
+void
+cube_grid_fini(void)
+{
+	int i;
+
+	for (i = 0; i < GRID_MAX_SHADERS && grid.shaders[i].src; i++) {
+		free((char *)grid.shaders[i].instanced);
+		grid.shaders[i].src = grid.shaders[i].instanced = NULL;
+	}
+
+	free(grid.models);
+	free(grid.modelview);
+	free(grid.modelviewprojection);
+	free(grid.normal);
+	if (grid.vbo)
+		glDeleteBuffers(1, &grid.vbo);
+
+	grid.models = NULL;
+	grid.modelview = grid.modelviewprojection = NULL;
+	grid.normal = NULL;
+	grid.vbo = 0;
+	grid.count = 0;
+	/* for cube_grid_update() to allocate them again */
+	grid.cols = grid.rows = 0;
+}
@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2019 STMicroelectronics. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef CUBE_GRID_H
+#define CUBE_GRID_H
+
+#include "simple-st-egl.h"
+#include "esUtil.h"
+
+/* Stress mode: w->grid_cols x w->grid_rows independently rotating cubes
+ * instead of the single one, drawn with the programs of the current mode.
+ * With GL_EXT_instanced_arrays or GL_ANGLE_instanced_arrays, every draw
+ * covers all the cubes, the model matrices being per-instance attributes
+ * streamed each frame; else the draws are repeated per cube with only the
+ * transform uniforms changing in between.
+ */
+
+/* The transforms of the vertex shaders: cube_position() and cube_normal()
+ * apply the model matrix of the instance, if any, to in_position and
+ * in_normal, before the modelview and normal matrices. To be put before
+ * the main() of the vertex shaders drawn by cube_grid_draw().
+ */
+#define CUBE_VERTEX_TRANSFORMS						\
+	"#ifdef CUBE_INSTANCED                             \n"	\
+	"attribute vec4 in_model0;                         \n"	\
+	"attribute vec4 in_model1;                         \n"	\
+	"attribute vec4 in_model2;                         \n"	\
+	"                                                  \n"	\
+	"vec4 cube_position(vec4 p)                        \n"	\
+	"{                                                 \n"	\
+	"    return vec4(dot(in_model0, p),                \n"	\
+	"                dot(in_model1, p),                \n"	\
+	"                dot(in_model2, p), 1.0);          \n"	\
+	"}                                                 \n"	\
+	"                                                  \n"	\
+	"vec3 cube_normal(vec3 n)                          \n"	\
+	"{                                                 \n"	\
+	"    return vec3(dot(in_model0.xyz, n),            \n"	\
+	"                dot(in_model1.xyz, n),            \n"	\
+	"                dot(in_model2.xyz, n));           \n"	\
+	"}                                                 \n"	\
+	"#else                                             \n"	\
+	"#define cube_position(p) (p)                      \n"	\
+	"#define cube_normal(n) (n)                        \n"	\
+	"#endif                                            \n"
+
+static inline bool cube_grid_enabled(const struct window *w)
+{
+	return w->grid_cols > 0;
+}
+
+/* 'vs_src' as built for the current grid mode; the string returned lives
+ * until cube_grid_fini() */
+const char *cube_grid_vertex_shader(const struct window *w,
+				    const char *vs_src);
+
+/* Compute the transforms of every cube for this frame and damage the
+ * area covered by the grid, in place of cube_damage(). */
+void cube_grid_update(struct window *w, ESMatrix4x4 *projection);
+
+/* cube_mesh_draw() of faces 'first' to 'first + count - 1' of every cube
+ * with the current program, whose transform uniforms are at 'modelview',
+ * 'modelviewprojection' and 'normal'. Without grid, the single cube is
+ * drawn with the uniforms already set. */
+void cube_grid_draw(struct window *w, GLint modelview,
+		    GLint modelviewprojection, GLint normal,
+		    int first, int count);
+
+void cube_grid_fini(void);
+
+#endif
@@ -0,0 +1,269 @@
+/*
+ * Copyright (c) 2019 STMicroelectronics. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "cube-mesh.h"
+
+#define CUBE_VERTICES		(CUBE_FACES * CUBE_FACE_VERTICES)
+#define CUBE_INDICES		(CUBE_FACES * 6)
+
+#define ARRAY_SIZE(a)		(sizeof(a) / sizeof((a)[0]))
+
+/* 16 bytes per vertex instead of up to 36 with planar floats. The
+ * positions and normals only have -1, 0 and +1 components, which integer
+ * attributes convert to floats exactly. */
+struct cube_vertex {
+	GLbyte   position[4];	/* x, y, z, padding */
+	GLbyte   normal[4];	/* x, y, z, padding */
+	GLushort texcoord[2];	/* normalized */
+	GLubyte  color[3];	/* normalized */
+	GLubyte  effect;
+};
+
+static const GLbyte positions[CUBE_VERTICES][3] = {
+	/* front */
+	{ -1, -1, +1 }, { +1, -1, +1 }, { -1, +1, +1 }, { +1, +1, +1 },
+	/* back */
+	{ +1, -1, -1 }, { -1, -1, -1 }, { +1, +1, -1 }, { -1, +1, -1 },
+	/* right */
+	{ +1, -1, +1 }, { +1, -1, -1 }, { +1, +1, +1 }, { +1, +1, -1 },
+	/* left */
+	{ -1, -1, -1 }, { -1, -1, +1 }, { -1, +1, -1 }, { -1, +1, +1 },
+	/* top */
+	{ -1, +1, +1 }, { +1, +1, +1 }, { -1, +1, -1 }, { +1, +1, -1 },
+	/* bottom */
+	{ -1, -1, -1 }, { +1, -1, -1 }, { -1, -1, +1 }, { +1, -1, +1 },
+};
+
+static const GLbyte normals[CUBE_FACES][3] = {
+	{  0,  0, +1 },	/* forward */
+	{  0,  0, -1 },	/* backward */
+	{ +1,  0,  0 },	/* right */
+	{ -1,  0,  0 },	/* left */
+	{  0, +1,  0 },	/* up */
+	{  0, -1,  0 },	/* down */
+};
+
+/* the triangle strip of a face as two triangles, same winding */
+static const GLubyte face_indices[6] = { 0, 1, 2, 2, 1, 3 };
+
+/* mesh whose attributes are set up, when vertex array objects are not
+ * supported */
+static const struct cube_mesh *bound_mesh;
+
+static GLushort
+unorm16(GLfloat f)
+{
+	return (GLushort)(f * 65535.0f + 0.5f);
+}
+
+static GLubyte
+unorm8(GLfloat f)
+{
+	return (GLubyte)(f * 255.0f + 0.5f);
+}
+
+static void
+setup_attribs(const struct cube_mesh *mesh)
+{
+	const GLsizei stride = sizeof(struct cube_vertex);
+	GLuint attr;
+
+	glBindBuffer(GL_ARRAY_BUFFER, mesh->vbo);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->ibo);
+
+	glVertexAttribPointer(CUBE_ATTR_POSITION, 3, GL_BYTE, GL_FALSE, stride,
+			      (const GLvoid *)offsetof(struct cube_vertex,
+						       position));
+	glEnableVertexAttribArray(CUBE_ATTR_POSITION);
+	glVertexAttribPointer(CUBE_ATTR_NORMAL, 3, GL_BYTE, GL_FALSE, stride,
+			      (const GLvoid *)offsetof(struct cube_vertex,
+						       normal));
+	glEnableVertexAttribArray(CUBE_ATTR_NORMAL);
+
+	glVertexAttribPointer(CUBE_ATTR_TEXCOORD, 2, GL_UNSIGNED_SHORT,
+			      GL_TRUE, stride,
+			      (const GLvoid *)offsetof(struct cube_vertex,
+						       texcoord));
+	glVertexAttribPointer(CUBE_ATTR_COLOR, 3, GL_UNSIGNED_BYTE, GL_TRUE,
+			      stride,
+			      (const GLvoid *)offsetof(struct cube_vertex,
+						       color));
+	glVertexAttribPointer(CUBE_ATTR_EFFECT, 1, GL_UNSIGNED_BYTE, GL_FALSE,
+			      stride,
+			      (const GLvoid *)offsetof(struct cube_vertex,
+						       effect));
+
+	for (attr = CUBE_ATTR_TEXCOORD; attr <= CUBE_ATTR_EFFECT; attr++) {
+		if (mesh->attribs & (1 << attr))
+			glEnableVertexAttribArray(attr);
+		else
+			glDisableVertexAttribArray(attr);
+	}
+}
+
+int
+cube_mesh_init(struct cube_mesh *mesh, const struct _egl *egl,
+	       const GLfloat *texcoords, const GLfloat *colors,
+	       const GLubyte *effects)
+{
+	struct cube_vertex vertices[CUBE_VERTICES] = { 0 };
+	GLubyte indices[CUBE_INDICES];
+	int i, j;
+
+	cube_mesh_fini(mesh, egl);
+	/* do not let the buffer bindings below land in another mesh's VAO */
+	if (egl->has_vertex_array_object)
+		egl->glBindVertexArrayOES(0);
+
+	for (i = 0; i < CUBE_VERTICES; i++) {
+		struct cube_vertex *v = &vertices[i];
+
+		for (j = 0; j < 3; j++) {
+			v->position[j] = positions[i][j];
+			v->normal[j] = normals[i / CUBE_FACE_VERTICES][j];
+		}
+		if (texcoords) {
+			v->texcoord[0] = unorm16(texcoords[2 * i]);
+			v->texcoord[1] = unorm16(texcoords[2 * i + 1]);
+		}
+		if (colors)
+			for (j = 0; j < 3; j++)
+				v->color[j] = unorm8(colors[3 * i + j]);
+		if (effects)
+			v->effect = effects[i];
+	}
+
+	for (i = 0; i < CUBE_INDICES; i++)
+		indices[i] = i / 6 * CUBE_FACE_VERTICES + face_indices[i % 6];
+
+	mesh->attribs = (texcoords ? 1 << CUBE_ATTR_TEXCOORD : 0) |
+			(colors ? 1 << CUBE_ATTR_COLOR : 0) |
+			(effects ? 1 << CUBE_ATTR_EFFECT : 0);
+
+	glGenBuffers(1, &mesh->vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, mesh->vbo);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices,
+		     GL_STATIC_DRAW);
+
+	glGenBuffers(1, &mesh->ibo);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->ibo);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices,
+		     GL_STATIC_DRAW);
+
+	if (egl->has_vertex_array_object) {
+		egl->glGenVertexArraysOES(1, &mesh->vao);
+		egl->glBindVertexArrayOES(mesh->vao);
+		setup_attribs(mesh);
+		egl->glBindVertexArrayOES(0);
+	}
+
+	cube_mesh_bind(mesh, egl);
+
+	return glGetError() == GL_NO_ERROR ? 0 : -1;
+}
+
+void
+cube_mesh_fini(struct cube_mesh *mesh, const struct _egl *egl)
+{
+	if (bound_mesh == mesh)
+		bound_mesh = NULL;
+
+	if (mesh->vao)
+		egl->glDeleteVertexArraysOES(1, &mesh->vao);
+	if (mesh->ibo)
+		glDeleteBuffers(1, &mesh->ibo);
+	if (mesh->vbo)
+		glDeleteBuffers(1, &mesh->vbo);
+
+	mesh->vao = mesh->ibo = mesh->vbo = 0;
+}
+
+static const struct {
+	GLuint location;
+	const char *name;
+} attrib_locations[] = {
+	{ CUBE_ATTR_POSITION, "in_position" },
+	{ CUBE_ATTR_NORMAL, "in_normal" },
+	{ CUBE_ATTR_TEXCOORD, "in_TexCoord" },
+	{ CUBE_ATTR_COLOR, "in_color" },
+	{ CUBE_ATTR_EFFECT, "in_effect" },
+	{ CUBE_ATTR_MODEL, "in_model0" },
+	{ CUBE_ATTR_MODEL + 1, "in_model1" },
+	{ CUBE_ATTR_MODEL + 2, "in_model2" },
+};
+
+void
+cube_bind_attrib_locations(GLuint program)
+{
+	unsigned i;
+
+	/* binding a name the program does not use is harmless */
+	for (i = 0; i < ARRAY_SIZE(attrib_locations); i++)
+		glBindAttribLocation(program, attrib_locations[i].location,
+				     attrib_locations[i].name);
+}
+
+const char *
+cube_attrib_layout(void)
+{
+	static char layout[256];
+	size_t len = 0;
+	unsigned i;
+
+	if (layout[0])
+		return layout;
+
+	for (i = 0; i < ARRAY_SIZE(attrib_locations); i++)
+		len += snprintf(layout + len, sizeof(layout) - len, "%s=%u;",
+				attrib_locations[i].name,
+				attrib_locations[i].location);
+
+	return layout;
+}
+
+void
+cube_mesh_bind(const struct cube_mesh *mesh, const struct _egl *egl)
+{
+	if (mesh->vao) {
+		egl->glBindVertexArrayOES(mesh->vao);
+		return;
+	}
+
+	if (bound_mesh == mesh)
+		return;
+
+	setup_attribs(mesh);
+	bound_mesh = mesh;
+}
+
+void
+cube_mesh_draw(int first, int count)
+{
+	glDrawElements(GL_TRIANGLES, count * 6, GL_UNSIGNED_BYTE,
+		       (const GLvoid *)(intptr_t)(first * 6));
+}
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2019 STMicroelectronics. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef CUBE_MESH_H
+#define CUBE_MESH_H
+
+#include "simple-st-egl.h"
+
+/* The cube geometry shared by all the modes: 6 faces of 4 vertices, in
+ * the order front, back, right, left, top, bottom, interleaved in a single
+ * vertex buffer with compact types and drawn as indexed triangles. When
+ * GL_OES_vertex_array_object is supported, the attribute state is
+ * captured once in a vertex array object.
+ */
+
+#define CUBE_FACES		6
+#define CUBE_FACE_VERTICES	4
+
+/* attribute locations, the same in every program (see
+ * cube_bind_attrib_locations()) */
+#define CUBE_ATTR_POSITION	0
+#define CUBE_ATTR_NORMAL	1
+#define CUBE_ATTR_TEXCOORD	2
+#define CUBE_ATTR_COLOR		3
+#define CUBE_ATTR_EFFECT	4
+/* per-instance model matrix of the grid of cubes, 3 locations (see
+ * cube-grid.h) */
+#define CUBE_ATTR_MODEL		5
+
+struct cube_mesh {
+	GLuint vbo, ibo, vao;
+	unsigned attribs;	/* 1 << CUBE_ATTR_* of the optional ones */
+};
+
+/* Build the vertex buffer of the cube. Per vertex, 'texcoords' holds 2
+ * floats in [0, 1], 'colors' 3 floats in [0, 1] and 'effects' a byte; the
+ * attributes of those left NULL are not enabled. A mesh initialized
+ * before is released first.
+ */
+int  cube_mesh_init(struct cube_mesh *mesh, const struct _egl *egl,
+		    const GLfloat *texcoords, const GLfloat *colors,
+		    const GLubyte *effects);
+void cube_mesh_fini(struct cube_mesh *mesh, const struct _egl *egl);
+
+/* to be called before linking the programs drawing a mesh */
+void cube_bind_attrib_locations(GLuint program);
+
+/* the bindings of cube_bind_attrib_locations() as a string, for the keys of
+ * the program cache */
+const char *cube_attrib_layout(void);
+
+/* make 'mesh' the one drawn by cube_mesh_draw() */
+void cube_mesh_bind(const struct cube_mesh *mesh, const struct _egl *egl);
+/* draw 'count' faces, starting from 'first' */
+void cube_mesh_draw(int first, int count);
+
+#endif
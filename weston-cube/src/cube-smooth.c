@@ -26,58 +26,25 @@
 #include <stdbool.h>
 #include <math.h>
 #include <assert.h>
-#include <sys/time.h>
 #include <string.h>
 
 #include <wayland-client.h>
 
 #include "cube-common.h"
+#include "cube-grid.h"
+#include "cube-mesh.h"
+#include "telemetry.h"
 #include "shared/helpers.h"
 #include "esUtil.h"
 
 
 struct gl {
 	GLfloat aspect;
-	GLuint pos, col, normal;
 	GLuint program;
 	GLint modelviewmatrix, modelviewprojectionmatrix, normalmatrix;
-	GLuint vbo;
-	GLuint positionsoffset, colorsoffset, normalsoffset;
+	struct cube_mesh mesh;
 } gl_smooth;
 
-static const GLfloat vVertices[] = {
-		// front
-		-1.0f, -1.0f, +1.0f,
-		+1.0f, -1.0f, +1.0f,
-		-1.0f, +1.0f, +1.0f,
-		+1.0f, +1.0f, +1.0f,
-		// back
-		+1.0f, -1.0f, -1.0f,
-		-1.0f, -1.0f, -1.0f,
-		+1.0f, +1.0f, -1.0f,
-		-1.0f, +1.0f, -1.0f,
-		// right
-		+1.0f, -1.0f, +1.0f,
-		+1.0f, -1.0f, -1.0f,
-		+1.0f, +1.0f, +1.0f,
-		+1.0f, +1.0f, -1.0f,
-		// left
-		-1.0f, -1.0f, -1.0f,
-		-1.0f, -1.0f, +1.0f,
-		-1.0f, +1.0f, -1.0f,
-		-1.0f, +1.0f, +1.0f,
-		// top
-		-1.0f, +1.0f, +1.0f,
-		+1.0f, +1.0f, +1.0f,
-		-1.0f, +1.0f, -1.0f,
-		+1.0f, +1.0f, -1.0f,
-		// bottom
-		-1.0f, -1.0f, -1.0f,
-		+1.0f, -1.0f, -1.0f,
-		-1.0f, -1.0f, +1.0f,
-		+1.0f, -1.0f, +1.0f,
-};
-
 static const GLfloat vColors[] = {
 		// front
 		0.0f,  0.0f,  1.0f, // blue
@@ -111,39 +78,6 @@ static const GLfloat vColors[] = {
 		1.0f,  0.0f,  1.0f  // magenta
 };
 
-static const GLfloat vNormals[] = {
-		// front
-		+0.0f, +0.0f, +1.0f, // forward
-		+0.0f, +0.0f, +1.0f, // forward
-		+0.0f, +0.0f, +1.0f, // forward
-		+0.0f, +0.0f, +1.0f, // forward
-		// back
-		+0.0f, +0.0f, -1.0f, // backward
-		+0.0f, +0.0f, -1.0f, // backward
-		+0.0f, +0.0f, -1.0f, // backward
-		+0.0f, +0.0f, -1.0f, // backward
-		// right
-		+1.0f, +0.0f, +0.0f, // right
-		+1.0f, +0.0f, +0.0f, // right
-		+1.0f, +0.0f, +0.0f, // right
-		+1.0f, +0.0f, +0.0f, // right
-		// left
-		-1.0f, +0.0f, +0.0f, // left
-		-1.0f, +0.0f, +0.0f, // left
-		-1.0f, +0.0f, +0.0f, // left
-		-1.0f, +0.0f, +0.0f, // left
-		// top
-		+0.0f, +1.0f, +0.0f, // up
-		+0.0f, +1.0f, +0.0f, // up
-		+0.0f, +1.0f, +0.0f, // up
-		+0.0f, +1.0f, +0.0f, // up
-		// bottom
-		+0.0f, -1.0f, +0.0f, // down
-		+0.0f, -1.0f, +0.0f, // down
-		+0.0f, -1.0f, +0.0f, // down
-		+0.0f, -1.0f, +0.0f  // down
-};
-
 static const char *vertex_shader_source =
 		"uniform mat4 modelviewMatrix;      \n"
 		"uniform mat4 modelviewprojectionMatrix;\n"
@@ -153,15 +87,18 @@ static const char *vertex_shader_source =
 		"attribute vec3 in_normal;          \n"
 		"attribute vec4 in_color;           \n"
 		"\n"
+		CUBE_VERTEX_TRANSFORMS
+		"\n"
 		"vec4 lightSource = vec4(2.0, 2.0, 20.0, 0.0);\n"
 		"                                   \n"
 		"varying vec4 vVaryingColor;        \n"
 		"                                   \n"
 		"void main()                        \n"
 		"{                                  \n"
-		"    gl_Position = modelviewprojectionMatrix * in_position;\n"
-		"    vec3 vEyeNormal = normalMatrix * in_normal;\n"
-		"    vec4 vPosition4 = modelviewMatrix * in_position;\n"
+		"    vec4 position = cube_position(in_position);\n"
+		"    gl_Position = modelviewprojectionMatrix * position;\n"
+		"    vec3 vEyeNormal = normalMatrix * cube_normal(in_normal);\n"
+		"    vec4 vPosition4 = modelviewMatrix * position;\n"
 		"    vec3 vPosition3 = vPosition4.xyz / vPosition4.w;\n"
 		"    vec3 vLightDir = normalize(lightSource.xyz - vPosition3);\n"
 		"    float diff = max(0.0, dot(vEyeNormal, vLightDir));\n"
@@ -183,13 +120,8 @@ static void draw_cube_smooth(void *data, struct wl_callback *callback )
 	struct window *w = data;
 	struct display *d = w->display;
 	struct gl *pgl = w->gl;
-	struct wl_region *region;
-	struct timeval tv;
 	ESMatrix4x4 modelview;
-	static const uint32_t benchmark_interval = 5;
-	uint32_t time;
-	EGLint rect[8];
-	EGLint buffer_age = 0;
+	EGLint buffer_age;
 	struct point move;
 
 	assert(w->callback == callback);
@@ -197,35 +129,14 @@ static void draw_cube_smooth(void *data, struct wl_callback *callback )
 	if (callback)
 		wl_callback_destroy(callback);
 
-	gettimeofday(&tv, NULL);
-	time = tv.tv_sec * 1000 + tv.tv_usec / 1000;
-	if (w->frames == 0)
-		w->benchmark_time = time;
-	if (time - w->benchmark_time > (benchmark_interval * 1000)) {
-		printf("%d frames in %d seconds: %f fps\n",
-		       w->frames,
-		       benchmark_interval,
-		       (float) w->frames / benchmark_interval);
-		w->benchmark_time = time;
-		w->frames = 0;
-	}
+	telemetry_frame_begin(&d->egl);
 
-	if (d->egl.swap_buffers_with_damage)
-		eglQuerySurface(d->egl.dpy, w->egl_surface,
-				EGL_BUFFER_AGE_EXT, &buffer_age);
+	buffer_age = window_buffer_age(w);
 
 	glViewport(0, 0, w->geometry.width, w->geometry.height);
 	pgl->aspect = (GLfloat)(w->geometry.height) /
 		(GLfloat)(w->geometry.width);
 
-	/* clear the color buffer */
-	glClearColor(CUBE_RED, CUBE_GREEN, CUBE_BLUE, CUBE_ALPHA);
-#ifdef DAMAGE_DEBUG
-	glClearColor((GLfloat)(w->frames_cumul % 255) / 255.0f,
-		     0.0, 0.0, 0.5);
-#endif
-	glClear(GL_COLOR_BUFFER_BIT);
-
 	esMatrixLoadIdentity(&modelview);
 	move = w->move;
 	esTranslate(&modelview,
@@ -249,6 +160,20 @@ static void draw_cube_smooth(void *data, struct wl_callback *callback )
 	ESMatrix4x4 modelviewprojection;
 	esMatrixLoadIdentity(&modelviewprojection);
 	esMatrixMultiply(&modelviewprojection, &modelview, &projection);
+	if (cube_grid_enabled(w))
+		cube_grid_update(w, &projection);
+	else
+		cube_damage(w, &modelviewprojection);
+
+	window_begin_frame(w, buffer_age, true);
+
+	/* clear the color buffer */
+	glClearColor(CUBE_RED, CUBE_GREEN, CUBE_BLUE, CUBE_ALPHA);
+#ifdef DAMAGE_DEBUG
+	glClearColor((GLfloat)(w->frames_cumul % 255) / 255.0f,
+		     0.0, 0.0, 0.5);
+#endif
+	glClear(GL_COLOR_BUFFER_BIT);
 
 	float normal[9];
 	normal[0] = modelview.m4x4[0][0];
@@ -267,69 +192,15 @@ static void draw_cube_smooth(void *data, struct wl_callback *callback )
 			   &modelviewprojection.m4x4[0][0]);
 	glUniformMatrix3fv(pgl->normalmatrix, 1, GL_FALSE, normal);
 
-	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-	glDrawArrays(GL_TRIANGLE_STRIP, 4, 4);
-	glDrawArrays(GL_TRIANGLE_STRIP, 8, 4);
-	glDrawArrays(GL_TRIANGLE_STRIP, 12, 4);
-	glDrawArrays(GL_TRIANGLE_STRIP, 16, 4);
-	glDrawArrays(GL_TRIANGLE_STRIP, 20, 4);
-
-	if (w->opaque) {
-		region =
-		       wl_compositor_create_region(w->display->compositor);
-		wl_region_add(region, 0, 0,
-			      w->geometry.width,
-			      w->geometry.height);
-		wl_surface_set_opaque_region(w->surface, region);
-		wl_region_destroy(region);
-	} else {
-		wl_surface_set_opaque_region(w->surface, NULL);
-	}
-
-	if (d->egl.swap_buffers_with_damage) {
-		if (buffer_age > 0) {
-#ifdef DAMAGE_DEBUG
-			rect[0] = (EGLint)w->corner.x;
-			rect[1] = (EGLint)w->corner.y;
-			rect[2] = (EGLint)w->rect.x;
-			rect[3] = (EGLint)w->rect.y;
-#else
-			rect[0] = w->geometry.width  * DAMAGE_X_PERCENT +
-				move.x;
-			rect[1] = w->geometry.height * DAMAGE_Y_PERCENT -
-				move.y;
-			rect[2] = w->geometry.width  * DAMAGE_W_PERCENT;
-			rect[3] = w->geometry.height * DAMAGE_H_PERCENT ;
-#endif
-			memcpy(&rect[4], w->damage, 4 * sizeof(EGLint));
-			d->egl.swap_buffers_with_damage(d->egl.dpy,
-							w->egl_surface,
-							rect, 2);
-			memcpy(w->damage, rect, 4 * sizeof(EGLint));
+	cube_mesh_bind(&pgl->mesh, &d->egl);
+	cube_grid_draw(w, pgl->modelviewmatrix, pgl->modelviewprojectionmatrix,
+		       pgl->normalmatrix, 0, CUBE_FACES);
 
-#ifdef DAMAGE_DEBUG
-			printf("[1] {x,y}[w x h]: {%i,%i}[%i x %i]\n"
-			       "[2] {x,y}[w x h]: {%i,%i}[%i x %i]\n",
-			       rect[0], rect[1] ,rect[2] ,rect[3],
-			       rect[4], rect[5] ,rect[6] ,rect[7]);
-#endif
+	telemetry_frame_drawn(&d->egl);
 
-			wl_surface_damage(w->surface,
-					  rect[0], rect[1],
-					  rect[2], rect[3]);
-			wl_surface_commit(w->surface);
-		 } else {
-			w->damage[0] = 0;
-			w->damage[1] = 0;
-			w->damage[2] = w->geometry.width;
-			w->damage[3] = w->geometry.height;
-			eglSwapBuffers(d->egl.dpy, w->egl_surface);
-		 }
-	} else {
-		eglSwapBuffers(d->egl.dpy, w->egl_surface);
-	}
+	window_present(w, buffer_age, true);
 
-	w->frames++;
+	telemetry_frame_end();
 	if (w->frames_cumul++ >= FRAME_CUMUL_RESET_VALUE) {
 		printf("Reseting !!\n");
 		w->frames_cumul  = 0;
@@ -346,18 +217,14 @@ void init_cube_smooth(struct window *w)
 	pgl->aspect = (GLfloat)(w->geometry.width) /
 		(GLfloat)(w->geometry.height);
 
-	ret = create_program(vertex_shader_source, fragment_shader_source);
+	ret = create_program(cube_grid_vertex_shader(w, vertex_shader_source),
+			     fragment_shader_source);
 	if (ret < 0)
 		return;
 
-	pgl->pos = 0;
-	pgl->normal = 1;
-	pgl->col = 2;
 	pgl->program = ret;
 
-	glBindAttribLocation(pgl->program, pgl->pos, "in_position");
-	glBindAttribLocation(pgl->program, pgl->normal, "in_normal");
-	glBindAttribLocation(pgl->program, pgl->col, "in_color");
+	cube_bind_attrib_locations(pgl->program);
 
 	ret = link_program(pgl->program);
 	if (ret)
@@ -375,32 +242,9 @@ void init_cube_smooth(struct window *w)
 	glViewport(0, 0, w->geometry.width, w->geometry.width);
 	glEnable(GL_CULL_FACE);
 
-	pgl->positionsoffset = 0;
-	pgl->colorsoffset = sizeof(vVertices);
-	pgl->normalsoffset = sizeof(vVertices) + sizeof(vColors);
-	glGenBuffers(1, &pgl->vbo);
-	glBindBuffer(GL_ARRAY_BUFFER, pgl->vbo);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(vVertices) + sizeof(vColors) +
-		     sizeof(vNormals), 0, GL_STATIC_DRAW);
-
-	glBufferSubData(GL_ARRAY_BUFFER, pgl->positionsoffset,
-			sizeof(vVertices), &vVertices[0]);
-	glBufferSubData(GL_ARRAY_BUFFER, pgl->colorsoffset, sizeof(vColors),
-			&vColors[0]);
-	glBufferSubData(GL_ARRAY_BUFFER, pgl->normalsoffset, sizeof(vNormals),
-			&vNormals[0]);
-
-	glVertexAttribPointer(pgl->pos, 3, GL_FLOAT, GL_FALSE, 0,
-			      (const GLvoid *)(intptr_t)pgl->positionsoffset);
-	glEnableVertexAttribArray(pgl->pos);
-
-	glVertexAttribPointer(pgl->normal, 3, GL_FLOAT, GL_FALSE, 0,
-			      (const GLvoid *)(intptr_t)pgl->normalsoffset);
-	glEnableVertexAttribArray(pgl->normal);
-
-	glVertexAttribPointer(pgl->col, 3, GL_FLOAT, GL_FALSE, 0,
-			      (const GLvoid *)(intptr_t)pgl->colorsoffset);
-	glEnableVertexAttribArray(pgl->col);
+	if (cube_mesh_init(&pgl->mesh, &w->display->egl, NULL, vColors,
+			   NULL))
+		return;
 
 	w->redraw = draw_cube_smooth;
 	w->next_shader = NULL;
@@ -408,3 +252,16 @@ void init_cube_smooth(struct window *w)
 	w->gl = pgl;
 }
 
+void fini_cube_smooth(struct window *w)
+{
+	struct gl *pgl = &gl_smooth;
+
+	if (pgl->program)
+		glDeleteProgram(pgl->program);
+	cube_mesh_fini(&pgl->mesh, &w->display->egl);
+
+	memset(pgl, 0, sizeof(*pgl));
+	w->redraw = NULL;
+	w->gl = NULL;
+}
+
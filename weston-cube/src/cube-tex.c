@@ -26,19 +26,24 @@
 #include <stdbool.h>
 #include <math.h>
 #include <assert.h>
-#include <sys/time.h>
 #include <string.h>
 
 #include <wayland-client.h>
 
 #include "cube-common.h"
+#include "cube-grid.h"
+#include "cube-mesh.h"
+#include "startup-trace.h"
+#include "telemetry.h"
 #include "image-loader.h"
 #include "esUtil.h"
 
 #define MAX_PROG 4
 
 struct face_ctx {
+	/* 0 until 'build' is done, see get_face() */
 	GLuint prg;
+	struct deferred_program build;
 	struct {
 		GLint modelviewmatrix;
 		GLint modelviewprojectionmatrix;
@@ -51,50 +56,16 @@ struct face_ctx {
 
 struct gl {
 	GLfloat aspect;
-	GLuint pos, tex, normal;
 
 	struct face_ctx face[MAX_PROG];
 
-	GLuint positionsoffset, texcoordsoffset, normalsoffset;
-	GLuint vbo, texhandle[3];
+	struct cube_mesh mesh;
+	GLuint texhandle[3];
 	pixman_image_t *texture[3];
 	GLfloat *TexCoords;
 	enum mode mod;
 } gl_tex;
 
-static const GLfloat vVertices[] = {
-		// front
-		-1.0f, -1.0f, +1.0f,
-		+1.0f, -1.0f, +1.0f,
-		-1.0f, +1.0f, +1.0f,
-		+1.0f, +1.0f, +1.0f,
-		// back
-		+1.0f, -1.0f, -1.0f,
-		-1.0f, -1.0f, -1.0f,
-		+1.0f, +1.0f, -1.0f,
-		-1.0f, +1.0f, -1.0f,
-		// right
-		+1.0f, -1.0f, +1.0f,
-		+1.0f, -1.0f, -1.0f,
-		+1.0f, +1.0f, +1.0f,
-		+1.0f, +1.0f, -1.0f,
-		// left
-		-1.0f, -1.0f, -1.0f,
-		-1.0f, -1.0f, +1.0f,
-		-1.0f, +1.0f, -1.0f,
-		-1.0f, +1.0f, +1.0f,
-		// top
-		-1.0f, +1.0f, +1.0f,
-		+1.0f, +1.0f, +1.0f,
-		-1.0f, +1.0f, -1.0f,
-		+1.0f, +1.0f, -1.0f,
-		// bottom
-		-1.0f, -1.0f, -1.0f,
-		+1.0f, -1.0f, -1.0f,
-		-1.0f, -1.0f, +1.0f,
-		+1.0f, -1.0f, +1.0f,
-};
-
 GLfloat vTexCoords1[] = {
 		//front
 		0.0f, 1.0f,
@@ -161,39 +132,6 @@ GLfloat vTexCoords6[] = {
 		2.0f / 4.0f, 1.0f / 2.0f,
 };
 
-static const GLfloat vNormals[] = {
-		// front
-		+0.0f, +0.0f, +1.0f, // forward
-		+0.0f, +0.0f, +1.0f, // forward
-		+0.0f, +0.0f, +1.0f, // forward
-		+0.0f, +0.0f, +1.0f, // forward
-		// back
-		+0.0f, +0.0f, -1.0f, // backward
-		+0.0f, +0.0f, -1.0f, // backward
-		+0.0f, +0.0f, -1.0f, // backward
-		+0.0f, +0.0f, -1.0f, // backward
-		// right
-		+1.0f, +0.0f, +0.0f, // right
-		+1.0f, +0.0f, +0.0f, // right
-		+1.0f, +0.0f, +0.0f, // right
-		+1.0f, +0.0f, +0.0f, // right
-		// left
-		-1.0f, +0.0f, +0.0f, // left
-		-1.0f, +0.0f, +0.0f, // left
-		-1.0f, +0.0f, +0.0f, // left
-		-1.0f, +0.0f, +0.0f, // left
-		// top
-		+0.0f, +1.0f, +0.0f, // up
-		+0.0f, +1.0f, +0.0f, // up
-		+0.0f, +1.0f, +0.0f, // up
-		+0.0f, +1.0f, +0.0f, // up
-		// bottom
-		+0.0f, -1.0f, +0.0f, // down
-		+0.0f, -1.0f, +0.0f, // down
-		+0.0f, -1.0f, +0.0f, // down
-		+0.0f, -1.0f, +0.0f  // down
-};
-
 static const char *vertex_shader_source =
 		"uniform mat4 modelviewMatrix;                     \n"
 		"uniform mat4 modelviewprojectionMatrix;           \n"
@@ -203,6 +141,8 @@ static const char *vertex_shader_source =
 		"attribute vec2 in_TexCoord;                       \n"
 		"attribute vec3 in_normal;                         \n"
 		"                                                  \n"
+		CUBE_VERTEX_TRANSFORMS
+		"                                                  \n"
 		"vec4 lightSource = vec4(2.0, 2.0, 20.0, 0.0);     \n"
 		"                                                  \n"
 		"varying vec4 vVaryingColor;                       \n"
@@ -210,11 +150,13 @@ static const char *vertex_shader_source =
 		"                                                  \n"
 		"void main()                                       \n"
 		"{                                                 \n"
+		"    vec4 position = cube_position(in_position);   \n"
 		"    gl_Position = modelviewprojectionMatrix *     \n"
-		"                  in_position;                    \n"
-		"    vec3 vEyeNormal = normalMatrix * in_normal;   \n"
+		"                  position;                       \n"
+		"    vec3 vEyeNormal = normalMatrix *              \n"
+		"                      cube_normal(in_normal);     \n"
 		"    vec4 vPosition4 = modelviewMatrix *           \n"
-		"                      in_position;                \n"
+		"                      position;                   \n"
 		"    vec3 vPosition3 = vPosition4.xyz /            \n"
 		"                      vPosition4.w;               \n"
 		"    vec3 vLightDir = normalize(lightSource.xyz -  \n"
@@ -439,18 +381,66 @@ static void init_tex(struct gl *gl)
 	}
 }
 
+static void
+face_init_uniforms(struct face_ctx *face)
+{
+	face->prg = face->build.program;
+	face->attr.modelviewmatrix =
+		glGetUniformLocation(face->prg, "modelviewMatrix");
+	face->attr.modelviewprojectionmatrix =
+		glGetUniformLocation(face->prg, "modelviewprojectionMatrix");
+	face->attr.normalmatrix = glGetUniformLocation(face->prg,
+						       "normalMatrix");
+	face->attr.texture = glGetUniformLocation(face->prg, "uTex");
+	face->attr.reso = glGetUniformLocation(face->prg, "uReso");
+	face->attr.frame = glGetUniformLocation(face->prg, "uFrame");
+}
+
+/* The program of face 'i' once built, the legacy one (face 0) standing
+ * in until then. With 'build', it is built now if needed. */
+static struct face_ctx *
+get_face(struct window *w, struct gl *pgl, int i, bool build)
+{
+	struct face_ctx *face = &pgl->face[i];
+
+	if (!w->animated)
+		return &pgl->face[0];
+
+	if (!face->prg) {
+		if (!deferred_program_poll(&face->build, build))
+			return &pgl->face[0];
+		face_init_uniforms(face);
+	}
+
+	return face;
+}
+
+/* Without GL_KHR_parallel_shader_compile, the effects are linked here, one
+ * per frame once the first frame is on screen */
+static void
+build_next_face(struct window *w, struct gl *pgl)
+{
+	int i;
+
+	if (!w->animated || w->display->egl.has_parallel_shader_compile)
+		return;
+
+	for (i = 1; i < MAX_PROG; i++) {
+		if (pgl->face[i].prg || pgl->face[i].build.failed)
+			continue;
+		get_face(w, pgl, i, true);
+		return;
+	}
+}
+
 static void draw_cube_tex(void *data, struct wl_callback *callback)
 {
 	struct window *w = data;
 	struct display *d = w->display;
 	struct gl *pgl;
-	struct wl_region *region;
-	struct timeval tv;
+	struct face_ctx *face;
 	ESMatrix4x4 modelview;
-	static const uint32_t benchmark_interval = 5;
-	uint32_t time;
-	EGLint rect[8];
-	EGLint buffer_age = 0;
+	EGLint buffer_age;
 	struct point move;
 
 	assert(w->callback == callback);
@@ -458,22 +448,9 @@ static void draw_cube_tex(void *data, struct wl_callback *callback)
 	if (callback)
 		wl_callback_destroy(callback);
 
-	gettimeofday(&tv, NULL);
-	time = tv.tv_sec * 1000 + tv.tv_usec / 1000;
-	if (w->frames == 0)
-		w->benchmark_time = time;
-	if (time - w->benchmark_time > (benchmark_interval * 1000)) {
-		printf("%d frames in %d seconds: %f fps\n",
-		       w->frames,
-		       benchmark_interval,
-		       (float) w->frames / benchmark_interval);
-		w->benchmark_time = time;
-		w->frames = 0;
-	}
+	telemetry_frame_begin(&d->egl);
 
-	if (d->egl.swap_buffers_with_damage)
-		eglQuerySurface(d->egl.dpy, w->egl_surface,
-				EGL_BUFFER_AGE_EXT, &buffer_age);
+	buffer_age = window_buffer_age(w);
 
 	pgl = w->gl;
 
@@ -481,14 +458,6 @@ static void draw_cube_tex(void *data, struct wl_callback *callback)
 	pgl->aspect = (GLfloat)(w->geometry.height) /
 		(GLfloat)(w->geometry.width);
 
-	/* clear the color buffer */
-	glClearColor(CUBE_RED, CUBE_GREEN, CUBE_BLUE, CUBE_ALPHA);
-#ifdef DAMAGE_DEBUG
-	glClearColor((GLfloat)(w->frames_cumul % 255) / 255.0f,
-		     0.0, 0.0, 0.5);
-#endif
-	glClear(GL_COLOR_BUFFER_BIT);
-
 	esMatrixLoadIdentity(&modelview);
 	move = w->move;
 	esTranslate(&modelview,
@@ -512,6 +481,20 @@ static void draw_cube_tex(void *data, struct wl_callback *callback)
 	ESMatrix4x4 modelviewprojection;
 	esMatrixLoadIdentity(&modelviewprojection);
 	esMatrixMultiply(&modelviewprojection, &modelview, &projection);
+	if (cube_grid_enabled(w))
+		cube_grid_update(w, &projection);
+	else
+		cube_damage(w, &modelviewprojection);
+
+	window_begin_frame(w, buffer_age, true);
+
+	/* clear the color buffer */
+	glClearColor(CUBE_RED, CUBE_GREEN, CUBE_BLUE, CUBE_ALPHA);
+#ifdef DAMAGE_DEBUG
+	glClearColor((GLfloat)(w->frames_cumul % 255) / 255.0f,
+		     0.0, 0.0, 0.5);
+#endif
+	glClear(GL_COLOR_BUFFER_BIT);
 
 	float normal[9];
 	normal[0] = modelview.m4x4[0][0];
@@ -525,7 +508,7 @@ static void draw_cube_tex(void *data, struct wl_callback *callback)
 	normal[8] = modelview.m4x4[2][2];
 
 	{
-		struct face_ctx *face = &pgl->face[2];
+		face = get_face(w, pgl, 2, false);
 
 		glUseProgram(face->prg);
 		glUniformMatrix4fv(face->attr.modelviewmatrix, 1, GL_FALSE,
@@ -542,12 +525,14 @@ static void draw_cube_tex(void *data, struct wl_callback *callback)
 			    0.0f);
 
 	}
+	cube_mesh_bind(&pgl->mesh, &d->egl);
 	glBindTexture(GL_TEXTURE_2D, pgl->texhandle[0]);
-	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-	glDrawArrays(GL_TRIANGLE_STRIP, 4, 4);
+	cube_grid_draw(w, face->attr.modelviewmatrix,
+		       face->attr.modelviewprojectionmatrix,
+		       face->attr.normalmatrix, 0, 2);
 
 	{
-		struct face_ctx *face = &pgl->face[3];
+		face = get_face(w, pgl, 3, false);
 
 		glUseProgram(face->prg);
 		glUniformMatrix4fv(face->attr.modelviewmatrix, 1, GL_FALSE,
@@ -570,11 +555,12 @@ static void draw_cube_tex(void *data, struct wl_callback *callback)
 			      0.0f);
 		}
 	}
-	glDrawArrays(GL_TRIANGLE_STRIP, 8, 4);
-	glDrawArrays(GL_TRIANGLE_STRIP, 12, 4);
+	cube_grid_draw(w, face->attr.modelviewmatrix,
+		       face->attr.modelviewprojectionmatrix,
+		       face->attr.normalmatrix, 2, 2);
 
 	{
-		struct face_ctx *face = &pgl->face[0];
+		face = get_face(w, pgl, 0, false);
 
 		glUseProgram(face->prg);
 		glUniformMatrix4fv(face->attr.modelviewmatrix, 1, GL_FALSE,
@@ -598,75 +584,37 @@ static void draw_cube_tex(void *data, struct wl_callback *callback)
 		}
 	}
 
-	glDrawArrays(GL_TRIANGLE_STRIP, 16, 4);
-	glDrawArrays(GL_TRIANGLE_STRIP, 20, 4);
-
-	if (w->opaque) {
-		region = wl_compositor_create_region(w->display->compositor);
-		wl_region_add(region, 0, 0,
-			      w->geometry.width,
-			      w->geometry.height);
-		wl_surface_set_opaque_region(w->surface, region);
-		wl_region_destroy(region);
-	} else {
-		wl_surface_set_opaque_region(w->surface, NULL);
-	}
-
-	if (d->egl.swap_buffers_with_damage ) {
-		if (buffer_age > 0) {
-#ifdef DAMAGE_DEBUG
-			rect[0] = (EGLint)w->corner.x;
-			rect[1] = (EGLint)w->corner.y;
-			rect[2] = (EGLint)w->rect.x;
-			rect[3] = (EGLint)w->rect.y;
-#else
-			rect[0] = w->geometry.width  * DAMAGE_X_PERCENT +
-				move.x;
-			rect[1] = w->geometry.height * DAMAGE_Y_PERCENT -
-				move.y;
-			rect[2] = w->geometry.width  * DAMAGE_W_PERCENT;
-			rect[3] = w->geometry.height * DAMAGE_H_PERCENT ;
-#endif
-			memcpy(&rect[4], w->damage, 4 * sizeof(EGLint));
-			d->egl.swap_buffers_with_damage(d->egl.dpy,
-							w->egl_surface,
-							rect, 2);
-			memcpy(w->damage, rect, 4 * sizeof(EGLint));
+	cube_grid_draw(w, face->attr.modelviewmatrix,
+		       face->attr.modelviewprojectionmatrix,
+		       face->attr.normalmatrix, 4, 2);
 
-#ifdef DAMAGE_DEBUG
-			printf("[1] {x,y}[w x h]: {%i,%i}[%i x %i]\n"
-			       "[2] {x,y}[w x h]: {%i,%i}[%i x %i]\n",
-			       rect[0], rect[1] ,rect[2] ,rect[3],
-			       rect[4], rect[5] ,rect[6] ,rect[7]);
-#endif
+	telemetry_frame_drawn(&d->egl);
 
-			wl_surface_damage(w->surface,
-					  rect[0], rect[1],
-					  rect[2], rect[3]);
-			wl_surface_commit(w->surface);
-		 } else {
-			w->damage[0] = 0;
-			w->damage[1] = 0;
-			w->damage[2] = w->geometry.width;
-			w->damage[3] = w->geometry.height;
-			eglSwapBuffers(d->egl.dpy, w->egl_surface);
-		 }
-	} else {
-		eglSwapBuffers(d->egl.dpy, w->egl_surface);
-	}
+	window_present(w, buffer_age, true);
+	build_next_face(w, pgl);
 
-	w->frames++;
+	telemetry_frame_end();
 	if (w->frames_cumul++ >= FRAME_CUMUL_RESET_VALUE) {
 		printf("Reseting !!\n");
 		w->frames_cumul  = 0;
 	}
 }
 
+static void
+next_tex_shader(void *data)
+{
+	struct window *w = data;
+	int i;
+
+	for (i = 1; i < MAX_PROG; i++)
+		get_face(w, w->gl, i, true);
+}
+
 void
 init_cube_tex(struct window *w)
 {
 	struct gl *pgl;
-	int ret, i, max;
+	int i, max;
 
 	pgl = &gl_tex;
 	pgl->mod = w->mod;
@@ -690,7 +638,9 @@ init_cube_tex(struct window *w)
 	}
 
 	for (i = 0; i < max; i++){
+		startup_trace_begin("image decode");
 		pgl->texture[i] = load_image(w->tex_filename[i]);
+		startup_trace_end();
 		if (pgl->texture[i] == NULL) {
 			printf("failed to load texture file: %s\n",
 			       w->tex_filename[i]);
@@ -701,84 +651,65 @@ init_cube_tex(struct window *w)
 	pgl->aspect = (GLfloat)(w->geometry.width) /
 		(GLfloat)(w->geometry.height);
 
-	pgl->pos = 0;
-	pgl->normal = 1;
-	pgl->tex = 2;
-
 	for (i = 0; i < MAX_PROG; i++) {
 		struct face_ctx *face = &pgl->face[i];
-		int shader = 0;
 
-		if (w->animated)
-			shader = i;
+		face->prg = 0;
+		/* without animation, all the faces use the legacy shader */
+		if (i && !w->animated)
+			continue;
 
 		printf("Creating shader: \"%s\"\n",
-		       fragment_shader_sources[shader].name);
-		ret = create_program(vertex_shader_source,
-				     *fragment_shader_sources[shader].source);
-		if (ret < 0)
-			goto end;
-		face->prg = ret;
-
-		glBindAttribLocation(face->prg, pgl->pos,
-				     "in_position");
-		glBindAttribLocation(face->prg, pgl->tex,
-				     "in_TexCoord");
-		glBindAttribLocation(face->prg, pgl->normal,
-				     "in_normal");
-
-		ret = link_program(face->prg);
-		if (ret)
-			goto end;
-
-		face->attr.modelviewmatrix =
-			glGetUniformLocation(face->prg,
-					     "modelviewMatrix");
-		face->attr.modelviewprojectionmatrix =
-			glGetUniformLocation(face->prg,
-					     "modelviewprojectionMatrix");
-		face->attr.normalmatrix = glGetUniformLocation(face->prg,
-							       "normalMatrix");
-		face->attr.texture = glGetUniformLocation(face->prg,
-							  "uTex");
-		face->attr.reso = glGetUniformLocation(face->prg, "uReso");
-		face->attr.frame = glGetUniformLocation(face->prg, "uFrame");
+		       fragment_shader_sources[i].name);
+		deferred_program_start(&face->build, &w->display->egl,
+				       cube_grid_vertex_shader(w,
+						vertex_shader_source),
+				       *fragment_shader_sources[i].source);
 	}
 
+	/* the first frame only needs the legacy shader, the others are
+	 * built in the background or by build_next_face() */
+	if (!deferred_program_poll(&pgl->face[0].build, true))
+		goto end;
+	face_init_uniforms(&pgl->face[0]);
+	if (w->animated && !w->display->egl.has_parallel_shader_compile)
+		printf("Effects are built one per frame\n");
+
 	glViewport(0, 0, w->geometry.width, w->geometry.width);
 	glEnable(GL_CULL_FACE);
 
-	pgl->positionsoffset = 0;
-	pgl->texcoordsoffset = sizeof(vVertices);
-	pgl->normalsoffset = sizeof(vVertices) + sizeof(vTexCoords1);
-
-	glGenBuffers(1, &pgl->vbo);
-	glBindBuffer(GL_ARRAY_BUFFER, pgl->vbo);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(vVertices) + sizeof(vTexCoords1) +
-		     sizeof(vNormals), 0, GL_STATIC_DRAW);
-	glBufferSubData(GL_ARRAY_BUFFER, pgl->positionsoffset,
-			sizeof(vVertices), &vVertices[0]);
-	glBufferSubData(GL_ARRAY_BUFFER, pgl->texcoordsoffset,
-			sizeof(vTexCoords1),
-			pgl->TexCoords);
-	glBufferSubData(GL_ARRAY_BUFFER, pgl->normalsoffset, sizeof(vNormals),
-			&vNormals[0]);
-	glVertexAttribPointer(pgl->pos, 3, GL_FLOAT, GL_FALSE, 0,
-			      (const GLvoid *)(intptr_t)pgl->positionsoffset);
-	glEnableVertexAttribArray(pgl->pos);
-	glVertexAttribPointer(pgl->normal, 3, GL_FLOAT, GL_FALSE, 0,
-			      (const GLvoid *)(intptr_t)pgl->normalsoffset);
-	glEnableVertexAttribArray(pgl->normal);
-	glVertexAttribPointer(pgl->tex, 2, GL_FLOAT, GL_FALSE, 0,
-			      (const GLvoid *)(intptr_t)pgl->texcoordsoffset);
-	glEnableVertexAttribArray(pgl->tex);
+	if (cube_mesh_init(&pgl->mesh, &w->display->egl, pgl->TexCoords,
+			   NULL, NULL))
+		goto end;
 
 	init_tex(pgl);
 
 	w->redraw = draw_cube_tex;
-	w->next_shader = NULL;
+	w->next_shader = next_tex_shader;
 
 	w->gl = pgl;
 end:
 	return;
 }
+
+void
+fini_cube_tex(struct window *w)
+{
+	struct gl *pgl = &gl_tex;
+	int i;
+
+	for (i = 0; i < MAX_PROG; i++)
+		deferred_program_fini(&pgl->face[i].build);
+
+	cube_mesh_fini(&pgl->mesh, &w->display->egl);
+	/* the names never generated are 0, which is ignored */
+	glDeleteTextures(3, pgl->texhandle);
+	for (i = 0; i < 3; i++)
+		if (pgl->texture[i])
+			pixman_image_unref(pgl->texture[i]);
+
+	memset(pgl, 0, sizeof(*pgl));
+	w->redraw = NULL;
+	w->next_shader = NULL;
+	w->gl = NULL;
+}
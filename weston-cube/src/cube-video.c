@@ -29,16 +29,25 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/time.h>
+#include <time.h>
 
 #include <wayland-client.h>
 #include "cube-common.h"
+#include "cube-grid.h"
+#include "cube-mesh.h"
+#include "frame-trace.h"
+#include "presentation.h"
+#include "telemetry.h"
 #include "esUtil.h"
 
 #define MAX_PROG 4
 
 struct face_ctx {
+	/* 0 until 'build' is done, see get_face() */
 	GLuint prg;
+	struct deferred_program build;
+	/* pre-pass texture sampled instead of the video frame, if any */
+	GLuint input;
 	struct {
 		GLint modelviewmatrix;
 		GLint modelviewprojectionmatrix;
@@ -56,60 +65,58 @@ struct blit_ctx {
 	} attr;
 };
 
+/* Pre-pass (-p): each new decoded frame is rendered once, at its own
+ * size, into 2D textures that the cube samples instead of the external
+ * image: PREPASS_RGB is the frame, PREPASS_LUMA its luma and
+ * PREPASS_EDGES the Sobel magnitude of that luma for the outline effect,
+ * which is then a single fetch per cube pixel. The other effects are
+ * drawn with their usual main() on PREPASS_RGB: the barrel one is
+ * animated, it cannot be computed once per frame.
+ */
+enum prepass_target {
+	PREPASS_RGB,
+	PREPASS_LUMA,
+	PREPASS_EDGES,
+	PREPASS_TARGETS
+};
+
+struct prepass_ctx {
+	struct blit_ctx rgb, luma, edges;
+	GLuint tex[PREPASS_TARGETS], fbo[PREPASS_TARGETS];
+	/* of PREPASS_LUMA and PREPASS_EDGES, one channel when possible */
+	GLenum luma_format;
+	/* size of the targets */
+	int width, height;
+	/* video_frame_seq() of the frame in tex[], none when 'valid' is
+	 * not set */
+	unsigned seq;
+	bool valid;
+};
+
 struct gl {
 	struct _egl egl;
 
 	GLfloat aspect;
-	GLuint pos, tex, normal;
 
 	struct face_ctx face[MAX_PROG];
+	/* all the effects in one program, see uber_fragment_shader_source */
+	struct face_ctx uber;
 	struct blit_ctx blit;
+	struct prepass_ctx prepass;
 	uint32_t shad_id;
-	GLuint vbo;
-	GLuint positionsoffset, texcoordsoffset, normalsoffset;
+	struct cube_mesh mesh;
 	GLuint texhandle;
 
-	/* video decoder: */
-	struct decoder *decoder;
+	/* video decoder, and the one of the next file of the playlist
+	 * (prerolled so that switching to it does not stall rendering): */
+	struct decoder *decoder, *next_decoder;
 	int filenames_count, idx;
 	const char *filenames[32];
 
-	EGLSyncKHR last_fence;
+	/* presentation time prediction, see predict_presentation(): */
+	uint64_t last_draw, refresh;
 } gl_video;
 
-static const GLfloat vVertices[] = {
-		// front
-		-1.0f, -1.0f, +1.0f,
-		+1.0f, -1.0f, +1.0f,
-		-1.0f, +1.0f, +1.0f,
-		+1.0f, +1.0f, +1.0f,
-		// back
-		+1.0f, -1.0f, -1.0f,
-		-1.0f, -1.0f, -1.0f,
-		+1.0f, +1.0f, -1.0f,
-		-1.0f, +1.0f, -1.0f,
-		// right
-		+1.0f, -1.0f, +1.0f,
-		+1.0f, -1.0f, -1.0f,
-		+1.0f, +1.0f, +1.0f,
-		+1.0f, +1.0f, -1.0f,
-		// left
-		-1.0f, -1.0f, -1.0f,
-		-1.0f, -1.0f, +1.0f,
-		-1.0f, +1.0f, -1.0f,
-		-1.0f, +1.0f, +1.0f,
-		// top
-		-1.0f, +1.0f, +1.0f,
-		+1.0f, +1.0f, +1.0f,
-		-1.0f, +1.0f, -1.0f,
-		+1.0f, +1.0f, -1.0f,
-		// bottom
-		-1.0f, -1.0f, -1.0f,
-		+1.0f, -1.0f, -1.0f,
-		-1.0f, -1.0f, +1.0f,
-		+1.0f, -1.0f, +1.0f,
-};
-
 static const GLfloat vTexCoords[] = {
 		//front
 		0.0f, 1.0f,
@@ -143,37 +150,18 @@ static const GLfloat vTexCoords[] = {
 		1.0f, 0.0f,
 };
 
-static const GLfloat vNormals[] = {
-		// front
-		+0.0f, +0.0f, +1.0f, // forward
-		+0.0f, +0.0f, +1.0f, // forward
-		+0.0f, +0.0f, +1.0f, // forward
-		+0.0f, +0.0f, +1.0f, // forward
-		// back
-		+0.0f, +0.0f, -1.0f, // backward
-		+0.0f, +0.0f, -1.0f, // backward
-		+0.0f, +0.0f, -1.0f, // backward
-		+0.0f, +0.0f, -1.0f, // backward
-		// right
-		+1.0f, +0.0f, +0.0f, // right
-		+1.0f, +0.0f, +0.0f, // right
-		+1.0f, +0.0f, +0.0f, // right
-		+1.0f, +0.0f, +0.0f, // right
-		// left
-		-1.0f, +0.0f, +0.0f, // left
-		-1.0f, +0.0f, +0.0f, // left
-		-1.0f, +0.0f, +0.0f, // left
-		-1.0f, +0.0f, +0.0f, // left
-		// top
-		+0.0f, +1.0f, +0.0f, // up
-		+0.0f, +1.0f, +0.0f, // up
-		+0.0f, +1.0f, +0.0f, // up
-		+0.0f, +1.0f, +0.0f, // up
-		// bottom
-		+0.0f, -1.0f, +0.0f, // down
-		+0.0f, -1.0f, +0.0f, // down
-		+0.0f, -1.0f, +0.0f, // down
-		+0.0f, -1.0f, +0.0f  // down
+/* Effect (index in fragment_shader_sources) of each vertex when animated,
+ * i.e. the one of the program drawing its face in the multi-pass mode */
+static const GLubyte vEffects[] = {
+		// front, back
+		2, 2, 2, 2,
+		2, 2, 2, 2,
+		// right, left
+		3, 3, 3, 3,
+		3, 3, 3, 3,
+		// top, bottom
+		0, 0, 0, 0,
+		0, 0, 0, 0,
 };
 
 static const char *blit_vs =
@@ -211,6 +199,8 @@ static const char *vertex_shader_source =
 		"attribute vec2 in_TexCoord;                       \n"
 		"attribute vec3 in_normal;                         \n"
 		"                                                  \n"
+		CUBE_VERTEX_TRANSFORMS
+		"                                                  \n"
 		"vec4 lightSource = vec4(2.0, 2.0, 20.0, 0.0);     \n"
 		"                                                  \n"
 		"varying vec4 vVaryingColor;                       \n"
@@ -218,11 +208,13 @@ static const char *vertex_shader_source =
 		"                                                  \n"
 		"void main()                                       \n"
 		"{                                                 \n"
+		"    vec4 position = cube_position(in_position);   \n"
 		"    gl_Position = modelviewprojectionMatrix *     \n"
-		"                  in_position;                    \n"
-		"    vec3 vEyeNormal = normalMatrix * in_normal;   \n"
+		"                  position;                       \n"
+		"    vec3 vEyeNormal = normalMatrix *              \n"
+		"                      cube_normal(in_normal);     \n"
 		"    vec4 vPosition4 = modelviewMatrix *           \n"
-		"                      in_position;                \n"
+		"                      position;                   \n"
 		"    vec3 vPosition3 = vPosition4.xyz /            \n"
 		"                      vPosition4.w;               \n"
 		"    vec3 vLightDir = normalize(lightSource.xyz -  \n"
@@ -234,44 +226,58 @@ static const char *vertex_shader_source =
 		"    vTexCoord = in_TexCoord;                      \n"
 		"}                                                 \n";
 
+/* The effects up to the declaration of their texture: the same main() is
+ * drawn from the external image, or from the 2D textures of the pre-pass
+ * (see struct prepass_ctx) */
+#define FRAGMENT_SHADER_EXTERNAL				\
+	"#extension GL_OES_EGL_image_external : enable     \n"	\
+	"precision mediump float;                          \n"	\
+	"                                                  \n"	\
+	"uniform samplerExternalOES uTex;                  \n"
+
+#define FRAGMENT_SHADER_2D					\
+	"precision mediump float;                          \n"	\
+	"                                                  \n"	\
+	"uniform sampler2D uTex;                           \n"
+
+#define FRAGMENT_SHADER_MAIN0					\
+	"                                                  \n"	\
+	"varying vec4 vVaryingColor;                       \n"	\
+	"varying vec2 vTexCoord;                           \n"	\
+	"                                                  \n"	\
+	"void main()                                       \n"	\
+	"{                                                 \n"	\
+	"    gl_FragColor = vVaryingColor *                \n"	\
+	"                   texture2D(uTex, vTexCoord);    \n"	\
+	"}                                                 \n"
+
 static const char *fragment_shader_source0 =
-		"#extension GL_OES_EGL_image_external : enable     \n"
-		"precision mediump float;                          \n"
-		"                                                  \n"
-		"uniform samplerExternalOES uTex;                  \n"
-		"                                                  \n"
-		"varying vec4 vVaryingColor;                       \n"
-		"varying vec2 vTexCoord;                           \n"
-		"                                                  \n"
-		"void main()                                       \n"
-		"{                                                 \n"
-		"    gl_FragColor = vVaryingColor *                \n"
-		"                   texture2D(uTex, vTexCoord);    \n"
-		"}                                                 \n";
+		FRAGMENT_SHADER_EXTERNAL
+		FRAGMENT_SHADER_MAIN0;
 
 /* https://www.shadertoy.com/view/XsVSW1 */
+#define FRAGMENT_SHADER_MAIN1					\
+	"                                                  \n"	\
+	"varying vec4 vVaryingColor;                       \n"	\
+	"varying vec2 vTexCoord;                           \n"	\
+	"                                                  \n"	\
+	"void main()                                       \n"	\
+	"{                                                 \n"	\
+	"    vec2 p = vTexCoord - 0.5;                     \n"	\
+	"                                                  \n"	\
+	"    float r = length(p);                          \n"	\
+	"    float a = atan(p.y, p.x);                     \n"	\
+	"                                                  \n"	\
+	"    r = r * r * 3.0;                              \n"	\
+	"    p = r * vec2(cos(a) * 0.5, sin(a) * 0.5);     \n"	\
+	"                                                  \n"	\
+	"    vec4 color = texture2D(uTex, p + 0.5);        \n"	\
+	"    gl_FragColor = vVaryingColor * color;         \n"	\
+	"}                                                 \n"
+
 static const char *fragment_shader_source1 =
-		"#extension GL_OES_EGL_image_external : enable     \n"
-		"precision mediump float;                          \n"
-		"                                                  \n"
-		"uniform samplerExternalOES uTex;                  \n"
-		"                                                  \n"
-		"varying vec4 vVaryingColor;                       \n"
-		"varying vec2 vTexCoord;                           \n"
-		"                                                  \n"
-		"void main()                                       \n"
-		"{                                                 \n"
-		"    vec2 p = vTexCoord - 0.5;                     \n"
-		"                                                  \n"
-		"    float r = length(p);                          \n"
-		"    float a = atan(p.y, p.x);                     \n"
-		"                                                  \n"
-		"    r = r * r * 3.0;                              \n"
-		"    p = r * vec2(cos(a) * 0.5, sin(a) * 0.5);     \n"
-		"                                                  \n"
-		"    vec4 color = texture2D(uTex, p + 0.5);        \n"
-		"    gl_FragColor = vVaryingColor * color;         \n"
-		"}                                                 \n";
+		FRAGMENT_SHADER_EXTERNAL
+		FRAGMENT_SHADER_MAIN1;
 
 /* https://www.shadertoy.com/view/XlccRX */
 static const char *fragment_shader_source2 =
@@ -369,126 +375,722 @@ static const char *fragment_shader_source2 =
  * based on the barrel deformation shader taken from:
    http://www.geeks3d.com/20140213/glsl-shader-library-fish-eye-and-dome-and-barrel-distortion-post-processing-filters/2/
 */
+#define FRAGMENT_SHADER_MAIN3					\
+	"uniform float uFrame;                             \n"	\
+	"                                                  \n"	\
+	"varying vec4 vVaryingColor;                       \n"	\
+	"varying vec2 vTexCoord;                           \n"	\
+	"                                                  \n"	\
+	"//CONTROL VARIABLES                               \n"	\
+	"// barrel power - (values between 0-1 work well)  \n"	\
+	"float uPower = 0.5;                               \n"	\
+	"float uSpeed = 1.0;                               \n"	\
+	"float uFrequency = 8.0;                           \n"	\
+	"                                                  \n"	\
+	"vec2 Distort(vec2 p, float power, float speed,    \n"	\
+	"             float freq)                          \n"	\
+	"{                                                 \n"	\
+	"    float theta  = atan(p.y, p.x);                \n"	\
+	"    float radius = length(p);                     \n"	\
+	"    radius = pow(radius, power * sin( radius *    \n"	\
+	"             freq - uFrame * speed ) + 1.0);      \n"	\
+	"    p.x = radius * cos(theta);                    \n"	\
+	"    p.y = radius * sin(theta);                    \n"	\
+	"    return 0.5 * (p + 1.0);                       \n"	\
+	"}                                                 \n"	\
+	"                                                  \n"	\
+	"void main()                                       \n"	\
+	"{                                                 \n"	\
+	"    vec2 xy = 2.0 * vTexCoord - 1.0;              \n"	\
+	"    vec2 uvt;                                     \n"	\
+	"    float d = length(xy);                         \n"	\
+	"                                                  \n"	\
+	"    //distance of distortion                      \n"	\
+	"    if (d < 1.0 && uPower != 0.0)                 \n"	\
+	"    {                                             \n"	\
+	"        // if power is 0, then don't call the     \n"	\
+	"        // distortion function since there's no   \n"	\
+	"        // reason to do it :)                     \n"	\
+	"        uvt = Distort(xy, uPower, uSpeed,         \n"	\
+	"                      uFrequency);                \n"	\
+	"    }                                             \n"	\
+	"    else                                          \n"	\
+	"    {                                             \n"	\
+	"        uvt = vTexCoord;                          \n"	\
+	"    }                                             \n"	\
+	"    vec4 c = texture2D(uTex, uvt);                \n"	\
+	"    gl_FragColor = vVaryingColor * c;             \n"	\
+	"}                                                 \n"
+
 static const char *fragment_shader_source3 =
-		"#extension GL_OES_EGL_image_external : enable     \n"
+		FRAGMENT_SHADER_EXTERNAL
+		FRAGMENT_SHADER_MAIN3;
+
+/* Same as vertex_shader_source, passing the effect of the face along */
+static const char *uber_vertex_shader_source =
+		"uniform mat4 modelviewMatrix;                     \n"
+		"uniform mat4 modelviewprojectionMatrix;           \n"
+		"uniform mat3 normalMatrix;                        \n"
+		"                                                  \n"
+		"attribute vec4 in_position;                       \n"
+		"attribute vec2 in_TexCoord;                       \n"
+		"attribute vec3 in_normal;                         \n"
+		"attribute float in_effect;                        \n"
+		"                                                  \n"
+		CUBE_VERTEX_TRANSFORMS
+		"                                                  \n"
+		"vec4 lightSource = vec4(2.0, 2.0, 20.0, 0.0);     \n"
 		"                                                  \n"
+		"varying vec4 vVaryingColor;                       \n"
+		"varying vec2 vTexCoord;                           \n"
+		"varying float vEffect;                            \n"
+		"                                                  \n"
+		"void main()                                       \n"
+		"{                                                 \n"
+		"    vec4 position = cube_position(in_position);   \n"
+		"    gl_Position = modelviewprojectionMatrix *     \n"
+		"                  position;                       \n"
+		"    vec3 vEyeNormal = normalMatrix *              \n"
+		"                      cube_normal(in_normal);     \n"
+		"    vec4 vPosition4 = modelviewMatrix *           \n"
+		"                      position;                   \n"
+		"    vec3 vPosition3 = vPosition4.xyz /            \n"
+		"                      vPosition4.w;               \n"
+		"    vec3 vLightDir = normalize(lightSource.xyz -  \n"
+		"                               vPosition3);       \n"
+		"    float diff = max(0.0, dot(vEyeNormal,         \n"
+		"                              vLightDir));        \n"
+		"    vVaryingColor = vec4(diff *                   \n"
+		"                    vec3(1.0, 1.0, 1.0), 1.0);    \n"
+		"    vTexCoord = in_TexCoord;                      \n"
+		"    vEffect = in_effect;                          \n"
+		"}                                                 \n";
+
+/* fragment_shader_source0..3 in one shader, the effect being picked per
+ * face: the whole cube is drawn with a single program. vEffect is the
+ * same on all the vertices of a face, so the branch only diverges along
+ * the edges. NOTE: the texture is not mipmapped, sampling it in
+ * non-uniform control flow is fine. */
+static const char *uber_fragment_shader_source =
+		"#extension GL_OES_EGL_image_external : enable     \n"
 		"precision mediump float;                          \n"
 		"                                                  \n"
 		"uniform samplerExternalOES uTex;                  \n"
+		"uniform vec3 uReso;                               \n"
 		"uniform float uFrame;                             \n"
 		"                                                  \n"
 		"varying vec4 vVaryingColor;                       \n"
 		"varying vec2 vTexCoord;                           \n"
+		"varying float vEffect;                            \n"
+		"                                                  \n"
+		"vec4 fisheye(vec2 uv)                             \n"
+		"{                                                 \n"
+		"    vec2 p = uv - 0.5;                            \n"
+		"    float r = length(p);                          \n"
+		"    float a = atan(p.y, p.x);                     \n"
+		"                                                  \n"
+		"    r = r * r * 3.0;                              \n"
+		"    p = r * vec2(cos(a) * 0.5, sin(a) * 0.5);     \n"
+		"    return texture2D(uTex, p + 0.5);              \n"
+		"}                                                 \n"
+		"                                                  \n"
+		"float luma(vec2 uv)                               \n"
+		"{                                                 \n"
+		"    return dot(texture2D(uTex, uv).xyz,           \n"
+		"               vec3(0.2126, 0.7152, 0.0722));     \n"
+		"}                                                 \n"
+		"                                                  \n"
+		"vec4 outline(vec2 uv)                             \n"
+		"{                                                 \n"
+		"    float dx = 3.0 / uReso.x;                     \n"
+		"    float dy = 3.0 / uReso.y;                     \n"
+		"                                                  \n"
+		"    float _00 = luma(uv + vec2(-dx,-dy));         \n"
+		"    float _01 = luma(uv + vec2(-dx,0.0));         \n"
+		"    float _02 = luma(uv + vec2(-dx, dy));         \n"
+		"    float _10 = luma(uv + vec2(0.0,-dy));         \n"
+		"    float _12 = luma(uv + vec2(0.0, dy));         \n"
+		"    float _20 = luma(uv + vec2( dx,-dy));         \n"
+		"    float _21 = luma(uv + vec2( dx,0.0));         \n"
+		"    float _22 = luma(uv + vec2( dx, dy));         \n"
 		"                                                  \n"
-		"//CONTROL VARIABLES                               \n"
-		"// barrel power - (values between 0-1 work well)  \n"
-		"float uPower = 0.5;                               \n"
-		"float uSpeed = 1.0;                               \n"
-		"float uFrequency = 8.0;                           \n"
+		"    float horiz = _00 + 2.0 * _01 + _02 - _20 -   \n"
+		"                  2.0 * _21 - _22;                \n"
+		"    float vert  = _00 + 2.0 * _10 + _20 - _02 -   \n"
+		"                  2.0 * _12 - _22;                \n"
+		"    float sobel = sqrt(horiz * horiz +            \n"
+		"                       vert * vert);              \n"
 		"                                                  \n"
-		"vec2 Distort(vec2 p, float power, float speed,    \n"
-		"             float freq)                          \n"
+		"    vec3 col = 0.5 + 0.5 * cos(uFrame +           \n"
+		"               uv.xyx + vec3(0,2,4));             \n"
+		"    return vec4(sobel * col, 1.0);                \n"
+		"}                                                 \n"
+		"                                                  \n"
+		"vec4 barrel(vec2 uv)                              \n"
 		"{                                                 \n"
-		"    float theta  = atan(p.y, p.x);                \n"
+		"    vec2 p = 2.0 * uv - 1.0;                      \n"
 		"    float radius = length(p);                     \n"
-		"    radius = pow(radius, power * sin( radius *    \n"
-		"             freq - uFrame * speed ) + 1.0);      \n"
-		"    p.x = radius * cos(theta);                    \n"
-		"    p.y = radius * sin(theta);                    \n"
-		"    return 0.5 * (p + 1.0);                       \n"
+		"                                                  \n"
+		"    if (radius < 1.0) {                           \n"
+		"        float theta = atan(p.y, p.x);             \n"
+		"        radius = pow(radius, 0.5 * sin(radius *   \n"
+		"                 8.0 - uFrame) + 1.0);            \n"
+		"        p = radius * vec2(cos(theta),             \n"
+		"                          sin(theta));            \n"
+		"        uv = 0.5 * (p + 1.0);                     \n"
+		"    }                                             \n"
+		"    return texture2D(uTex, uv);                   \n"
 		"}                                                 \n"
 		"                                                  \n"
 		"void main()                                       \n"
 		"{                                                 \n"
-		"    vec2 xy = 2.0 * vTexCoord - 1.0;              \n"
-		"    vec2 uvt;                                     \n"
-		"    float d = length(xy);                         \n"
-		"                                                  \n"
-		"    //distance of distortion                      \n"
-		"    if (d < 1.0 && uPower != 0.0)                 \n"
-		"    {                                             \n"
-		"        // if power is 0, then don't call the     \n"
-		"        // distortion function since there's no   \n"
-		"        // reason to do it :)                     \n"
-		"        uvt = Distort(xy, uPower, uSpeed,         \n"
-		"                      uFrequency);                \n"
-		"    }                                             \n"
+		"    vec4 c;                                       \n"
+		"                                                  \n"
+		"    if (vEffect < 0.5)                            \n"
+		"        c = texture2D(uTex, vTexCoord);           \n"
+		"    else if (vEffect < 1.5)                       \n"
+		"        c = fisheye(vTexCoord);                   \n"
+		"    else if (vEffect < 2.5)                       \n"
+		"        c = outline(vTexCoord);                   \n"
 		"    else                                          \n"
-		"    {                                             \n"
-		"        uvt = vTexCoord;                          \n"
-		"    }                                             \n"
-		"    vec4 c = texture2D(uTex, uvt);                \n"
+		"        c = barrel(vTexCoord);                    \n"
 		"    gl_FragColor = vVaryingColor * c;             \n"
 		"}                                                 \n";
 
+/* pre-pass shaders, see struct prepass_ctx */
+
+/* the Sobel magnitude of the luma goes up to 4 * sqrt(2): scaled down to
+ * [0, 1] for the 8-bit PREPASS_EDGES, and back up when sampled */
+#define PREPASS_SOBEL_SCALE	"5.657"
+
+/* draws the front face of the mesh over the whole target */
+static const char *prepass_vs =
+		"attribute vec4 in_position;                       \n"
+		"                                                  \n"
+		"varying vec2 vTexCoord;                           \n"
+		"                                                  \n"
+		"void main()                                       \n"
+		"{                                                 \n"
+		"    gl_Position = vec4(in_position.xy, 0.0, 1.0); \n"
+		"    vTexCoord = in_position.xy * 0.5 + 0.5;       \n"
+		"}                                                 \n";
+
+static const char *prepass_rgb_fs =
+		FRAGMENT_SHADER_EXTERNAL
+		"                                                  \n"
+		"varying vec2 vTexCoord;                           \n"
+		"                                                  \n"
+		"void main()                                       \n"
+		"{                                                 \n"
+		"    gl_FragColor = texture2D(uTex, vTexCoord);    \n"
+		"}                                                 \n";
+
+/* in the red channel, the only one of a GL_RED_EXT target */
+static const char *prepass_luma_fs =
+		FRAGMENT_SHADER_EXTERNAL
+		"                                                  \n"
+		"varying vec2 vTexCoord;                           \n"
+		"                                                  \n"
+		"void main()                                       \n"
+		"{                                                 \n"
+		"    vec3 c = texture2D(uTex, vTexCoord).rgb;      \n"
+		"    gl_FragColor = vec4(vec3(dot(c,               \n"
+		"                   vec3(0.2126, 0.7152, 0.0722))),\n"
+		"                   1.0);                          \n"
+		"}                                                 \n";
+
+/* fragment_shader_source2 on PREPASS_LUMA: 8 fetches of one channel of a
+ * 2D texture per video pixel, instead of 9 fetches of the external image
+ * per cube pixel. The offsets are the ones of fragment_shader_source2,
+ * whatever the size of the frames (see draw_faces()). */
+static const char *prepass_edges_fs =
+		FRAGMENT_SHADER_2D
+		"                                                  \n"
+		"varying vec2 vTexCoord;                           \n"
+		"                                                  \n"
+		"void main()                                       \n"
+		"{                                                 \n"
+		"    vec2 uv = vTexCoord;                          \n"
+		"                                                  \n"
+		"    float dx = 3.0 / " CUBE_STR(CUBE_VID_TEX_WIDTH) ".0;\n"
+		"    float dy = 3.0 / " CUBE_STR(CUBE_VID_TEX_HEIGTH) ".0;\n"
+		"                                                  \n"
+		"    float _00 = texture2D(uTex,                   \n"
+		"                          uv + vec2(-dx,-dy)).r;  \n"
+		"    float _01 = texture2D(uTex,                   \n"
+		"                          uv + vec2(-dx,0.0)).r;  \n"
+		"    float _02 = texture2D(uTex,                   \n"
+		"                          uv + vec2(-dx, dy)).r;  \n"
+		"    float _10 = texture2D(uTex,                   \n"
+		"                          uv + vec2(0.0,-dy)).r;  \n"
+		"    float _12 = texture2D(uTex,                   \n"
+		"                          uv + vec2(0.0, dy)).r;  \n"
+		"    float _20 = texture2D(uTex,                   \n"
+		"                          uv + vec2( dx,-dy)).r;  \n"
+		"    float _21 = texture2D(uTex,                   \n"
+		"                          uv + vec2( dx,0.0)).r;  \n"
+		"    float _22 = texture2D(uTex,                   \n"
+		"                          uv + vec2( dx, dy)).r;  \n"
+		"                                                  \n"
+		"    float horiz = _00 + 2.0 * _01 + _02 - _20 -   \n"
+		"                  2.0 * _21 - _22;                \n"
+		"    float vert  = _00 + 2.0 * _10 + _20 - _02 -   \n"
+		"                  2.0 * _12 - _22;                \n"
+		"                                                  \n"
+		"    gl_FragColor = vec4(sqrt(horiz * horiz +      \n"
+		"                             vert * vert) /       \n"
+		"                        " PREPASS_SOBEL_SCALE ");\n"
+		"}                                                 \n";
+
+/* the effects drawn from the pre-pass: the usual ones on PREPASS_RGB, but
+ * the outline one with the Sobel magnitude of PREPASS_EDGES */
+static const char *prepass_fragment_shader_source0 =
+		FRAGMENT_SHADER_2D
+		FRAGMENT_SHADER_MAIN0;
+
+static const char *prepass_fragment_shader_source1 =
+		FRAGMENT_SHADER_2D
+		FRAGMENT_SHADER_MAIN1;
+
+static const char *prepass_fragment_shader_source2 =
+		FRAGMENT_SHADER_2D
+		"uniform float uFrame;                             \n"
+		"                                                  \n"
+		"varying vec4 vVaryingColor;                       \n"
+		"varying vec2 vTexCoord;                           \n"
+		"                                                  \n"
+		"void main()                                       \n"
+		"{                                                 \n"
+		"    vec2 uv = vTexCoord;                          \n"
+		"    float sobel = " PREPASS_SOBEL_SCALE " *       \n"
+		"                  texture2D(uTex, uv).r;          \n"
+		"    vec3 col = 0.5 + 0.5 * cos(uFrame +           \n"
+		"               uv.xyx + vec3(0,2,4));             \n"
+		"    gl_FragColor = vVaryingColor *                \n"
+		"                   vec4(sobel * col, 1.0);        \n"
+		"}                                                 \n";
+
+static const char *prepass_fragment_shader_source3 =
+		FRAGMENT_SHADER_2D
+		FRAGMENT_SHADER_MAIN3;
+
 struct _sharder_list {
 	const char *name;
 	const char **source;
+	const char **prepass_source;
 };
 
 static struct _sharder_list fragment_shader_sources[MAX_PROG] = {
-	{ "legacy",                        &fragment_shader_source0 },
-	{ "Fisheye/Pinch",                 &fragment_shader_source1 },
-	{ "Derivative Outline effect",     &fragment_shader_source2 },
-	{ "Sobel edge detection operator", &fragment_shader_source3 }
+	{ "legacy",                        &fragment_shader_source0,
+	  &prepass_fragment_shader_source0 },
+	{ "Fisheye/Pinch",                 &fragment_shader_source1,
+	  &prepass_fragment_shader_source1 },
+	{ "Derivative Outline effect",     &fragment_shader_source2,
+	  &prepass_fragment_shader_source2 },
+	{ "Sobel edge detection operator", &fragment_shader_source3,
+	  &prepass_fragment_shader_source3 }
 };
 
+static int
+prepass_program(struct blit_ctx *blit, const char *fs_src)
+{
+	int ret;
+
+	ret = create_program(prepass_vs, fs_src);
+	if (ret < 0)
+		return -1;
+
+	blit->prg = ret;
+
+	cube_bind_attrib_locations(blit->prg);
+
+	ret = link_program(blit->prg);
+	if (ret)
+		return -1;
+
+	blit->attr.texture = glGetUniformLocation(blit->prg, "uTex");
+
+	return 0;
+}
+
+/* (Re)allocate the targets at 'width' x 'height', the size of the frames:
+ * the framebuffers keep their attachments */
+static int
+prepass_resize(struct window *w, struct prepass_ctx *pp, int width,
+	       int height)
+{
+	GLenum format, status = GL_FRAMEBUFFER_COMPLETE;
+	int i;
+
+	for (i = 0; i < PREPASS_TARGETS; i++) {
+		format = i == PREPASS_RGB ? GL_RGBA : pp->luma_format;
+		glBindTexture(GL_TEXTURE_2D, pp->tex[i]);
+		glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0,
+			     format, GL_UNSIGNED_BYTE, NULL);
+
+		glBindFramebuffer(GL_FRAMEBUFFER, pp->fbo[i]);
+		status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+		if (status != GL_FRAMEBUFFER_COMPLETE) {
+			printf("pre-pass framebuffer incomplete at %dx%d: "
+			       "0x%x\n", width, height, status);
+			break;
+		}
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glBindFramebuffer(GL_FRAMEBUFFER, w->offscreen_fbo);
+
+	pp->width = width;
+	pp->height = height;
+	pp->valid = false;
+
+	return status == GL_FRAMEBUFFER_COMPLETE ? 0 : -1;
+}
+
+/* delete the pre-pass, the faces must then be drawn from the external
+ * image, see start_faces() */
+static void
+fini_prepass(struct gl *pgl)
+{
+	struct prepass_ctx *pp = &pgl->prepass;
+
+	if (pp->rgb.prg)
+		glDeleteProgram(pp->rgb.prg);
+	if (pp->luma.prg)
+		glDeleteProgram(pp->luma.prg);
+	if (pp->edges.prg)
+		glDeleteProgram(pp->edges.prg);
+	if (pp->fbo[PREPASS_RGB]) {
+		glDeleteFramebuffers(PREPASS_TARGETS, pp->fbo);
+		glDeleteTextures(PREPASS_TARGETS, pp->tex);
+	}
+
+	memset(pp, 0, sizeof(*pp));
+}
+
+static int
+init_prepass(struct window *w, struct gl *pgl)
+{
+	struct prepass_ctx *pp = &pgl->prepass;
+	int i;
+
+	if (prepass_program(&pp->rgb, prepass_rgb_fs) ||
+	    prepass_program(&pp->luma, prepass_luma_fs) ||
+	    prepass_program(&pp->edges, prepass_edges_fs)) {
+		fini_prepass(pgl);
+		return -1;
+	}
+
+	/* luminance is not color-renderable: without GL_EXT_texture_rg,
+	 * the luma goes in the red channel of an RGBA target */
+	pp->luma_format = w->display->egl.has_texture_rg ? GL_RED_EXT :
+							   GL_RGBA;
+
+	glGenTextures(PREPASS_TARGETS, pp->tex);
+	glGenFramebuffers(PREPASS_TARGETS, pp->fbo);
+	for (i = 0; i < PREPASS_TARGETS; i++) {
+		glBindTexture(GL_TEXTURE_2D, pp->tex[i]);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+				GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER,
+				GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S,
+				GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T,
+				GL_CLAMP_TO_EDGE);
+
+		glBindFramebuffer(GL_FRAMEBUFFER, pp->fbo[i]);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+				       GL_TEXTURE_2D, pp->tex[i], 0);
+	}
+
+	/* resized to the frames by run_prepass(), this size is only to
+	 * check that the formats can be rendered to */
+	if (prepass_resize(w, pp, CUBE_VID_TEX_WIDTH, CUBE_VID_TEX_HEIGTH)) {
+		fini_prepass(pgl);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Render the current video frame into the pre-pass textures, unless they
+ * already hold it. Before window_begin_frame(): the scissor of the
+ * previous frame is dropped, and the viewport is the caller's to set.
+ * Fails if the targets cannot take the size of the frame. */
+static int
+run_prepass(struct window *w, struct gl *pgl)
+{
+	struct prepass_ctx *pp = &pgl->prepass;
+	unsigned seq = video_frame_seq(pgl->decoder);
+	int width, height;
+
+	if (pp->valid && pp->seq == seq)
+		return 0;
+
+	/* the size of the frames changes with the caps */
+	video_frame_size(pgl->decoder, &width, &height);
+	if ((width != pp->width || height != pp->height) &&
+	    prepass_resize(w, pp, width, height))
+		return -1;
+
+	glDisable(GL_SCISSOR_TEST);
+	glViewport(0, 0, pp->width, pp->height);
+	cube_mesh_bind(&pgl->mesh, &w->display->egl);
+
+	/* the external texture is bound to unit 0 */
+	glBindFramebuffer(GL_FRAMEBUFFER, pp->fbo[PREPASS_RGB]);
+	glUseProgram(pp->rgb.prg);
+	glUniform1i(pp->rgb.attr.texture, 0);
+	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+
+	/* only the outline effect needs the luma and the edges */
+	if (w->animated) {
+		glBindFramebuffer(GL_FRAMEBUFFER, pp->fbo[PREPASS_LUMA]);
+		glUseProgram(pp->luma.prg);
+		glUniform1i(pp->luma.attr.texture, 0);
+		glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+
+		glBindFramebuffer(GL_FRAMEBUFFER, pp->fbo[PREPASS_EDGES]);
+		glUseProgram(pp->edges.prg);
+		glUniform1i(pp->edges.attr.texture, 0);
+		glBindTexture(GL_TEXTURE_2D, pp->tex[PREPASS_LUMA]);
+		glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+	}
+
+	glBindFramebuffer(GL_FRAMEBUFFER, w->offscreen_fbo);
+
+	pp->seq = seq;
+	pp->valid = true;
+
+	return 0;
+}
+
+static void
+preroll_next_video(struct window *w)
+{
+	struct display *d = w->display;
+	struct gl *pgl = w->gl;
+	int next = (pgl->idx + 1) % pgl->filenames_count;
+
+	pgl->next_decoder = video_init(&d->egl, &d->gbm, pgl->filenames[next],
+				       w->cam_fps, w->geometry.width,
+				       w->geometry.height, VIDEO_FLAG_PREROLL);
+}
+
+/* Switch to the next file of the playlist, on a frame boundary: the next
+ * decoder is already prerolled and the current one is stopped in the
+ * background.
+ */
+static void
+next_video(struct window *w)
+{
+	struct display *d = w->display;
+	struct gl *pgl = w->gl;
+
+	video_set_wakeup_fd(pgl->decoder, -1);
+	video_deinit_async(pgl->decoder);
+	pgl->idx = (pgl->idx + 1) % pgl->filenames_count;
+
+	pgl->decoder = pgl->next_decoder;
+	pgl->next_decoder = NULL;
+	pgl->prepass.valid = false;
+	if (!pgl->decoder)
+		pgl->decoder = video_init(&d->egl, &d->gbm,
+					  pgl->filenames[pgl->idx],
+					  w->cam_fps, w->geometry.width,
+					  w->geometry.height, 0);
+	else
+		video_play(pgl->decoder);
+	if (pgl->decoder)
+		video_set_wakeup_fd(pgl->decoder, w->wakeup_fd);
+
+	preroll_next_video(w);
+}
+
+/* draw faces 'first' to 'first + count - 1' with the program of 'face' */
+static void
+draw_faces(struct window *w, struct face_ctx *face, ESMatrix4x4 *modelview,
+	   ESMatrix4x4 *modelviewprojection, float normal[9],
+	   int first, int count)
+{
+	glUseProgram(face->prg);
+	if (face->input)
+		glBindTexture(GL_TEXTURE_2D, face->input);
+	glUniformMatrix4fv(face->attr.modelviewmatrix, 1, GL_FALSE,
+			   &modelview->m4x4[0][0]);
+	glUniformMatrix4fv(face->attr.modelviewprojectionmatrix, 1,
+			   GL_FALSE, &modelviewprojection->m4x4[0][0]);
+	glUniformMatrix3fv(face->attr.normalmatrix, 1, GL_FALSE, normal);
+	glUniform1i(face->attr.texture, 0); /* '0' refers to texture unit 0. */
+	glUniform1f(face->attr.frame, (GLfloat)w->frames_cumul);
+	glUniform3f(face->attr.reso, (GLfloat)CUBE_VID_TEX_WIDTH,
+		    (GLfloat)CUBE_VID_TEX_HEIGTH, 0.0f);
+
+	cube_grid_draw(w, face->attr.modelviewmatrix,
+		       face->attr.modelviewprojectionmatrix,
+		       face->attr.normalmatrix, first, count);
+}
+
+static void
+face_init_uniforms(struct face_ctx *face)
+{
+	face->prg = face->build.program;
+	face->attr.modelviewmatrix =
+		glGetUniformLocation(face->prg, "modelviewMatrix");
+	face->attr.modelviewprojectionmatrix =
+		glGetUniformLocation(face->prg, "modelviewprojectionMatrix");
+	face->attr.normalmatrix = glGetUniformLocation(face->prg,
+						       "normalMatrix");
+	face->attr.texture = glGetUniformLocation(face->prg, "uTex");
+	face->attr.reso = glGetUniformLocation(face->prg, "uReso");
+	face->attr.frame = glGetUniformLocation(face->prg, "uFrame");
+}
+
+/* 'face' once its program is built (now if 'build' is set), NULL until
+ * then */
+static struct face_ctx *
+face_ready(struct face_ctx *face, bool build)
+{
+	if (!face->prg) {
+		if (!deferred_program_poll(&face->build, build))
+			return NULL;
+		face_init_uniforms(face);
+	}
+
+	return face;
+}
+
+/* The program of face 'i' once built, the legacy one (face 0) standing
+ * in until then */
+static struct face_ctx *
+get_face(struct window *w, struct gl *pgl, int i, bool build)
+{
+	struct face_ctx *face;
+
+	if (!w->animated)
+		return &pgl->face[0];
+
+	face = face_ready(&pgl->face[i], build);
+
+	return face ? face : &pgl->face[0];
+}
+
+/* Without GL_KHR_parallel_shader_compile, the effects are linked here, one
+ * per frame once the first frame is on screen */
+static void
+build_next_face(struct window *w, struct gl *pgl)
+{
+	int i;
+
+	if (!w->animated || w->display->egl.has_parallel_shader_compile)
+		return;
+
+	for (i = 1; i < MAX_PROG; i++) {
+		if (pgl->face[i].prg || pgl->face[i].build.failed)
+			continue;
+		face_ready(&pgl->face[i], true);
+		return;
+	}
+}
+
+/* Start the builds of the programs of the faces, on the pre-pass if it is
+ * set up. The first frame only needs the legacy shader, built here, the
+ * others are built in the background or by build_next_face(). */
+static int
+start_faces(struct window *w, struct gl *pgl)
+{
+	int i;
+
+	for (i = 0; i < MAX_PROG; i++) {
+		struct face_ctx *face = &pgl->face[i];
+		const char *fs_src = NULL;
+
+		deferred_program_fini(&face->build);
+		face->prg = 0;
+		face->input = 0;
+		/* without animation, all the faces use the legacy shader */
+		if (i && !w->animated)
+			continue;
+
+		if (pgl->prepass.fbo[PREPASS_RGB]) {
+			fs_src = *fragment_shader_sources[i].prepass_source;
+			face->input = pgl->prepass.tex[i == 2 ? PREPASS_EDGES :
+						       PREPASS_RGB];
+		} else {
+			fs_src = *fragment_shader_sources[i].source;
+		}
+
+		printf("Creating shader: \"%s\"%s\n",
+		       fragment_shader_sources[i].name,
+		       face->input ? " on the pre-pass" : "");
+		deferred_program_start(&face->build, &w->display->egl,
+				       cube_grid_vertex_shader(w,
+						vertex_shader_source),
+				       fs_src);
+	}
+
+	return face_ready(&pgl->face[0], true) ? 0 : -1;
+}
+
+/* Predict when the frame drawn now will be on screen: from the display
+ * timing reported by the compositor when it supports wp_presentation,
+ * else assume that the draws are throttled to one per refresh and that
+ * the frame is presented on the next one. */
+static uint64_t
+predict_presentation(struct gl *pgl)
+{
+	struct timespec ts;
+	uint64_t now, interval, target;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+
+	if (pgl->last_draw) {
+		interval = now - pgl->last_draw;
+		/* smooth out the scheduling jitter, ignore the stalls */
+		if (interval < 100000000)
+			pgl->refresh = pgl->refresh ?
+				(pgl->refresh * 7 + interval) / 8 : interval;
+	}
+	pgl->last_draw = now;
+
+	target = presentation_predict(now);
+	if (target)
+		return target;
+
+	return now + (pgl->refresh ? pgl->refresh : 16666667);
+}
+
 static void draw_cube_video(void *data, struct wl_callback *callback)
 {
 	struct window *w = data;
 	struct display *d = w->display;
 	struct gl *pgl;
-	struct timeval tv;
+	struct face_ctx *uber;
 	struct point move;
-	static const uint32_t benchmark_interval = 5;
-	uint32_t time;
 	ESMatrix4x4 modelview;
 	EGLImage frame;
-	EGLint buffer_age = 0;
-	EGLint rect[8];
+	EGLint buffer_age;
 
 	assert(w->callback == callback);
 	w->callback = NULL;
 	if (callback)
 		wl_callback_destroy(callback);
 
-	gettimeofday(&tv, NULL);
-	time = tv.tv_sec * 1000 + tv.tv_usec / 1000;
-	if (w->frames == 0)
-		w->benchmark_time = time;
-	if (time - w->benchmark_time > (benchmark_interval * 1000)) {
-		printf("%d frames in %d seconds: %f fps\n",
-		       w->frames,
-		       benchmark_interval,
-		       (float) w->frames / benchmark_interval);
-		w->benchmark_time = time;
-		w->frames = 0;
-	}
+	telemetry_frame_begin(&d->egl);
 
-	if (d->egl.swap_buffers_with_damage)
-		eglQuerySurface(d->egl.dpy, w->egl_surface,
-				EGL_BUFFER_AGE_EXT, &buffer_age);
+	buffer_age = window_buffer_age(w);
 
 	pgl = w->gl;
 
-	if (pgl->last_fence) {
-		d->egl.eglClientWaitSyncKHR(d->egl.dpy, pgl->last_fence,
-					    0, EGL_FOREVER_KHR);
-		d->egl.eglDestroySyncKHR(d->egl.dpy, pgl->last_fence);
-		pgl->last_fence = NULL;
-	}
+	frame_trace_poll();
 
-	frame = video_frame(pgl->decoder);
-	if (!frame) {
-		/* end of stream */
-		glDeleteTextures(1, &pgl->texhandle);
-		glGenTextures(1, &pgl->texhandle);
-		video_deinit(pgl->decoder);
-		pgl->idx = (pgl->idx + 1) % pgl->filenames_count;
-		pgl->decoder = video_init(&d->egl, &d->gbm,
-					  pgl->filenames[pgl->idx],
-					  w->cam_fps);
-	}
+	if (video_eos(pgl->decoder))
+		next_video(w);
+
+	/* never blocks: returns the current frame again when the decoder
+	 * has not produced a new one yet */
+	frame = video_frame(pgl->decoder, predict_presentation(pgl));
 
 	glActiveTexture(GL_TEXTURE0);
 	glBindTexture(GL_TEXTURE_EXTERNAL_OES, pgl->texhandle);
@@ -500,26 +1102,24 @@ static void draw_cube_video(void *data, struct wl_callback *callback)
 			GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_WRAP_T,
 			GL_CLAMP_TO_EDGE);
-	d->egl.glEGLImageTargetTexture2DOES(GL_TEXTURE_EXTERNAL_OES, frame);
+	if (frame)
+		d->egl.glEGLImageTargetTexture2DOES(GL_TEXTURE_EXTERNAL_OES,
+						    frame);
+
+	/* the uber shader is built the first time it is selected, and
+	 * samples the frame itself */
+	uber = w->uber_shader ? face_ready(&pgl->uber, true) : NULL;
+	if (pgl->prepass.fbo[PREPASS_RGB] && frame && !uber &&
+	    run_prepass(w, pgl)) {
+		printf("cannot resize the pre-pass, drawing without\n");
+		fini_prepass(pgl);
+		start_faces(w, pgl);
+	}
 
 	glViewport(0, 0, w->geometry.width, w->geometry.height);
 	pgl->aspect = (GLfloat)(w->geometry.height) /
 		(GLfloat)(w->geometry.width);
 
-	/* clear the color buffer */
-	glClearColor(CUBE_RED, CUBE_GREEN, CUBE_BLUE, CUBE_ALPHA);
-#ifdef DAMAGE_DEBUG
-	glClearColor((GLfloat)(w->frames_cumul % 255) / 255.0f,
-		     0.0, 0.0, 0.5);
-#endif
-	glClear(GL_COLOR_BUFFER_BIT);
-
-	if (w->background) {
-		glUseProgram(pgl->blit.prg);
-		glUniform1i(pgl->blit.attr.texture, 0); /* '0' refers to texture unit 0. */
-		glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-	}
-
 	esMatrixLoadIdentity(&modelview);
 	move = w->move;
 	esTranslate(&modelview, move.x / w->pitch.x, -move.y / w->pitch.y,
@@ -542,6 +1142,28 @@ static void draw_cube_video(void *data, struct wl_callback *callback)
 	ESMatrix4x4 modelviewprojection;
 	esMatrixLoadIdentity(&modelviewprojection);
 	esMatrixMultiply(&modelviewprojection, &modelview, &projection);
+	if (cube_grid_enabled(w))
+		cube_grid_update(w, &projection);
+	else
+		cube_damage(w, &modelviewprojection);
+
+	window_begin_frame(w, buffer_age, !w->background);
+
+	/* clear the color buffer */
+	glClearColor(CUBE_RED, CUBE_GREEN, CUBE_BLUE, CUBE_ALPHA);
+#ifdef DAMAGE_DEBUG
+	glClearColor((GLfloat)(w->frames_cumul % 255) / 255.0f,
+		     0.0, 0.0, 0.5);
+#endif
+	glClear(GL_COLOR_BUFFER_BIT);
+
+	cube_mesh_bind(&pgl->mesh, &d->egl);
+
+	if (w->background) {
+		glUseProgram(pgl->blit.prg);
+		glUniform1i(pgl->blit.attr.texture, 0); /* '0' refers to texture unit 0. */
+		glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+	}
 
 	float normal[9];
 	normal[0] = modelview.m4x4[0][0];
@@ -554,122 +1176,29 @@ static void draw_cube_video(void *data, struct wl_callback *callback)
 	normal[7] = modelview.m4x4[2][1];
 	normal[8] = modelview.m4x4[2][2];
 
-	{
-		struct face_ctx *face = &pgl->face[2];
-
-		glUseProgram(face->prg);
-		glUniformMatrix4fv(face->attr.modelviewmatrix, 1, GL_FALSE,
-				   &modelview.m4x4[0][0]);
-		glUniformMatrix4fv(face->attr.modelviewprojectionmatrix, 1,
-				   GL_FALSE, &modelviewprojection.m4x4[0][0]);
-		glUniformMatrix3fv(face->attr.normalmatrix, 1, GL_FALSE,
-				   normal);
-		glUniform1i(face->attr.texture, 0); /* '0' refers to texture unit 0. */
-		glUniform1f(face->attr.frame, (GLfloat)w->frames_cumul);
-		glUniform3f(face->attr.reso, (GLfloat)CUBE_VID_TEX_WIDTH,
-			    (GLfloat)CUBE_VID_TEX_HEIGTH, 0.0f);
-
-	}
-	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-	glDrawArrays(GL_TRIANGLE_STRIP, 4, 4);
-
-	{
-		struct face_ctx *face = &pgl->face[3];
-
-		glUseProgram(face->prg);
-		glUniformMatrix4fv(face->attr.modelviewmatrix, 1, GL_FALSE,
-				   &modelview.m4x4[0][0]);
-		glUniformMatrix4fv(face->attr.modelviewprojectionmatrix, 1,
-				   GL_FALSE, &modelviewprojection.m4x4[0][0]);
-		glUniformMatrix3fv(face->attr.normalmatrix, 1, GL_FALSE,
-				   normal);
-		glUniform1i(face->attr.texture, 0); /* '0' refers to texture unit 0. */
-		glUniform1f(face->attr.frame, (GLfloat)w->frames_cumul);
-		glUniform3f(face->attr.reso, (GLfloat)CUBE_VID_TEX_WIDTH,
-			    (GLfloat)CUBE_VID_TEX_HEIGTH, 0.0f);
-
-	}
-	glDrawArrays(GL_TRIANGLE_STRIP, 8, 4);
-	glDrawArrays(GL_TRIANGLE_STRIP, 12, 4);
-
-	{
-		struct face_ctx *face = &pgl->face[0];
-
-		glUseProgram(face->prg);
-		glUniformMatrix4fv(face->attr.modelviewmatrix, 1, GL_FALSE,
-				   &modelview.m4x4[0][0]);
-		glUniformMatrix4fv(face->attr.modelviewprojectionmatrix, 1,
-				   GL_FALSE, &modelviewprojection.m4x4[0][0]);
-		glUniformMatrix3fv(face->attr.normalmatrix, 1, GL_FALSE,
-				   normal);
-		glUniform1i(face->attr.texture, 0); /* '0' refers to texture unit 0. */
-		glUniform1f(face->attr.frame, (GLfloat)w->frames_cumul);
-		glUniform3f(face->attr.reso, (GLfloat)CUBE_VID_TEX_WIDTH,
-			    (GLfloat)CUBE_VID_TEX_HEIGTH, 0.0f);
-
-	}
-	glDrawArrays(GL_TRIANGLE_STRIP, 16, 4);
-	glDrawArrays(GL_TRIANGLE_STRIP, 20, 4);
-
-	pgl->last_fence = d->egl.eglCreateSyncKHR(d->egl.dpy,
-						  EGL_SYNC_FENCE_KHR, NULL);
-
-	if (w->opaque) {
-		struct wl_region *region;
-
-		region = wl_compositor_create_region(w->display->compositor);
-		wl_region_add(region, 0, 0,
-			      w->geometry.width,
-			      w->geometry.height);
-		wl_surface_set_opaque_region(w->surface, region);
-		wl_region_destroy(region);
+	if (uber) {
+		draw_faces(w, uber, &modelview, &modelviewprojection,
+			   normal, 0, CUBE_FACES);
 	} else {
-		wl_surface_set_opaque_region(w->surface, NULL);
+		draw_faces(w, get_face(w, pgl, 2, false), &modelview,
+			   &modelviewprojection, normal, 0, 2);
+		draw_faces(w, get_face(w, pgl, 3, false), &modelview,
+			   &modelviewprojection, normal, 2, 2);
+		draw_faces(w, get_face(w, pgl, 0, false), &modelview,
+			   &modelviewprojection, normal, 4, 2);
 	}
 
-	if (d->egl.swap_buffers_with_damage && !w->background) {
-		if (buffer_age > 0) {
-#ifdef DAMAGE_DEBUG
-			rect[0] = (EGLint)w->corner.x;
-			rect[1] = (EGLint)w->corner.y;
-			rect[2] = (EGLint)w->rect.x;
-			rect[3] = (EGLint)w->rect.y;
-#else
-			rect[0] = w->geometry.width  * DAMAGE_X_PERCENT +
-				move.x;
-			rect[1] = w->geometry.height * DAMAGE_Y_PERCENT -
-				move.y;
-			rect[2] = w->geometry.width  * DAMAGE_W_PERCENT;
-			rect[3] = w->geometry.height * DAMAGE_H_PERCENT ;
-#endif
-			memcpy(&rect[4], w->damage, 4 * sizeof(EGLint));
-			d->egl.swap_buffers_with_damage(d->egl.dpy,
-							w->egl_surface,
-							rect, 2);
-			memcpy(w->damage, rect, 4 * sizeof(EGLint));
+	video_frame_done(pgl->decoder);
+	frame_trace_stamp(FRAME_TRACE_DRAWN);
 
-#ifdef DAMAGE_DEBUG
-			printf("[1] {x,y}[w x h]: {%i,%i}[%i x %i]\n"
-			       "[2] {x,y}[w x h]: {%i,%i}[%i x %i]\n",
-			       rect[0], rect[1] ,rect[2] ,rect[3],
-			       rect[4], rect[5] ,rect[6] ,rect[7]);
-#endif
+	telemetry_frame_drawn(&d->egl);
 
-			wl_surface_damage(w->surface,
-					  rect[0], rect[1],
-					  rect[2], rect[3]);
-			wl_surface_commit(w->surface);
-		 } else {
-			w->damage[0] = 0;
-			w->damage[1] = 0;
-			w->damage[2] = w->geometry.width;
-			w->damage[3] = w->geometry.height;
-			eglSwapBuffers(d->egl.dpy, w->egl_surface);
-		 }
-	} else {
-		eglSwapBuffers(d->egl.dpy, w->egl_surface);
-	}
-	w->frames++;
+	window_present(w, buffer_age, !w->background);
+	frame_trace_stamp(FRAME_TRACE_SWAPPED);
+	frame_trace_end();
+	build_next_face(w, pgl);
+
+	telemetry_frame_end();
 	if (w->frames_cumul++ >= FRAME_CUMUL_RESET_VALUE) {
 		printf("Reseting !!\n");
 		w->frames_cumul  = 0;
@@ -679,6 +1208,10 @@ static void draw_cube_video(void *data, struct wl_callback *callback)
 static void
 next_video_shader(void *data) {
 	struct window *w = data;
+	int i;
+
+	for (i = 1; i < MAX_PROG; i++)
+		get_face(w, w->gl, i, true);
 
 	w->gl->shad_id = (w->gl->shad_id + 1) % MAX_PROG;
 	printf("\nUsing Shader: \"%s\"\n",
@@ -701,6 +1234,8 @@ init_cube_video(struct window *w, const char *filenames)
 	    egl_check(&d->egl, eglClientWaitSyncKHR))
 		goto end;
 
+	frame_trace_init();
+
 	fnames = strdup(filenames);
 	while ((s = strstr(fnames, ","))) {
 		pgl->filenames[i] = fnames;
@@ -711,28 +1246,29 @@ init_cube_video(struct window *w, const char *filenames)
 	pgl->filenames[i] = fnames;
 	pgl->filenames_count = ++i;
 
+	/* a file played on its own is looped without any rebuild */
 	pgl->decoder = video_init(&d->egl, &d->gbm, pgl->filenames[pgl->idx],
-				  w->cam_fps);
+				  w->cam_fps, w->geometry.width,
+				  w->geometry.height, pgl->filenames_count == 1 ?
+				  VIDEO_FLAG_LOOP : 0);
 	if (!pgl->decoder) {
 		printf("cannot create video decoder\n");
 		goto end;
 	}
+	video_set_wakeup_fd(pgl->decoder, w->wakeup_fd);
+	if (pgl->filenames_count > 1)
+		preroll_next_video(w);
 
 	pgl->aspect = (GLfloat)(w->geometry.width) /
 		(GLfloat)(w->geometry.height);
 
-	pgl->pos = 0;
-	pgl->tex = 1;
-	pgl->normal = 2;
-
 	ret = create_program(blit_vs, blit_fs);
 	if (ret < 0)
 		goto end;
 
 	pgl->blit.prg = ret;
 
-	glBindAttribLocation(pgl->blit.prg, pgl->pos, "in_position");
-	glBindAttribLocation(pgl->blit.prg, pgl->tex, "in_TexCoord");
+	cube_bind_attrib_locations(pgl->blit.prg);
 
 	ret = link_program(pgl->blit.prg);
 	if (ret)
@@ -741,78 +1277,37 @@ init_cube_video(struct window *w, const char *filenames)
 	pgl->blit.attr.texture = glGetUniformLocation(pgl->blit.prg,
 						      "uTex");
 
-	for (i = 0; i < MAX_PROG; i++) {
-		struct face_ctx *face = &pgl->face[i];
-		int shader = 0;
-
-		if (w->animated)
-			shader = i;
-
-		printf("Creating shader: \"%s\"\n",
-		       fragment_shader_sources[shader].name);
-		ret = create_program(vertex_shader_source,
-				     *fragment_shader_sources[shader].source);
-		if (ret < 0)
-			goto end;
-		face->prg = ret;
-
-		glBindAttribLocation(face->prg, pgl->pos,
-				     "in_position");
-		glBindAttribLocation(face->prg, pgl->tex,
-				     "in_TexCoord");
-		glBindAttribLocation(face->prg, pgl->normal,
-				     "in_normal");
-
-		ret = link_program(face->prg);
-		if (ret)
-			goto end;
-
-		face->attr.modelviewmatrix =
-			glGetUniformLocation(face->prg,
-					     "modelviewMatrix");
-		face->attr.modelviewprojectionmatrix =
-			glGetUniformLocation(face->prg,
-					     "modelviewprojectionMatrix");
-		face->attr.normalmatrix = glGetUniformLocation(face->prg,
-							       "normalMatrix");
-		face->attr.texture = glGetUniformLocation(face->prg,
-							  "uTex");
-		face->attr.reso = glGetUniformLocation(face->prg, "uReso");
-		face->attr.frame = glGetUniformLocation(face->prg, "uFrame");
-	}
+	if (w->video_prepass && init_prepass(w, pgl))
+		printf("cannot set up the pre-pass, drawing without\n");
+
+	printf("Creating shader: \"uber\"\n");
+	pgl->uber.prg = 0;
+	deferred_program_start(&pgl->uber.build, &d->egl,
+			       cube_grid_vertex_shader(w,
+						uber_vertex_shader_source),
+			       uber_fragment_shader_source);
+
+	if (start_faces(w, pgl))
+		goto end;
+	if (w->animated && !d->egl.has_parallel_shader_compile)
+		printf("Effects are built one per frame\n");
 
 	glViewport(0, 0, w->geometry.width, w->geometry.width);
 	glEnable(GL_CULL_FACE);
 
-	pgl->positionsoffset = 0;
-	pgl->texcoordsoffset = sizeof(vVertices);
-	pgl->normalsoffset = sizeof(vVertices) + sizeof(vTexCoords);
-
-	glGenBuffers(1, &pgl->vbo);
-	glBindBuffer(GL_ARRAY_BUFFER, pgl->vbo);
-	glBufferData(GL_ARRAY_BUFFER,
-		     sizeof(vVertices) + sizeof(vTexCoords) + sizeof(vNormals),
-		     0, GL_STATIC_DRAW);
-	glBufferSubData(GL_ARRAY_BUFFER, pgl->positionsoffset,
-			sizeof(vVertices), &vVertices[0]);
-	glBufferSubData(GL_ARRAY_BUFFER, pgl->texcoordsoffset,
-			sizeof(vTexCoords), &vTexCoords[0]);
-	glBufferSubData(GL_ARRAY_BUFFER, pgl->normalsoffset,
-			sizeof(vNormals), &vNormals[0]);
-	glVertexAttribPointer(pgl->pos, 3, GL_FLOAT, GL_FALSE, 0,
-			      (const GLvoid *)(intptr_t)pgl->positionsoffset);
-	glEnableVertexAttribArray(pgl->pos);
-	glVertexAttribPointer(pgl->tex, 2, GL_FLOAT, GL_FALSE, 0,
-			      (const GLvoid *)(intptr_t)pgl->texcoordsoffset);
-	glEnableVertexAttribArray(pgl->tex);
-	glVertexAttribPointer(pgl->normal, 3, GL_FLOAT, GL_FALSE, 0,
-			      (const GLvoid *)(intptr_t)pgl->normalsoffset);
-	glEnableVertexAttribArray(pgl->normal);
+	/* without animation, every face uses the legacy effect */
+	if (cube_mesh_init(&pgl->mesh, &d->egl, vTexCoords, NULL,
+			   w->animated ? vEffects : NULL))
+		goto end;
+	if (!w->animated)
+		glVertexAttrib1f(CUBE_ATTR_EFFECT, 0.0f);
 
 	glGenTextures(1, &pgl->texhandle);
 
 	pgl->shad_id = 0;
 
+	printf("Using %s shader\n", w->uber_shader ? "uber" : "per-face");
+
 	w->next_shader = next_video_shader;
 	w->redraw = draw_cube_video;
 	w->gl = pgl;
@@ -820,3 +1315,38 @@ end:
 	return;
 }
 
+void
+fini_cube_video(struct window *w)
+{
+	struct display *d = w->display;
+	struct gl *pgl = &gl_video;
+	int i;
+
+	/* the streaming threads use the GBM device and the EGL display */
+	if (pgl->next_decoder)
+		video_deinit(pgl->next_decoder);
+	if (pgl->decoder)
+		video_deinit(pgl->decoder);
+
+	for (i = 0; i < MAX_PROG; i++)
+		deferred_program_fini(&pgl->face[i].build);
+	deferred_program_fini(&pgl->uber.build);
+	if (pgl->blit.prg)
+		glDeleteProgram(pgl->blit.prg);
+
+	fini_prepass(pgl);
+
+	cube_mesh_fini(&pgl->mesh, &d->egl);
+	if (pgl->texhandle)
+		glDeleteTextures(1, &pgl->texhandle);
+
+	/* the other names point in the same strdup() */
+	free((char *)pgl->filenames[0]);
+
+	memset(pgl, 0, sizeof(*pgl));
+	if (w->gl == pgl)
+		w->gl = NULL;
+	w->redraw = NULL;
+	w->next_shader = NULL;
+}
+
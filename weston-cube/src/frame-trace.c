@@ -0,0 +1,399 @@
+/*
+ * Copyright (c) 2019 STMicroelectronics. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cube-common.h"
+#include "frame-trace.h"
+
+/* bucket i counts the latencies in [2^(i-1), 2^i) us, bucket 0 the ones
+ * below 1us */
+#define NUM_BUCKETS	24
+/* frames stamped by the streaming threads, not picked up yet */
+#define NUM_PENDING	64
+/* frames swapped, waiting for their presentation feedback */
+#define NUM_PRESENTING	8
+
+enum frame_trace_stage {
+	STAGE_DECODE,
+	STAGE_QUEUE,
+	STAGE_IMPORT,
+	STAGE_DRAW,
+	STAGE_SWAP,
+	STAGE_PRESENT,
+	STAGE_TOTAL,
+	NUM_STAGES
+};
+
+static const char *stage_names[NUM_STAGES] = {
+	"decode", "queue", "import", "draw", "swap", "present", "total",
+};
+
+struct histogram {
+	uint64_t count;
+	uint64_t sum, min, max;
+	uint64_t buckets[NUM_BUCKETS];
+};
+
+struct presenting_frame {
+	uint64_t id;
+	uint64_t first, swapped;
+};
+
+struct pending_frame {
+	const void *src;
+	uint64_t pts;
+	uint64_t t[FRAME_TRACE_APPSINK + 1];
+};
+
+static struct {
+	bool enabled;
+	const char *path;
+	uint64_t frames;
+	struct histogram stages[NUM_STAGES];
+	unsigned dump_seen;
+
+	pthread_mutex_t lock;
+	struct pending_frame pending[NUM_PENDING];
+	unsigned next_pending;
+
+	/* render thread only */
+	bool current_valid;
+	uint64_t current[FRAME_TRACE_POINTS];
+	uint64_t current_id, last_id;
+	struct presenting_frame presenting[NUM_PRESENTING];
+	unsigned next_presenting;
+} trace = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+uint64_t
+frame_trace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+bool
+frame_trace_enabled(void)
+{
+	return trace.enabled;
+}
+
+static void
+histogram_add(struct histogram *h, uint64_t ns)
+{
+	uint64_t us = ns / 1000;
+	unsigned bucket = 0;
+
+	while (us && bucket < NUM_BUCKETS - 1) {
+		us >>= 1;
+		bucket++;
+	}
+
+	if (!h->count || ns < h->min)
+		h->min = ns;
+	if (ns > h->max)
+		h->max = ns;
+	h->sum += ns;
+	h->count++;
+	h->buckets[bucket]++;
+}
+
+/* upper bound of the bucket holding the given percentile, in us */
+static uint64_t
+histogram_percentile(const struct histogram *h, unsigned percent)
+{
+	uint64_t rank = (h->count * percent + 99) / 100, seen = 0;
+	unsigned i;
+
+	for (i = 0; i < NUM_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= rank)
+			return 1ULL << i;
+	}
+
+	return 1ULL << (NUM_BUCKETS - 1);
+}
+
+static void
+frame_trace_dump(void)
+{
+	const char *sep;
+	FILE *f;
+	unsigned i, j;
+
+	f = fopen(trace.path, "w");
+	if (!f) {
+		fprintf(stderr, "cannot write frame trace to %s\n", trace.path);
+		return;
+	}
+
+	fprintf(f, "{\n  \"frames\": %llu,\n  \"stages\": {\n",
+		(unsigned long long)trace.frames);
+
+	for (i = 0; i < NUM_STAGES; i++) {
+		const struct histogram *h = &trace.stages[i];
+
+		fprintf(f, "    \"%s\": {\n", stage_names[i]);
+		fprintf(f, "      \"count\": %llu,\n",
+			(unsigned long long)h->count);
+		if (h->count) {
+			fprintf(f, "      \"min_us\": %llu,\n",
+				(unsigned long long)h->min / 1000);
+			fprintf(f, "      \"mean_us\": %llu,\n",
+				(unsigned long long)(h->sum / h->count) / 1000);
+			fprintf(f, "      \"max_us\": %llu,\n",
+				(unsigned long long)h->max / 1000);
+			fprintf(f, "      \"p50_us\": %llu,\n",
+				(unsigned long long)histogram_percentile(h, 50));
+			fprintf(f, "      \"p90_us\": %llu,\n",
+				(unsigned long long)histogram_percentile(h, 90));
+			fprintf(f, "      \"p99_us\": %llu,\n",
+				(unsigned long long)histogram_percentile(h, 99));
+		}
+
+		/* [upper bound in us, count] of the non empty buckets */
+		fprintf(f, "      \"buckets\": [");
+		for (j = 0, sep = ""; j < NUM_BUCKETS; j++) {
+			if (!h->buckets[j])
+				continue;
+			fprintf(f, "%s[%llu, %llu]", sep, 1ULL << j,
+				(unsigned long long)h->buckets[j]);
+			sep = ", ";
+		}
+		fprintf(f, "]\n    }%s\n", i < NUM_STAGES - 1 ? "," : "");
+	}
+
+	fprintf(f, "  }\n}\n");
+	fclose(f);
+
+	printf("Frame trace: %llu frames written to %s\n",
+	       (unsigned long long)trace.frames, trace.path);
+}
+
+bool
+frame_trace_init(void)
+{
+	if (trace.enabled)
+		return true;
+
+	trace.path = getenv("CUBE_FRAME_TRACE");
+	if (!trace.path || !trace.path[0])
+		return false;
+
+	cube_dump_signal_init();
+	trace.dump_seen = cube_dump_requests();
+
+	atexit(frame_trace_dump);
+
+	trace.enabled = true;
+	printf("Frame trace enabled, dumped to %s at exit or on SIGUSR1\n",
+	       trace.path);
+
+	return true;
+}
+
+void
+frame_trace_poll(void)
+{
+	if (!trace.enabled || cube_dump_requests() == trace.dump_seen)
+		return;
+
+	trace.dump_seen = cube_dump_requests();
+	frame_trace_dump();
+}
+
+static struct pending_frame *
+find_pending(const void *src, uint64_t pts)
+{
+	unsigned i;
+
+	for (i = 0; i < NUM_PENDING; i++)
+		if (trace.pending[i].src == src && trace.pending[i].pts == pts)
+			return &trace.pending[i];
+
+	return NULL;
+}
+
+void
+frame_trace_mark(const void *src, uint64_t pts, enum frame_trace_point point)
+{
+	struct pending_frame *frame;
+	uint64_t now;
+
+	if (!trace.enabled || point > FRAME_TRACE_APPSINK)
+		return;
+
+	now = frame_trace_now();
+
+	pthread_mutex_lock(&trace.lock);
+	frame = find_pending(src, pts);
+	if (!frame) {
+		/* oldest entries get recycled, frames dropped upstream are
+		 * never picked up */
+		frame = &trace.pending[trace.next_pending];
+		trace.next_pending = (trace.next_pending + 1) % NUM_PENDING;
+		memset(frame, 0, sizeof(*frame));
+		frame->src = src;
+		frame->pts = pts;
+	}
+	frame->t[point] = now;
+	pthread_mutex_unlock(&trace.lock);
+}
+
+void
+frame_trace_begin(const void *src, uint64_t pts)
+{
+	struct pending_frame *frame;
+
+	if (!trace.enabled)
+		return;
+
+	memset(trace.current, 0, sizeof(trace.current));
+
+	pthread_mutex_lock(&trace.lock);
+	frame = find_pending(src, pts);
+	if (frame) {
+		memcpy(trace.current, frame->t, sizeof(frame->t));
+		frame->src = NULL;
+	}
+	pthread_mutex_unlock(&trace.lock);
+
+	trace.current[FRAME_TRACE_PICKED] = frame_trace_now();
+	trace.current_valid = true;
+	trace.current_id = 0;
+}
+
+void
+frame_trace_stamp(enum frame_trace_point point)
+{
+	if (!trace.enabled || !trace.current_valid)
+		return;
+
+	trace.current[point] = frame_trace_now();
+}
+
+uint64_t
+frame_trace_await_presentation(void)
+{
+	if (!trace.enabled || !trace.current_valid)
+		return 0;
+
+	trace.current_id = ++trace.last_id;
+
+	return trace.current_id;
+}
+
+void
+frame_trace_end(void)
+{
+	static const struct {
+		enum frame_trace_point from, to;
+	} stages[NUM_STAGES - 1] = {
+		[STAGE_DECODE] = { FRAME_TRACE_DECODER_IN, FRAME_TRACE_APPSINK },
+		[STAGE_QUEUE] = { FRAME_TRACE_APPSINK, FRAME_TRACE_PICKED },
+		[STAGE_IMPORT] = { FRAME_TRACE_PICKED, FRAME_TRACE_IMPORTED },
+		[STAGE_DRAW] = { FRAME_TRACE_IMPORTED, FRAME_TRACE_DRAWN },
+		[STAGE_SWAP] = { FRAME_TRACE_DRAWN, FRAME_TRACE_SWAPPED },
+		[STAGE_PRESENT] = { FRAME_TRACE_SWAPPED, FRAME_TRACE_PRESENTED },
+	};
+	uint64_t first = 0, last = 0;
+	unsigned i;
+
+	if (!trace.enabled || !trace.current_valid)
+		return;
+
+	for (i = 0; i < NUM_STAGES - 1; i++) {
+		uint64_t from = trace.current[stages[i].from];
+		uint64_t to = trace.current[stages[i].to];
+
+		if (from && to >= from)
+			histogram_add(&trace.stages[i], to - from);
+	}
+
+	for (i = 0; i < FRAME_TRACE_POINTS; i++) {
+		if (!trace.current[i])
+			continue;
+		if (!first)
+			first = trace.current[i];
+		last = trace.current[i];
+	}
+
+	trace.frames++;
+	trace.current_valid = false;
+
+	/* the total is known once the frame is on screen, if the compositor
+	 * tells; an older frame still waiting is accounted as discarded */
+	if (trace.current_id) {
+		struct presenting_frame *frame =
+			&trace.presenting[trace.next_presenting];
+
+		if (frame->id)
+			frame_trace_presented(frame->id, 0);
+		frame->id = trace.current_id;
+		frame->first = first;
+		frame->swapped = trace.current[FRAME_TRACE_SWAPPED];
+		trace.next_presenting =
+			(trace.next_presenting + 1) % NUM_PRESENTING;
+		return;
+	}
+
+	histogram_add(&trace.stages[STAGE_TOTAL], last - first);
+}
+
+void
+frame_trace_presented(uint64_t id, uint64_t when)
+{
+	struct presenting_frame *frame = NULL;
+	unsigned i;
+
+	if (!trace.enabled || !id)
+		return;
+
+	for (i = 0; i < NUM_PRESENTING; i++) {
+		if (trace.presenting[i].id == id) {
+			frame = &trace.presenting[i];
+			break;
+		}
+	}
+	if (!frame)
+		return;
+
+	if (when && frame->swapped && when >= frame->swapped)
+		histogram_add(&trace.stages[STAGE_PRESENT],
+			      when - frame->swapped);
+	if (!when || when < frame->swapped)
+		when = frame->swapped;
+	if (frame->first && when >= frame->first)
+		histogram_add(&trace.stages[STAGE_TOTAL], when - frame->first);
+
+	frame->id = 0;
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2019 STMicroelectronics. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef FRAME_TRACE_H
+#define FRAME_TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Per-frame latency tracing of the video path. Each frame is stamped with
+ * CLOCK_MONOTONIC at every point below; the time spent between two points
+ * is accumulated in a histogram per stage. The histograms are dumped as
+ * JSON to the file named by the CUBE_FRAME_TRACE environment variable at
+ * exit and whenever SIGUSR1 is received. Tracing is disabled, and all the
+ * calls are no-ops, when the variable is not set.
+ *
+ * Frames are identified by their source (the decoder) and buffer PTS until
+ * the render loop picks them up; from then on there is a single current
+ * frame, owned by the render thread.
+ */
+
+enum frame_trace_point {
+	FRAME_TRACE_DECODER_IN,	/* demuxed buffer enters the decoder */
+	FRAME_TRACE_APPSINK,	/* decoded frame reaches the appsink */
+	FRAME_TRACE_PICKED,	/* frame taken by the render loop */
+	FRAME_TRACE_IMPORTED,	/* EGLImage ready */
+	FRAME_TRACE_DRAWN,	/* GL commands issued */
+	FRAME_TRACE_SWAPPED,	/* eglSwapBuffers() returned */
+	FRAME_TRACE_PRESENTED,	/* on screen */
+	FRAME_TRACE_POINTS
+};
+
+bool frame_trace_init(void);
+bool frame_trace_enabled(void);
+uint64_t frame_trace_now(void);
+
+/* streaming threads: stamp a frame identified by (src, pts) */
+void frame_trace_mark(const void *src, uint64_t pts,
+		      enum frame_trace_point point);
+
+/* render thread: the frame (src, pts) becomes the current one */
+void frame_trace_begin(const void *src, uint64_t pts);
+void frame_trace_stamp(enum frame_trace_point point);
+/* account the current frame in the histograms */
+void frame_trace_end(void);
+
+/* wp_presentation: the current frame will be reported by
+ * frame_trace_presented() ('when' is 0 if it was discarded) with the
+ * returned id, 0 when not tracing */
+uint64_t frame_trace_await_presentation(void);
+void frame_trace_presented(uint64_t id, uint64_t when);
+
+/* dump the histograms if SIGUSR1 was received since the last call */
+void frame_trace_poll(void);
+
+#endif
@@ -0,0 +1,311 @@
+/*
+ * Copyright (c) 2019 STMicroelectronics. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <drm_fourcc.h>
+
+#include <gst/allocators/gstdmabuf.h>
+#include <gst/video/gstvideometa.h>
+
+#include "gbm-buffer-pool.h"
+
+GST_DEBUG_CATEGORY_EXTERN(cube_video_debug);
+#define GST_CAT_DEFAULT cube_video_debug
+
+typedef struct _CubeGbmBufferPool {
+	GstBufferPool       parent;
+
+	struct gbm_device  *dev;
+	GstAllocator       *allocator;
+	GstVideoInfo        info;
+	uint32_t            format;
+	gboolean            add_videometa;
+	unsigned            allocated;
+} CubeGbmBufferPool;
+
+typedef struct _CubeGbmBufferPoolClass {
+	GstBufferPoolClass  parent_class;
+} CubeGbmBufferPoolClass;
+
+GType cube_gbm_buffer_pool_get_type(void);
+
+#define CUBE_TYPE_GBM_BUFFER_POOL (cube_gbm_buffer_pool_get_type())
+#define CUBE_GBM_BUFFER_POOL(obj) \
+	(G_TYPE_CHECK_INSTANCE_CAST((obj), CUBE_TYPE_GBM_BUFFER_POOL, \
+				    CubeGbmBufferPool))
+
+G_DEFINE_TYPE(CubeGbmBufferPool, cube_gbm_buffer_pool, GST_TYPE_BUFFER_POOL);
+
+uint32_t
+video_format_to_drm_fourcc(GstVideoFormat format)
+{
+	switch (format) {
+	case GST_VIDEO_FORMAT_I420:
+		return DRM_FORMAT_YUV420;
+	case GST_VIDEO_FORMAT_NV12:
+		return DRM_FORMAT_NV12;
+	case GST_VIDEO_FORMAT_YUY2:
+		return DRM_FORMAT_YUYV;
+	default:
+		return 0;
+	}
+}
+
+static GQuark
+gbm_bo_quark(void)
+{
+	static GQuark quark;
+
+	if (!quark)
+		quark = g_quark_from_static_string("cube-gbm-bo");
+
+	return quark;
+}
+
+static void
+gbm_bo_free(gpointer data)
+{
+	gbm_bo_destroy(data);
+}
+
+/* Allocate a linear BO able to hold one frame of 'info' and return the
+ * layout of its planes. The driver is asked for the real format first so
+ * that it picks the strides and offsets (only possible when upstream
+ * reads them from the video meta); when it cannot allocate YUV buffers,
+ * fall back to a plain byte buffer big enough for the layout computed by
+ * GStreamer.
+ */
+static struct gbm_bo *
+alloc_bo(struct gbm_device *dev, const GstVideoInfo *info, uint32_t format,
+	 bool native, gsize offset[GST_VIDEO_MAX_PLANES],
+	 gint stride[GST_VIDEO_MAX_PLANES])
+{
+	guint nplanes = GST_VIDEO_INFO_N_PLANES(info);
+	guint width = GST_VIDEO_INFO_WIDTH(info);
+	guint height = GST_VIDEO_INFO_HEIGHT(info);
+	guint stride0 = GST_VIDEO_INFO_PLANE_STRIDE(info, 0);
+	struct gbm_bo *bo;
+	guint i;
+
+	bo = native ? gbm_bo_create(dev, width, height, format,
+				    GBM_BO_USE_LINEAR) : NULL;
+	if (bo && gbm_bo_get_plane_count(bo) == (int)nplanes) {
+		for (i = 0; i < nplanes; i++) {
+			offset[i] = gbm_bo_get_offset(bo, i);
+			stride[i] = gbm_bo_get_stride_for_plane(bo, i);
+		}
+		return bo;
+	}
+	if (bo)
+		gbm_bo_destroy(bo);
+
+	/* NOTE: a linear R8 BO is a contiguous array of bytes, so any layout
+	 * fitting in its size is valid, whatever its actual pitch is. */
+	bo = gbm_bo_create(dev, stride0,
+			   (GST_VIDEO_INFO_SIZE(info) + stride0 - 1) / stride0,
+			   GBM_FORMAT_R8, GBM_BO_USE_LINEAR);
+	if (!bo)
+		return NULL;
+
+	for (i = 0; i < nplanes; i++) {
+		offset[i] = GST_VIDEO_INFO_PLANE_OFFSET(info, i);
+		stride[i] = GST_VIDEO_INFO_PLANE_STRIDE(info, i);
+	}
+
+	return bo;
+}
+
+bool
+gbm_buffer_pool_supports(struct gbm_device *dev, const GstVideoInfo *info)
+{
+	gsize offset[GST_VIDEO_MAX_PLANES];
+	gint stride[GST_VIDEO_MAX_PLANES];
+	uint32_t format;
+	struct gbm_bo *bo;
+
+	format = video_format_to_drm_fourcc(GST_VIDEO_INFO_FORMAT(info));
+	if (!dev || !format)
+		return false;
+
+	bo = alloc_bo(dev, info, format, true, offset, stride);
+	if (!bo)
+		return false;
+
+	gbm_bo_destroy(bo);
+
+	return true;
+}
+
+static const gchar **
+cube_gbm_buffer_pool_get_options(GstBufferPool *pool)
+{
+	static const gchar *options[] = {
+		GST_BUFFER_POOL_OPTION_VIDEO_META,
+		NULL
+	};
+
+	(void)pool;
+
+	return options;
+}
+
+static gboolean
+cube_gbm_buffer_pool_set_config(GstBufferPool *pool, GstStructure *config)
+{
+	CubeGbmBufferPool *self = CUBE_GBM_BUFFER_POOL(pool);
+	GstCaps *caps;
+	guint size, min, max;
+
+	if (!gst_buffer_pool_config_get_params(config, &caps, &size,
+					       &min, &max) || !caps) {
+		GST_ERROR("GBM pool configured without caps");
+		return FALSE;
+	}
+
+	if (!gst_video_info_from_caps(&self->info, caps)) {
+		GST_ERROR("GBM pool configured with invalid video caps");
+		return FALSE;
+	}
+
+	self->format =
+		video_format_to_drm_fourcc(GST_VIDEO_INFO_FORMAT(&self->info));
+	if (!self->format) {
+		GST_ERROR("GBM pool: unsupported format %s",
+			  gst_video_format_to_string(
+				GST_VIDEO_INFO_FORMAT(&self->info)));
+		return FALSE;
+	}
+
+	self->add_videometa =
+		gst_buffer_pool_config_has_option(config,
+					GST_BUFFER_POOL_OPTION_VIDEO_META);
+
+	return GST_BUFFER_POOL_CLASS(cube_gbm_buffer_pool_parent_class)->set_config(pool, config);
+}
+
+static GstFlowReturn
+cube_gbm_buffer_pool_alloc_buffer(GstBufferPool *pool, GstBuffer **buffer,
+				  GstBufferPoolAcquireParams *params)
+{
+	CubeGbmBufferPool *self = CUBE_GBM_BUFFER_POOL(pool);
+	GstVideoInfo *info = &self->info;
+	gsize offset[GST_VIDEO_MAX_PLANES] = { 0 };
+	gint stride[GST_VIDEO_MAX_PLANES] = { 0 };
+	struct gbm_bo *bo;
+	GstMemory *mem;
+	GstBuffer *buf;
+	off_t size;
+	int fd;
+
+	(void)params;
+
+	bo = alloc_bo(self->dev, info, self->format, self->add_videometa,
+		      offset, stride);
+	if (!bo) {
+		GST_ERROR("failed to allocate a %ux%u GBM BO",
+			  GST_VIDEO_INFO_WIDTH(info),
+			  GST_VIDEO_INFO_HEIGHT(info));
+		return GST_FLOW_ERROR;
+	}
+
+	fd = gbm_bo_get_fd(bo);
+	size = fd < 0 ? -1 : lseek(fd, 0, SEEK_END);
+	if (size < (off_t)GST_VIDEO_INFO_SIZE(info)) {
+		GST_ERROR("failed to export GBM BO %p", bo);
+		if (fd >= 0)
+			close(fd);
+		gbm_bo_destroy(bo);
+		return GST_FLOW_ERROR;
+	}
+	lseek(fd, 0, SEEK_SET);
+
+	/* the allocator owns the fd from now on, and the BO lives as long as
+	 * the memory wrapping it */
+	mem = gst_dmabuf_allocator_alloc(self->allocator, fd, size);
+	gst_mini_object_set_qdata(GST_MINI_OBJECT(mem), gbm_bo_quark(), bo,
+				  gbm_bo_free);
+
+	buf = gst_buffer_new();
+	gst_buffer_append_memory(buf, mem);
+
+	if (self->add_videometa)
+		gst_buffer_add_video_meta_full(buf, GST_VIDEO_FRAME_FLAG_NONE,
+					       GST_VIDEO_INFO_FORMAT(info),
+					       GST_VIDEO_INFO_WIDTH(info),
+					       GST_VIDEO_INFO_HEIGHT(info),
+					       GST_VIDEO_INFO_N_PLANES(info),
+					       offset, stride);
+
+	self->allocated++;
+	GST_DEBUG("GBM pool: buffer %u -> bo %p, fd %d, size %ld",
+		  self->allocated, bo, fd, (long)size);
+
+	*buffer = buf;
+
+	return GST_FLOW_OK;
+}
+
+static void
+cube_gbm_buffer_pool_finalize(GObject *object)
+{
+	CubeGbmBufferPool *self = CUBE_GBM_BUFFER_POOL(object);
+
+	if (self->allocator)
+		gst_object_unref(self->allocator);
+
+	G_OBJECT_CLASS(cube_gbm_buffer_pool_parent_class)->finalize(object);
+}
+
+static void
+cube_gbm_buffer_pool_class_init(CubeGbmBufferPoolClass *klass)
+{
+	GObjectClass *gobject_class = G_OBJECT_CLASS(klass);
+	GstBufferPoolClass *pool_class = GST_BUFFER_POOL_CLASS(klass);
+
+	gobject_class->finalize = cube_gbm_buffer_pool_finalize;
+
+	pool_class->get_options = cube_gbm_buffer_pool_get_options;
+	pool_class->set_config = cube_gbm_buffer_pool_set_config;
+	pool_class->alloc_buffer = cube_gbm_buffer_pool_alloc_buffer;
+}
+
+static void
+cube_gbm_buffer_pool_init(CubeGbmBufferPool *self)
+{
+	self->allocator = gst_dmabuf_allocator_new();
+}
+
+GstBufferPool *
+gbm_buffer_pool_new(struct gbm_device *dev)
+{
+	CubeGbmBufferPool *self;
+
+	self = g_object_new(CUBE_TYPE_GBM_BUFFER_POOL, NULL);
+	gst_object_ref_sink(self);
+	self->dev = dev;
+
+	return GST_BUFFER_POOL(self);
+}
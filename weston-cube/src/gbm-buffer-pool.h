@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2019 STMicroelectronics. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef GBM_BUFFER_POOL_H
+#define GBM_BUFFER_POOL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <gbm.h>
+#include <gst/gst.h>
+#include <gst/video/video.h>
+
+/* GstBufferPool whose buffers are linear GBM BOs exported as dmabuf
+ * GstMemory. It is proposed to upstream in the appsink allocation query
+ * so that software decoders write straight into memory that EGL can
+ * import, instead of system memory that has to be copied every frame.
+ */
+
+uint32_t video_format_to_drm_fourcc(GstVideoFormat format);
+
+bool gbm_buffer_pool_supports(struct gbm_device *dev,
+			      const GstVideoInfo *info);
+GstBufferPool *gbm_buffer_pool_new(struct gbm_device *dev);
+
+#endif
@@ -24,14 +24,20 @@
  */
 
 #include <assert.h>
+#include <errno.h>
 #include <gbm.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/stat.h>
 
 #include "cube-common.h"
+#include "frame-trace.h"
+#include "gbm-buffer-pool.h"
+#include "startup-trace.h"
 
 #include <gbm.h>
 #include <drm_fourcc.h>
@@ -55,82 +61,448 @@ yesno(int yes)
 }
 
 #if HAVE_GBM_BO_MAP
-struct _gdm_bo_map {
-	int             fd[MAX_NUM_PLANES];
-	struct gbm_bo * bo[MAX_NUM_PLANES];
-	void          * map[MAX_NUM_PLANES];
-	void          * map_data[MAX_NUM_PLANES];
-	unsigned int    fd_index;
+/* Number of frames a staging BO may stay unused before being freed */
+#define STAGING_BO_MAX_IDLE_FRAMES 30
+
+/* Staging BO used to import frames that upstream left in system memory.
+ * A BO is only reused once the GPU is done sampling the frame copied in
+ * it, i.e. once the in-flight frame holding it has been retired (see
+ * retire_frames()).
+ */
+struct staging_bo {
+	struct gbm_bo      *bo;
+	void               *map;
+	void               *map_data;
+	int                 fd;
+	uint32_t            format;
+	uint32_t            size;
+	bool                in_use;
+	unsigned            last_used;
+	struct staging_bo  *next;
 };
+
+struct staging_pool {
+	struct staging_bo  *bos;
+	unsigned            count;
+	unsigned            high_water;
+};
+#endif
+
+/* Number of frames whose resources the GPU may still be reading: the one
+ * on screen, and the ones it replaced that are not retired yet */
+#define MAX_INFLIGHT_FRAMES 3
+
+/* A frame handed to the render loop, and everything that must stay alive
+ * until the GPU is done sampling it: releasing the sample gives its buffer
+ * back to the decoder, which may then write the next frame in it.
+ */
+struct inflight_frame {
+	GstSample          *samp;
+	EGLImage            image;
+	bool                cached;
+	/* signalled once the last draw sampling 'image' has completed */
+	EGLSyncKHR          fence;
+#if HAVE_GBM_BO_MAP
+	struct staging_bo  *staging;
 #endif
+};
 
 struct decoder {
+	/* each decoder dispatches its bus messages in its own thread: the
+	 * prerolled one runs alongside the current one */
+	GMainContext       *context;
 	GMainLoop          *loop;
+	GSource            *bus_watch;
 	GstElement         *pipeline;
 	GstElement         *sink;
 	pthread_t           gst_thread;
 
+	unsigned            flags;
+	bool                live;
+	/* for the startup trace: when video_init() was called, and whether
+	 * the pipeline prerolled since */
+	uint64_t            init_time;
+	bool                prerolled;
+	bool                looping;
+
 	uint32_t            format;
+	uint64_t            modifier;
 	GstVideoInfo        info;
 
 	const struct _gbm   *gbm;
 #if HAVE_GBM_BO_MAP
-	struct _gdm_bo_map  gdm_bo_map;
+	struct staging_pool staging;
+	/* BO the frame being imported is copied in, see push_frame() */
+	struct staging_bo  *staging_pending;
 #endif
 	const struct _egl   *egl;
 	unsigned            frame;
 
-	EGLImage            last_frame;
-	GstSample          *last_samp;
+	/* ring of in-flight frames, the newest one being on screen (see
+	 * video_frame_done()): */
+	struct inflight_frame inflight[MAX_INFLIGHT_FRAMES];
+	unsigned            inflight_head, inflight_count;
+	GstCaps            *caps;
+
+	/* latest decoded sample, not yet picked up by the render loop
+	 * (written by the streaming thread, see appsink_new_sample_cb()): */
+	GstSample          *mailbox;
+	bool                eos;
+	/* signaled when one of the above changes, see video_set_wakeup_fd() */
+	int                 wakeup_fd;
+	unsigned            frames_dropped;
+	unsigned            frames_repeated;
+	unsigned            frames_throttled;
+
+	/* presentation timing, see update_render_delay(): */
+	int64_t             render_delay;
+	uint64_t            last_target;
+	uint64_t            render_interval;
+
+	/* EGLImage cache (see image_cache_lookup()): */
+	unsigned            generation;
+	unsigned            image_cache_hits;
+	unsigned            image_cache_misses;
+
+	/* frames imported directly vs. copied into a GBM BO */
+	unsigned            frames_zero_copy;
+	unsigned            frames_copied;
 };
 
-static GstPadProbeReturn
-pad_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+/* Identity of an imported dmabuf: when a decoder recycles the buffers of
+ * its pool, the same GstMemory comes back with the same layout and the
+ * EGLImage created for it the first time can be reused as is.
+ */
+struct image_key {
+	ino_t               ino[MAX_NUM_PLANES];
+	int                 offset[MAX_NUM_PLANES];
+	int                 stride[MAX_NUM_PLANES];
+	uint32_t            format;
+	guint               width, height, nplanes;
+};
+
+struct image_cache_entry {
+	const struct _egl  *egl;
+	EGLImage            image;
+	struct image_key    key;
+	unsigned            generation;
+};
+
+static GQuark
+image_cache_quark(void)
 {
-	struct decoder *dec = user_data;
-	GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
-	GstCaps *caps;
+	static GQuark quark;
 
-	(void)pad;
+	if (!quark)
+		quark = g_quark_from_static_string("cube-egl-image");
+
+	return quark;
+}
 
-	if (GST_EVENT_TYPE(event) != GST_EVENT_CAPS)
-		return GST_PAD_PROBE_OK;
+/* Called when the GstMemory is freed (typically when the pool of the
+ * decoder is released) or when the entry is replaced by a new one. */
+static void
+image_cache_entry_free(gpointer data)
+{
+	struct image_cache_entry *entry = data;
+
+	entry->egl->eglDestroyImageKHR(entry->egl->dpy, entry->image);
+	g_slice_free(struct image_cache_entry, entry);
+}
+
+static EGLImage
+image_cache_lookup(struct decoder *dec, GstMemory *mem,
+		   const struct image_key *key)
+{
+	struct image_cache_entry *entry;
+
+	entry = gst_mini_object_get_qdata(GST_MINI_OBJECT(mem),
+					  image_cache_quark());
+	if (entry && entry->generation == dec->generation &&
+	    !memcmp(&entry->key, key, sizeof(*key))) {
+		dec->image_cache_hits++;
+		return entry->image;
+	}
+
+	dec->image_cache_misses++;
+	return EGL_NO_IMAGE_KHR;
+}
+
+static void
+image_cache_store(struct decoder *dec, GstMemory *mem,
+		  const struct image_key *key, EGLImage image)
+{
+	struct image_cache_entry *entry;
+
+	entry = g_slice_new0(struct image_cache_entry);
+	entry->egl = dec->egl;
+	entry->image = image;
+	entry->key = *key;
+	entry->generation = dec->generation;
+
+	/* this drops (and destroys the EGLImage of) any stale entry */
+	gst_mini_object_set_qdata(GST_MINI_OBJECT(mem), image_cache_quark(),
+				  entry, image_cache_entry_free);
 
-	gst_event_parse_caps(event, &caps);
+	GST_DEBUG("new EGLImage %p for memory %p (%u images created)",
+		  image, mem, dec->image_cache_misses);
+}
 
+/* dec->info, format and modifier of the frames with 'caps' */
+static bool
+parse_caps(struct decoder *dec, GstCaps *caps)
+{
 	if (!caps) {
-		GST_ERROR("caps event without caps");
-		return GST_PAD_PROBE_OK;
+		GST_ERROR("sample without caps");
+		return false;
 	}
 
+	/* any EGLImage cached on the memories of the previous caps is
+	 * now stale */
+	dec->generation++;
+	dec->modifier = DRM_FORMAT_MOD_INVALID;
+
+#if GST_CHECK_VERSION(1, 24, 0)
+	if (gst_video_is_dma_drm_caps(caps)) {
+		GstVideoInfoDmaDrm drm_info;
+
+		if (!gst_video_info_dma_drm_from_caps(&drm_info, caps)) {
+			GST_ERROR("sample with invalid DMA DRM caps");
+			return false;
+		}
+
+		/* the plane layout of tiled formats is only known from the
+		 * video meta, only get the size out of the caps then */
+		if (!gst_video_info_dma_drm_to_video_info(&drm_info, &dec->info))
+			dec->info = drm_info.vinfo;
+		dec->format = drm_info.drm_fourcc;
+		dec->modifier = drm_info.drm_modifier;
+
+		return true;
+	}
+#endif
+
 	if (!gst_video_info_from_caps(&dec->info, caps)) {
-		GST_ERROR("caps event with invalid video caps");
-		return GST_PAD_PROBE_OK;
+		GST_ERROR("sample with invalid video caps");
+		return false;
 	}
 
-	switch (GST_VIDEO_INFO_FORMAT(&(dec->info))) {
-	case GST_VIDEO_FORMAT_I420:
-		dec->format = DRM_FORMAT_YUV420;
-		break;
-	case GST_VIDEO_FORMAT_NV12:
-		dec->format = DRM_FORMAT_NV12;
-		break;
-	case GST_VIDEO_FORMAT_YUY2:
-		dec->format = DRM_FORMAT_YUYV;
-		break;
-	default:
+	dec->format =
+		video_format_to_drm_fourcc(GST_VIDEO_INFO_FORMAT(&(dec->info)));
+	if (!dec->format) {
 		GST_ERROR("unknown format\n");
-		return GST_PAD_PROBE_OK;
+		return false;
+	}
+
+	return true;
+}
+
+/* Called on the render thread when the sample about to be imported does
+ * not have the caps of the previous one. Doing this here rather than when
+ * the caps event goes through the appsink pad keeps dec->info in sync with
+ * the frames actually imported, whatever is still queued in the mailbox.
+ */
+static bool
+update_caps(struct decoder *dec, GstCaps *caps)
+{
+	/* only caps that were parsed successfully are remembered, the next
+	 * sample with rejected caps is checked again rather than imported
+	 * with the info of the previous ones */
+	if (!parse_caps(dec, caps)) {
+		gst_caps_replace(&dec->caps, NULL);
+		return false;
 	}
 
+	gst_caps_replace(&dec->caps, caps);
+
+	return true;
+}
+
+static GstClockTime
+sample_running_time(GstSample *samp)
+{
+	GstBuffer *buf = gst_sample_get_buffer(samp);
+	GstSegment *segment = gst_sample_get_segment(samp);
+
+	if (!buf || !segment || !GST_BUFFER_PTS_IS_VALID(buf))
+		return GST_CLOCK_TIME_NONE;
+
+	return gst_segment_to_running_time(segment, GST_FORMAT_TIME,
+					   GST_BUFFER_PTS(buf));
+}
+
+/* Tell upstream about a sample that got replaced before the render loop
+ * could show it, so that decoders skip the frames that would not be shown
+ * either. */
+static void
+send_qos(struct decoder *dec, GstSample *dropped, GstSample *next)
+{
+	GstClockTime ts, next_ts, duration, interval;
+	gdouble proportion = 1.0;
+
+	ts = sample_running_time(dropped);
+	next_ts = sample_running_time(next);
+	if (!GST_CLOCK_TIME_IS_VALID(ts) || !GST_CLOCK_TIME_IS_VALID(next_ts) ||
+	    next_ts <= ts)
+		return;
+
+	/* at most one frame is shown per redraw */
+	duration = GST_BUFFER_DURATION(gst_sample_get_buffer(dropped));
+	interval = __atomic_load_n(&dec->render_interval, __ATOMIC_RELAXED);
+	if (interval && GST_CLOCK_TIME_IS_VALID(duration) && duration)
+		proportion = (gdouble)interval / duration;
+
+	gst_element_send_event(dec->sink,
+			       gst_event_new_qos(GST_QOS_TYPE_UNDERFLOW,
+						 proportion, next_ts - ts, ts));
+}
+
+/* appsink callbacks, called from the streaming thread: the latest sample
+ * replaces whatever the render loop did not pick up yet. */
+/* let the render loop know that there is a new sample or an EOS to
+ * handle (called from the streaming thread) */
+static void
+wakeup(struct decoder *dec)
+{
+	int fd = __atomic_load_n(&dec->wakeup_fd, __ATOMIC_ACQUIRE);
+	uint64_t one = 1;
+
+	if (fd < 0)
+		return;
+
+	/* EAGAIN: the counter is saturated, the loop is woken up anyway */
+	if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		GST_WARNING("cannot signal the render loop: %s",
+			    strerror(errno));
+}
+
+static GstFlowReturn
+appsink_new_sample_cb(GstAppSink *sink, gpointer user_data)
+{
+	struct decoder *dec = user_data;
+	GstSample *samp, *old;
+
+	samp = gst_app_sink_pull_sample(sink);
+	if (!samp)
+		return GST_FLOW_OK;
+
+	frame_trace_mark(dec, GST_BUFFER_PTS(gst_sample_get_buffer(samp)),
+			 FRAME_TRACE_APPSINK);
+
+	old = __atomic_exchange_n(&dec->mailbox, samp, __ATOMIC_ACQ_REL);
+	/* the first buffer after a preroll (see appsink_new_preroll_cb())
+	 * comes again here: it was not late */
+	if (old && gst_sample_get_buffer(old) == gst_sample_get_buffer(samp)) {
+		gst_sample_unref(old);
+	} else if (old) {
+		__atomic_add_fetch(&dec->frames_dropped, 1, __ATOMIC_RELAXED);
+		send_qos(dec, old, samp);
+		gst_sample_unref(old);
+	}
+
+	wakeup(dec);
+
+	return GST_FLOW_OK;
+}
+
+static GstPadProbeReturn
+decoder_input_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+	GstBuffer *buf = GST_PAD_PROBE_INFO_BUFFER(info);
+
+	(void)pad;
+
+	frame_trace_mark(user_data, GST_BUFFER_PTS(buf),
+			 FRAME_TRACE_DECODER_IN);
+
 	return GST_PAD_PROBE_OK;
 }
 
+/* Stamp the buffers entering the video decoder, for the frame trace */
+static void
+trace_decoder_input(struct decoder *dec, GstElement *element)
+{
+	GstElementFactory *factory = gst_element_get_factory(element);
+	const gchar *klass;
+	GstPad *pad;
+
+	if (!factory || GST_IS_BIN(element))
+		return;
+
+	klass = gst_element_factory_get_metadata(factory,
+						 GST_ELEMENT_METADATA_KLASS);
+	if (!klass || !strstr(klass, "Decoder") || !strstr(klass, "Video"))
+		return;
+
+	pad = gst_element_get_static_pad(element, "sink");
+	if (!pad)
+		return;
+
+	gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, decoder_input_probe,
+			  dec, NULL);
+	gst_object_unref(pad);
+}
+
+static void
+deep_element_added_cb(GstBin *bin, GstBin *sub_bin, GstElement *element,
+		      gpointer user_data)
+{
+	(void)bin;
+	(void)sub_bin;
+
+	trace_decoder_input(user_data, element);
+}
+
+/* While the decoder is prerolled (VIDEO_FLAG_PREROLL), hand its first frame
+ * to the render loop as well so that it is ready to be shown as soon as the
+ * switch happens. */
+static GstFlowReturn
+appsink_new_preroll_cb(GstAppSink *sink, gpointer user_data)
+{
+	struct decoder *dec = user_data;
+	GstSample *samp, *old;
+
+	if (!dec->prerolled) {
+		dec->prerolled = true;
+		startup_trace_add("video preroll", dec->init_time,
+				  startup_trace_now());
+	}
+
+	/* otherwise the same buffer comes right after in new-sample */
+	if (!(__atomic_load_n(&dec->flags, __ATOMIC_ACQUIRE) &
+	      VIDEO_FLAG_PREROLL))
+		return GST_FLOW_OK;
+
+	samp = gst_app_sink_pull_preroll(sink);
+	if (!samp)
+		return GST_FLOW_OK;
+
+	old = __atomic_exchange_n(&dec->mailbox, samp, __ATOMIC_ACQ_REL);
+	if (old)
+		gst_sample_unref(old);
+
+	return GST_FLOW_OK;
+}
+
+static void
+appsink_eos_cb(GstAppSink *sink, gpointer user_data)
+{
+	struct decoder *dec = user_data;
+
+	(void)sink;
+
+	__atomic_store_n(&dec->eos, true, __ATOMIC_RELEASE);
+	wakeup(dec);
+}
+
 static void *
 gst_thread_func(void *args)
 {
 	struct decoder *dec = args;
+
+	g_main_context_push_thread_default(dec->context);
 	g_main_loop_run(dec->loop);
+	g_main_context_pop_thread_default(dec->context);
 	return NULL;
 }
 
@@ -182,6 +554,32 @@ bus_watch_cb(GstBus *bus, GstMessage *msg, gpointer user_data)
 		gst_element_set_state(GST_ELEMENT(dec->pipeline), requested_state);
 		break;
 	}
+	case GST_MESSAGE_ASYNC_DONE: {
+		/* a segment seek makes the pipeline post SEGMENT_DONE instead
+		 * of going EOS, so that the file can be looped without
+		 * flushing nor rebuilding anything */
+		if (!(dec->flags & VIDEO_FLAG_LOOP) || dec->looping)
+			break;
+
+		dec->looping = true;
+		if (!gst_element_seek(dec->pipeline, 1.0, GST_FORMAT_TIME,
+				      GST_SEEK_FLAG_FLUSH | GST_SEEK_FLAG_SEGMENT,
+				      GST_SEEK_TYPE_SET, 0,
+				      GST_SEEK_TYPE_NONE, GST_CLOCK_TIME_NONE))
+			GST_WARNING("segment seek failed, not looping");
+		break;
+	}
+	case GST_MESSAGE_SEGMENT_DONE: {
+		if (!gst_element_seek(dec->pipeline, 1.0, GST_FORMAT_TIME,
+				      GST_SEEK_FLAG_SEGMENT,
+				      GST_SEEK_TYPE_SET, 0,
+				      GST_SEEK_TYPE_NONE, GST_CLOCK_TIME_NONE)) {
+			/* let it go EOS instead */
+			GST_WARNING("looping seek failed");
+			gst_element_send_event(dec->pipeline, gst_event_new_eos());
+		}
+		break;
+	}
 	case GST_MESSAGE_LATENCY: {
 		printf("redistributing latency\n");
 		gst_bin_recalculate_latency(GST_BIN(dec->pipeline));
@@ -230,84 +628,357 @@ bus_watch_cb(GstBus *bus, GstMessage *msg, gpointer user_data)
 	return TRUE;
 }
 
+#if GST_CHECK_VERSION(1, 24, 0)
+/* DMA DRM caps listing every format and modifier EGL can import, so that
+ * decoders producing tiled or compressed buffers can keep their native
+ * layout instead of converting them to linear.
+ */
+static GstCaps *
+dma_drm_caps(const struct _egl *egl)
+{
+	static const uint32_t fourccs[] = {
+		DRM_FORMAT_NV12,
+		DRM_FORMAT_YUV420,
+		DRM_FORMAT_YUYV,
+	};
+	GValue formats = G_VALUE_INIT;
+	GstCaps *caps;
+	unsigned i;
+
+	if (!egl->has_dma_buf_import_modifiers)
+		return NULL;
+
+	g_value_init(&formats, GST_TYPE_LIST);
+
+	for (i = 0; i < G_N_ELEMENTS(fourccs); i++) {
+		EGLuint64KHR *modifiers;
+		EGLint j, num_modifiers = 0;
+
+		if (!egl->query_dma_buf_modifiers(egl->dpy, fourccs[i], 0,
+						  NULL, NULL, &num_modifiers) ||
+		    num_modifiers <= 0)
+			continue;
+
+		modifiers = calloc(num_modifiers, sizeof(*modifiers));
+		if (modifiers &&
+		    egl->query_dma_buf_modifiers(egl->dpy, fourccs[i],
+						 num_modifiers, modifiers,
+						 NULL, &num_modifiers)) {
+			for (j = 0; j < num_modifiers; j++) {
+				GValue format = G_VALUE_INIT;
+
+				g_value_init(&format, G_TYPE_STRING);
+				g_value_take_string(&format,
+					gst_video_dma_drm_fourcc_to_string(
+						fourccs[i], modifiers[j]));
+				gst_value_list_append_and_take_value(&formats,
+								     &format);
+			}
+		}
+		free(modifiers);
+	}
+
+	if (!gst_value_list_get_size(&formats)) {
+		g_value_unset(&formats);
+		return NULL;
+	}
+
+	caps = gst_caps_new_simple("video/x-raw",
+				   "format", G_TYPE_STRING, "DMA_DRM", NULL);
+	gst_caps_set_features(caps, 0,
+		gst_caps_features_new(GST_CAPS_FEATURE_MEMORY_DMABUF, NULL));
+	gst_structure_take_value(gst_caps_get_structure(caps, 0),
+				 "drm-format", &formats);
+
+	return caps;
+}
+#endif
+
 static GstPadProbeReturn
 appsink_query_cb(GstPad *pad G_GNUC_UNUSED, GstPadProbeInfo *info,
-	gpointer user_data G_GNUC_UNUSED)
+	gpointer user_data)
 {
+	struct decoder *dec = user_data;
 	GstQuery *query = info->data;
+	GstBufferPool *pool;
+	GstStructure *config;
+	GstVideoInfo vinfo;
+	GstCaps *caps;
+	gboolean need_pool;
+	guint size;
 
 	if (GST_QUERY_TYPE (query) != GST_QUERY_ALLOCATION)
 	  return GST_PAD_PROBE_OK;
 
 	gst_query_add_allocation_meta(query, GST_VIDEO_META_API_TYPE, NULL);
 
+	/* Propose a pool of GBM BOs so that decoders writing to system
+	 * memory (jpegdec, software decoders behind decodebin) produce
+	 * buffers that can be imported without the copy in buf_to_fd().
+	 * Decoders with their own dmabuf pool keep using it. */
+	gst_query_parse_allocation(query, &caps, &need_pool);
+	if (!need_pool || !caps || !gst_video_info_from_caps(&vinfo, caps))
+		return GST_PAD_PROBE_HANDLED;
+
+	if (!gbm_buffer_pool_supports(dec->gbm->dev, &vinfo)) {
+		GST_INFO("GBM device cannot allocate %s frames, no pool proposed",
+			 gst_video_format_to_string(GST_VIDEO_INFO_FORMAT(&vinfo)));
+		return GST_PAD_PROBE_HANDLED;
+	}
+
+	size = GST_VIDEO_INFO_SIZE(&vinfo);
+	pool = gbm_buffer_pool_new(dec->gbm->dev);
+	config = gst_buffer_pool_get_config(pool);
+	gst_buffer_pool_config_set_params(config, caps, size, 2, 0);
+	gst_buffer_pool_config_add_option(config,
+					  GST_BUFFER_POOL_OPTION_VIDEO_META);
+	if (gst_buffer_pool_set_config(pool, config))
+		gst_query_add_allocation_pool(query, pool, size, 2, 0);
+	gst_object_unref(pool);
+
 	return GST_PAD_PROBE_HANDLED;
 }
 
+/* Pick the mode of the camera closest to the requested size and rate among
+ * the structures of 'device_caps' named 'name' (and in one of 'formats',
+ * when not NULL). Returns fixed caps, or NULL if the device has none.
+ */
+static GstCaps *
+probe_camera_caps(GstCaps *device_caps, const char *name,
+		  const char * const *formats, int width, int height,
+		  int fps_n, int fps_d)
+{
+	GstStructure *best = NULL;
+	GstCaps *caps;
+	long best_dist = 0;
+	guint i;
+
+	for (i = 0; i < gst_caps_get_size(device_caps); i++) {
+		GstStructure *s = gst_caps_get_structure(device_caps, i);
+		const gchar *format;
+		long dist;
+		int w, h;
+
+		if (!gst_structure_has_name(s, name))
+			continue;
+
+		format = gst_structure_get_string(s, "format");
+		if (formats && (!format || !g_strv_contains(formats, format)))
+			continue;
+
+		s = gst_structure_copy(s);
+		gst_structure_fixate_field_nearest_int(s, "width", width);
+		gst_structure_fixate_field_nearest_int(s, "height", height);
+		gst_structure_fixate_field_nearest_fraction(s, "framerate",
+							   fps_n, fps_d);
+		if (!gst_structure_get_int(s, "width", &w) ||
+		    !gst_structure_get_int(s, "height", &h)) {
+			gst_structure_free(s);
+			continue;
+		}
+
+		dist = labs((long)w * h - (long)width * height);
+		if (best && dist >= best_dist) {
+			gst_structure_free(s);
+			continue;
+		}
+
+		if (best)
+			gst_structure_free(best);
+		best = s;
+		best_dist = dist;
+	}
+
+	if (!best)
+		return NULL;
+
+	caps = gst_caps_new_empty();
+	gst_caps_append_structure(caps, best);
+
+	return caps;
+}
+
+/* Build the pipeline of a V4L2 camera: raw frames are captured straight
+ * into dmabufs that can be imported without any CPU conversion; MJPEG is
+ * only used when the device has no raw format EGL can import, decoded by
+ * the hardware JPEG decoder when there is one.
+ */
+static gchar *
+camera_pipeline(const char *device, const char *fps, int width, int height)
+{
+	static const char * const raw_formats[] = { "NV12", "YUY2", NULL };
+	GstElementFactory *factory;
+	GstCaps *device_caps = NULL, *caps = NULL;
+	const char *jpegdec = "jpegdec";
+	gchar *caps_str, *pipeline;
+	GstElement *src;
+	int fps_n = 15, fps_d = 1;
+
+	if (sscanf(fps, "%d/%d", &fps_n, &fps_d) != 2 || fps_d <= 0) {
+		fps_n = 15;
+		fps_d = 1;
+	}
+
+	src = gst_element_factory_make("v4l2src", NULL);
+	if (src) {
+		g_object_set(G_OBJECT(src), "device", device, NULL);
+		if (gst_element_set_state(src, GST_STATE_READY) !=
+		    GST_STATE_CHANGE_FAILURE) {
+			GstPad *pad = gst_element_get_static_pad(src, "src");
+
+			device_caps = gst_pad_query_caps(pad, NULL);
+			gst_object_unref(pad);
+		}
+		gst_element_set_state(src, GST_STATE_NULL);
+		gst_object_unref(src);
+	}
+
+	if (device_caps) {
+		caps = probe_camera_caps(device_caps, "video/x-raw",
+					 raw_formats, width, height,
+					 fps_n, fps_d);
+		if (caps) {
+			caps_str = gst_caps_to_string(caps);
+			pipeline = g_strdup_printf(
+				"v4l2src name=\"v4l2src\" device=%s "
+				"io-mode=dmabuf ! %s ! "
+				"appsink name=\"sink\"",
+				device, caps_str);
+			g_free(caps_str);
+			gst_caps_unref(caps);
+			gst_caps_unref(device_caps);
+			return pipeline;
+		}
+
+		caps = probe_camera_caps(device_caps, "image/jpeg", NULL,
+					 width, height, fps_n, fps_d);
+		gst_caps_unref(device_caps);
+	}
+
+	factory = gst_element_factory_find("v4l2jpegdec");
+	if (factory) {
+		jpegdec = "v4l2jpegdec";
+		gst_object_unref(factory);
+	}
+
+	if (caps) {
+		caps_str = gst_caps_to_string(caps);
+		gst_caps_unref(caps);
+	} else {
+		/* could not probe the device, keep the historical mode */
+		caps_str = g_strdup_printf(
+			"image/jpeg,width=" CUBE_STR(CUBE_VID_TEX_WIDTH) ","
+			"height=" CUBE_STR(CUBE_VID_TEX_HEIGTH) ","
+			"framerate=(fraction)%s", fps);
+	}
+
+	pipeline = g_strdup_printf(
+		"v4l2src name=\"v4l2src\" device=%s ! %s ! "
+		"%s name=\"decode\" ! appsink name=\"sink\"",
+		device, caps_str, jpegdec);
+	g_free(caps_str);
+
+	return pipeline;
+}
+
 struct decoder *
 video_init(const struct _egl *egl, const struct _gbm *gbm, const char *filename,
-	   char *fps)
+	   char *fps, int width, int height, unsigned flags)
 {
 	struct decoder *dec;
 	GstElement *src;
+	GstCaps *caps;
 	GstPad *pad;
 	GstBus *bus;
-	static const char *pipeline;
+	gchar *pipeline;
+	static GstAppSinkCallbacks callbacks = {
+		.eos = appsink_eos_cb,
+		.new_preroll = appsink_new_preroll_cb,
+		.new_sample = appsink_new_sample_cb,
+	};
 
 	if (egl_check(egl, eglCreateImageKHR) ||
-	    egl_check(egl, eglDestroyImageKHR))
+	    egl_check(egl, eglDestroyImageKHR) ||
+	    egl_check(egl, eglCreateSyncKHR) ||
+	    egl_check(egl, eglDestroySyncKHR) ||
+	    egl_check(egl, eglClientWaitSyncKHR))
 		return NULL;
 
 	dec = calloc(1, sizeof(*dec));
-	dec->loop = g_main_loop_new(NULL, FALSE);
+	dec->init_time = startup_trace_now();
+	/* until video_set_wakeup_fd(), not fd 0 */
+	dec->wakeup_fd = -1;
+	dec->context = g_main_context_new();
+	dec->loop = g_main_loop_new(dec->context, FALSE);
 	dec->gbm = gbm;
 	dec->egl = egl;
-
-#if HAVE_GBM_BO_MAP
-	unsigned int i = 0;
-	for (i = 0; i< MAX_NUM_PLANES; i++) {
-		dec->gdm_bo_map.fd[i] = -1;
-		dec->gdm_bo_map.bo[i] = NULL;
-		dec->gdm_bo_map.map[i] = NULL;
-		dec->gdm_bo_map.map_data[i] = NULL;
-	}
-	dec->gdm_bo_map.fd_index = 0;
-#endif
+	dec->flags = flags;
+	dec->modifier = DRM_FORMAT_MOD_INVALID;
 
 	/* Setup pipeline: */
 	if (strstr(filename, "/dev/video")) {
-		char newpipeline[512];
-
-		snprintf(newpipeline, sizeof(newpipeline),
-			"v4l2src name=\"v4l2src\" device=%s ! "
-			"image/jpeg,width=" CUBE_STR(CUBE_VID_TEX_WIDTH) ","
-			"height=" CUBE_STR(CUBE_VID_TEX_HEIGTH) ","
-			"framerate=(fraction)%s ! "
-			"jpegdec name=\"decode\" ! video/x-raw ! "
-			"appsink sync=false name=\"sink\"",
-			filename, fps
-			);
-		pipeline = newpipeline;
+		/* nothing to loop with a live source */
+		dec->live = true;
+		dec->flags &= ~VIDEO_FLAG_LOOP;
+
+		pipeline = camera_pipeline(filename, fps, width, height);
+	} else if (g_str_has_prefix(filename, "videotestsrc")) {
+		/* synthetic frames (e.g. for benchmarks): 'filename' is the
+		 * source description, there is no end to loop at */
+		dec->flags &= ~VIDEO_FLAG_LOOP;
+
+		pipeline = g_strdup_printf(
+			"%s ! video/x-raw,format=NV12,width=%d,height=%d ! "
+			"appsink name=\"sink\"", filename, width, height);
 	} else {
-		pipeline =
+		pipeline = g_strdup(
 			"filesrc name=\"src\" ! decodebin name=\"decode\" ! "
-			"video/x-raw ! appsink sync=false name=\"sink\"";
+			"appsink name=\"sink\"");
 
 	}
-	printf("GST Pipeline: %s", pipeline);
+	printf("GST Pipeline: %s\n", pipeline);
 
 	dec->pipeline = gst_parse_launch(pipeline, NULL);
+	g_free(pipeline);
 
 	dec->sink = gst_bin_get_by_name(GST_BIN(dec->pipeline), "sink");
 
+	/* Accept dmabufs in any layout EGL can import first, then plain
+	 * raw video that is imported as linear. */
+	caps = gst_caps_new_empty();
+#if GST_CHECK_VERSION(1, 24, 0)
+	{
+		GstCaps *drm_caps = dma_drm_caps(egl);
+
+		if (drm_caps)
+			gst_caps_append(caps, drm_caps);
+	}
+#endif
+	gst_caps_append(caps, gst_caps_from_string("video/x-raw"));
+	gst_app_sink_set_caps(GST_APP_SINK(dec->sink), caps);
+	gst_caps_unref(caps);
+
+	if (frame_trace_enabled()) {
+		GstElement *decode;
+
+		/* decoders plugged by decodebin, or the camera JPEG one */
+		g_signal_connect(dec->pipeline, "deep-element-added",
+				 G_CALLBACK(deep_element_added_cb), dec);
+		decode = gst_bin_get_by_name(GST_BIN(dec->pipeline), "decode");
+		if (decode) {
+			trace_decoder_input(dec, decode);
+			gst_object_unref(decode);
+		}
+	}
+
 	/* Implement the allocation query using a pad probe. This probe will
 	 * adverstize support for GstVideoMeta, which avoid hardware accelerated
 	 * decoder that produce special strides and offsets from having to
-	 * copy the buffers.
+	 * copy the buffers, and propose a GBM backed buffer pool.
 	 */
 	pad = gst_element_get_static_pad(dec->sink, "sink");
 	gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_QUERY_DOWNSTREAM,
-		appsink_query_cb, NULL, NULL);
+		appsink_query_cb, dec, NULL);
 	gst_object_unref(pad);
 
 	src = gst_bin_get_by_name(GST_BIN(dec->pipeline), "src");
@@ -316,7 +987,9 @@ video_init(const struct _egl *egl, const struct _gbm *gbm, const char *filename,
 		gst_object_unref(src);
 	}
 
-	/* Configure the sink like a video sink (mimic GstVideoSink) */
+	/* Configure the sink like a video sink (mimic GstVideoSink): samples
+	 * are released on the pipeline clock, see update_render_delay() */
+	gst_base_sink_set_sync(GST_BASE_SINK(dec->sink), TRUE);
 	gst_base_sink_set_max_lateness(GST_BASE_SINK(dec->sink), 20 * GST_MSECOND);
 	gst_base_sink_set_qos_enabled(GST_BASE_SINK(dec->sink), TRUE);
 
@@ -325,88 +998,242 @@ video_init(const struct _egl *egl, const struct _gbm *gbm, const char *filename,
 	 */
 	g_object_set(G_OBJECT(dec->sink), "max-buffers", 2, NULL);
 
-	gst_pad_add_probe(gst_element_get_static_pad(dec->sink, "sink"),
-			GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
-			pad_probe, dec, NULL);
+	/* samples are pulled as soon as they are decoded, so that the render
+	 * loop never blocks waiting for the decoder */
+	gst_app_sink_set_callbacks(GST_APP_SINK(dec->sink), &callbacks, dec,
+				   NULL);
 
 	/* add bus to be able to receive error message, handle latency
 	 * requests, produce pipeline dumps, etc. */
 	bus = gst_pipeline_get_bus(GST_PIPELINE(dec->pipeline));
-	gst_bus_add_watch(bus, bus_watch_cb, dec);
+	dec->bus_watch = gst_bus_create_watch(bus);
+	g_source_set_callback(dec->bus_watch, G_SOURCE_FUNC(bus_watch_cb), dec,
+			      NULL);
+	g_source_attach(dec->bus_watch, dec->context);
 	gst_object_unref(GST_OBJECT(bus));
 
-	/* let 'er rip! */
-	gst_element_set_state(dec->pipeline, GST_STATE_PLAYING);
+	/* let 'er rip! (or just get the first frame ready, see video_play();
+	 * live sources do not preroll, only open the device then) */
+	if (!(dec->flags & VIDEO_FLAG_PREROLL))
+		gst_element_set_state(dec->pipeline, GST_STATE_PLAYING);
+	else
+		gst_element_set_state(dec->pipeline, dec->live ?
+				      GST_STATE_READY : GST_STATE_PAUSED);
 
 	pthread_create(&dec->gst_thread, NULL, gst_thread_func, dec);
 
 	return dec;
 }
 
+#if HAVE_GBM_BO_MAP
 static void
-set_last_frame(struct decoder *dec, EGLImage frame, GstSample *samp)
+staging_bo_destroy(struct decoder *dec, struct staging_bo *sbo)
 {
-	if (dec->last_frame)
-		dec->egl->eglDestroyImageKHR(dec->egl->dpy, dec->last_frame);
-	dec->last_frame = frame;
-	if (dec->last_samp)
-		gst_sample_unref(dec->last_samp);
-	dec->last_samp = samp;
+	close(sbo->fd);
+	gbm_bo_unmap(sbo->bo, sbo->map_data);
+	gbm_bo_destroy(sbo->bo);
+	free(sbo);
+
+	dec->staging.count--;
 }
 
-#if HAVE_GBM_BO_MAP
-static int
-buf_to_fd(struct decoder *dec, int size, void *ptr)
+static struct staging_bo *
+staging_bo_acquire(struct decoder *dec, uint32_t size)
 {
 	const struct _gbm *gbm = dec->gbm;
-	struct _gdm_bo_map *bo_map = &dec->gdm_bo_map;
-	unsigned int i = 0;
+	struct staging_pool *pool = &dec->staging;
+	struct staging_bo *sbo, *found = NULL, **link;
+	uint32_t stride;
+
+	/* look for a free BO of the right size, and release the ones that
+	 * have not been needed for a while */
+	link = &pool->bos;
+	while ((sbo = *link)) {
+		if (sbo->in_use) {
+			link = &sbo->next;
+			continue;
+		}
+
+		if (!found && sbo->format == dec->format &&
+		    sbo->size == size) {
+			found = sbo;
+			link = &sbo->next;
+			continue;
+		}
 
-	if (bo_map->fd_index >= MAX_NUM_PLANES)
-		bo_map->fd_index  = 0;
+		if (sbo->format != dec->format || sbo->size != size ||
+		    dec->frame - sbo->last_used > STAGING_BO_MAX_IDLE_FRAMES) {
+			*link = sbo->next;
+			staging_bo_destroy(dec, sbo);
+			continue;
+		}
 
-	i = bo_map->fd_index;
-	if (bo_map->map[i] == NULL) {
-		struct gbm_bo *bo = NULL;
-		void *map, *map_data;
-		uint32_t stride;
-		static int fd;
+		link = &sbo->next;
+	}
 
-		/* NOTE: do not actually use GBM_BO_USE_WRITE since that gets us a dumb buffer: */
+	if (found)
+		goto out;
 
-		bo = gbm_bo_create(gbm->dev, size, 1, GBM_FORMAT_R8,
-				   GBM_BO_USE_LINEAR);
+	found = calloc(1, sizeof(*found));
+	if (!found)
+		return NULL;
 
-		map = gbm_bo_map(bo, 0, 0, size, 1, GBM_BO_TRANSFER_WRITE,
-				 &stride, &map_data);
+	/* NOTE: do not actually use GBM_BO_USE_WRITE since that gets us a dumb buffer: */
+	found->bo = gbm_bo_create(gbm->dev, size, 1, GBM_FORMAT_R8,
+				  GBM_BO_USE_LINEAR);
+	if (!found->bo)
+		goto err;
+
+	found->map = gbm_bo_map(found->bo, 0, 0, size, 1,
+				GBM_BO_TRANSFER_WRITE, &stride,
+				&found->map_data);
+	if (!found->map)
+		goto err_destroy;
+
+	found->fd = gbm_bo_get_fd(found->bo);
+	if (found->fd < 0)
+		goto err_unmap;
+
+	found->format = dec->format;
+	found->size = size;
+	found->next = pool->bos;
+	pool->bos = found;
+	pool->count++;
+	if (pool->count > pool->high_water)
+		pool->high_water = pool->count;
+
+	printf("Create staging bo %p (%u in pool, high-water %u)\n",
+	       found->bo, pool->count, pool->high_water);
+	printf("            |-> fd     = %i\n", found->fd);
+	printf("            |-> size   = %u\n", size);
+	printf("            |-> stride = %u\n", stride);
+
+out:
+	found->in_use = true;
+	found->last_used = dec->frame;
+	return found;
+
+err_unmap:
+	gbm_bo_unmap(found->bo, found->map_data);
+err_destroy:
+	gbm_bo_destroy(found->bo);
+err:
+	GST_ERROR("could not allocate a %u bytes staging BO", size);
+	free(found);
+	return NULL;
+}
 
-		fd = gbm_bo_get_fd(bo);
+static int
+buf_to_fd(struct decoder *dec, uint32_t size, void *ptr)
+{
+	struct staging_bo *sbo;
 
-		bo_map->map[i] = map;
-		bo_map->map_data[i] = map_data;
-		bo_map->fd[i] = fd;
-		bo_map->bo[i] = bo;
+	sbo = staging_bo_acquire(dec, size);
+	if (!sbo)
+		return -1;
 
-		printf("Create [%d] +-> bo     = %p\n", i, bo);
-		printf("            |-> fd     = %i\n", fd);
-		printf("            |-> size   = %i\n", size);
-		printf("            |-> stride = %i\n", stride);
-	}
+	memcpy(sbo->map, ptr, size);
+
+	/* handed over to the in-flight frame in push_frame() */
+	dec->staging_pending = sbo;
+
+	return sbo->fd;
+}
+#endif
+
+static struct inflight_frame *
+current_frame(struct decoder *dec)
+{
+	if (!dec->inflight_count)
+		return NULL;
+
+	return &dec->inflight[(dec->inflight_head + dec->inflight_count - 1) %
+			      MAX_INFLIGHT_FRAMES];
+}
+
+static void
+inflight_frame_release(struct decoder *dec, struct inflight_frame *f)
+{
+	const struct _egl *egl = dec->egl;
+
+	if (f->fence)
+		egl->eglDestroySyncKHR(egl->dpy, f->fence);
+	/* cached images belong to the GstMemory they were created for */
+	if (f->image && !f->cached)
+		egl->eglDestroyImageKHR(egl->dpy, f->image);
+	if (f->samp)
+		gst_sample_unref(f->samp);
+#if HAVE_GBM_BO_MAP
+	if (f->staging)
+		f->staging->in_use = false;
+#endif
+	memset(f, 0, sizeof(*f));
+}
+
+/* Release, oldest first, the frames replaced on screen whose fence has
+ * signalled. Polls without blocking, unless 'wait' is set (teardown) in
+ * which case every frame, including the current one, is released.
+ * Returns the number of frames still in flight.
+ */
+static unsigned
+retire_frames(struct decoder *dec, bool wait)
+{
+	const struct _egl *egl = dec->egl;
+	struct inflight_frame *f;
+
+	while (dec->inflight_count > (wait ? 0 : 1)) {
+		f = &dec->inflight[dec->inflight_head];
+		if (f->fence &&
+		    egl->eglClientWaitSyncKHR(egl->dpy, f->fence, 0,
+					      wait ? EGL_FOREVER_KHR : 0) ==
+		    EGL_TIMEOUT_EXPIRED_KHR)
+			break;
 
-	memcpy(bo_map->map[i], ptr, size);
+		inflight_frame_release(dec, f);
+		dec->inflight_head = (dec->inflight_head + 1) %
+				     MAX_INFLIGHT_FRAMES;
+		dec->inflight_count--;
+	}
 
-	return bo_map->fd[bo_map->fd_index++];
+	return dec->inflight_count;
 }
+
+/* Make 'image' the current frame: the caller made sure a slot is free */
+static void
+push_frame(struct decoder *dec, EGLImage image, bool cached, GstSample *samp)
+{
+	struct inflight_frame *f = current_frame(dec);
+
+	/* the frame replaced has only been sampled by draws already issued:
+	 * if none of them was fenced by video_frame_done(), cover them now */
+	if (f && !f->fence)
+		f->fence = dec->egl->eglCreateSyncKHR(dec->egl->dpy,
+						      EGL_SYNC_FENCE_KHR,
+						      NULL);
+
+	f = &dec->inflight[(dec->inflight_head + dec->inflight_count) %
+			   MAX_INFLIGHT_FRAMES];
+	dec->inflight_count++;
+
+	f->samp = samp;
+	f->image = image;
+	f->cached = cached;
+#if HAVE_GBM_BO_MAP
+	f->staging = dec->staging_pending;
+	dec->staging_pending = NULL;
 #endif
+}
 
 static EGLImage
-buffer_to_image(struct decoder *dec, GstBuffer *buf)
+buffer_to_image(struct decoder *dec, GstBuffer *buf, bool *cached)
 {
 	struct { int fd, offset, stride; } planes[MAX_NUM_PLANES];
+	struct image_key key;
 	GstVideoMeta *meta = gst_buffer_get_video_meta(buf);
 	EGLImage image;
-	guint nmems = gst_buffer_n_memory(buf);
-	guint nplanes = GST_VIDEO_INFO_N_PLANES(&(dec->info));
+	guint nplanes = meta ? meta->n_planes :
+			       GST_VIDEO_INFO_N_PLANES(&(dec->info));
+	bool has_modifier = dec->modifier != DRM_FORMAT_MOD_INVALID;
 	guint i;
 	guint width, height;
 	gboolean is_dmabuf_mem;
@@ -428,6 +1255,19 @@ buffer_to_image(struct decoder *dec, GstBuffer *buf)
 		EGL_DMA_BUF_PLANE1_PITCH_EXT,
 		EGL_DMA_BUF_PLANE2_PITCH_EXT,
 	};
+	static const EGLint egl_dmabuf_plane_modifier_attr[MAX_NUM_PLANES][2] = {
+		{ EGL_DMA_BUF_PLANE0_MODIFIER_LO_EXT,
+		  EGL_DMA_BUF_PLANE0_MODIFIER_HI_EXT },
+		{ EGL_DMA_BUF_PLANE1_MODIFIER_LO_EXT,
+		  EGL_DMA_BUF_PLANE1_MODIFIER_HI_EXT },
+		{ EGL_DMA_BUF_PLANE2_MODIFIER_LO_EXT,
+		  EGL_DMA_BUF_PLANE2_MODIFIER_HI_EXT },
+	};
+
+	if (nplanes == 0 || nplanes > MAX_NUM_PLANES) {
+		GST_ERROR("cannot import a frame with %u planes", nplanes);
+		return EGL_NO_IMAGE_KHR;
+	}
 
 	/* Query gst_is_dmabuf_memory() here, since the gstmemory
 	 * block might get merged below by gst_buffer_map(), meaning
@@ -435,29 +1275,78 @@ buffer_to_image(struct decoder *dec, GstBuffer *buf)
 	mem = gst_buffer_peek_memory(buf, 0);
 	is_dmabuf_mem = gst_is_dmabuf_memory(mem);
 
-	if (nmems > 1) {
-		if (is_dmabuf_mem) {
-			/* this case currently is not defined */
+	/* a tiled layout cannot be copied into a linear staging BO */
+	if (has_modifier && dec->modifier != DRM_FORMAT_MOD_LINEAR &&
+	    !is_dmabuf_mem) {
+		GST_ERROR("modifier 0x%016llx frame is not in DMABUF memory",
+			  (unsigned long long)dec->modifier);
+		return EGL_NO_IMAGE_KHR;
+	}
 
-			GST_FIXME("gstbuffers with multiple memory blocks and DMABUF "
-			          "memory currently are not supported");
-			return EGL_NO_IMAGE_KHR;
-		}
+	*cached = false;
 
-		/* if this is not DMABUF memory, then the gst_buffer_map()
-		 * call below will automatically merge the memory blocks
-		 */
+	/* Usually, a videometa should be present, since by using the internal kmscube
+	 * video_appsink element instead of the regular appsink, it is guaranteed that
+	 * video meta support is declared in the video_appsink's allocation query.
+	 * However, this assumes that upstream elements actually look at the allocation
+	 * query's contents properly, or that they even send a query at all. If this
+	 * is not the case, then upstream might decide to push frames without adding
+	 * a meta. It can happen, and in this case, look at the video info data as
+	 * a fallback (it is computed out of the input caps).
+	 */
+	for (i = 0; i < nplanes; i++) {
+		if (meta) {
+			planes[i].offset = meta->offset[i];
+			planes[i].stride = meta->stride[i];
+		} else {
+			planes[i].offset = GST_VIDEO_INFO_PLANE_OFFSET(&(dec->info), i);
+			planes[i].stride = GST_VIDEO_INFO_PLANE_STRIDE(&(dec->info), i);
+		}
 	}
 
+	/* No need to dup() the fds: the EGL implementation takes its own
+	 * reference on the dmabufs when importing them. */
 	if (is_dmabuf_mem) {
-		dmabuf_fd = dup(gst_dmabuf_memory_get_fd(mem));
+		/* Multiplanar decoders (V4L2 NV12M, I420M, ...) put each
+		 * plane in its own memory block: look up which memory holds
+		 * each plane so that every plane gets its own fd, with the
+		 * offset made relative to that memory. */
+		for (i = 0; i < nplanes; i++) {
+			GstMemory *plane_mem;
+			guint mem_idx, mem_len;
+			gsize mem_skip;
+
+			if (!gst_buffer_find_memory(buf, planes[i].offset, 1,
+						    &mem_idx, &mem_len,
+						    &mem_skip)) {
+				GST_ERROR("no memory block for plane %u", i);
+				return EGL_NO_IMAGE_KHR;
+			}
+
+			plane_mem = gst_buffer_peek_memory(buf, mem_idx);
+			if (!gst_is_dmabuf_memory(plane_mem)) {
+				GST_ERROR("plane %u is not in DMABUF memory", i);
+				return EGL_NO_IMAGE_KHR;
+			}
+
+			planes[i].fd = gst_dmabuf_memory_get_fd(plane_mem);
+			planes[i].offset = plane_mem->offset + mem_skip;
+		}
+		dmabuf_fd = planes[0].fd;
 	}
 #if HAVE_GBM_BO_MAP
 	else {
 		GstMapInfo map_info;
+
+		/* if this is not DMABUF memory, then gst_buffer_map()
+		 * will automatically merge the memory blocks
+		 */
 		gst_buffer_map(buf, &map_info, GST_MAP_READ);
 		dmabuf_fd = buf_to_fd(dec, map_info.size, map_info.data);
 		gst_buffer_unmap(buf, &map_info);
+
+		for (i = 0; i < nplanes; i++)
+			planes[i].fd = dmabuf_fd;
 	}
 #endif
 
@@ -466,28 +1355,10 @@ buffer_to_image(struct decoder *dec, GstBuffer *buf)
 		return EGL_NO_IMAGE_KHR;
 	}
 
-	/* Usually, a videometa should be present, since by using the internal kmscube
-	 * video_appsink element instead of the regular appsink, it is guaranteed that
-	 * video meta support is declared in the video_appsink's allocation query.
-	 * However, this assumes that upstream elements actually look at the allocation
-	 * query's contents properly, or that they even send a query at all. If this
-	 * is not the case, then upstream might decide to push frames without adding
-	 * a meta. It can happen, and in this case, look at the video info data as
-	 * a fallback (it is computed out of the input caps).
-	 */
-	if (meta) {
-		for (i = 0; i < nplanes; i++) {
-			planes[i].fd = dmabuf_fd;
-			planes[i].offset = meta->offset[i];
-			planes[i].stride = meta->stride[i];
-		}
-	} else {
-		for (i = 0; i < nplanes; i++) {
-			planes[i].fd = dmabuf_fd;
-			planes[i].offset = GST_VIDEO_INFO_PLANE_OFFSET(&(dec->info), i);
-			planes[i].stride = GST_VIDEO_INFO_PLANE_STRIDE(&(dec->info), i);
-		}
-	}
+	if (is_dmabuf_mem)
+		dec->frames_zero_copy++;
+	else
+		dec->frames_copied++;
 
 	width = GST_VIDEO_INFO_WIDTH(&(dec->info));
 	height = GST_VIDEO_INFO_HEIGHT(&(dec->info));
@@ -504,102 +1375,301 @@ buffer_to_image(struct decoder *dec, GstBuffer *buf)
 		printf("GStreamer video stream information:\n");
 		printf("  size: %u x %u pixel\n", width, height);
 		printf("  pixel format: %s  number of planes: %u\n", pixfmt_str, nplanes);
+		if (has_modifier)
+			printf("  modifier: 0x%016llx\n",
+			       (unsigned long long)dec->modifier);
+		printf("  memory blocks: %u\n", gst_buffer_n_memory(buf));
 		printf("  can use zero-copy: %s\n", yesno(is_dmabuf_mem));
 		printf("  video meta found: %s\n", yesno(meta != NULL));
 		printf("===================================\n");
 	}
 
+	if (is_dmabuf_mem) {
+		struct stat st;
+
+		memset(&key, 0, sizeof(key));
+		key.format = dec->format;
+		key.width = width;
+		key.height = height;
+		key.nplanes = nplanes;
+		for (i = 0; i < nplanes; i++) {
+			if (fstat(planes[i].fd, &st) < 0) {
+				GST_ERROR("could not stat DMABUF FD %d",
+					  planes[i].fd);
+				return EGL_NO_IMAGE_KHR;
+			}
+			key.ino[i] = st.st_ino;
+			key.offset[i] = planes[i].offset;
+			key.stride[i] = planes[i].stride;
+		}
+
+		image = image_cache_lookup(dec, mem, &key);
+		if (image != EGL_NO_IMAGE_KHR) {
+			*cached = true;
+			return image;
+		}
+	}
+
 	{
 		/* Initialize the first 6 attributes with values that are
 		 * plane invariant (width, height, format) */
-		EGLint attr[6 + 6*(MAX_NUM_PLANES) + 1] = {
+		EGLint attr[6 + 10*(MAX_NUM_PLANES) + 1] = {
 			EGL_WIDTH, width,
 			EGL_HEIGHT, height,
 			EGL_LINUX_DRM_FOURCC_EXT, dec->format
 		};
+		EGLint *a = &attr[6];
+
+		/* staging BOs are linear whatever the caps say */
+		if (!is_dmabuf_mem || !dec->egl->has_dma_buf_import_modifiers)
+			has_modifier = false;
 
 		for (i = 0; i < nplanes; i++) {
-			attr[6 + 6*i + 0] = egl_dmabuf_plane_fd_attr[i];
-			attr[6 + 6*i + 1] = planes[i].fd;
-			attr[6 + 6*i + 2] = egl_dmabuf_plane_offset_attr[i];
-			attr[6 + 6*i + 3] = planes[i].offset;
-			attr[6 + 6*i + 4] = egl_dmabuf_plane_pitch_attr[i];
-			attr[6 + 6*i + 5] = planes[i].stride;
+			*a++ = egl_dmabuf_plane_fd_attr[i];
+			*a++ = planes[i].fd;
+			*a++ = egl_dmabuf_plane_offset_attr[i];
+			*a++ = planes[i].offset;
+			*a++ = egl_dmabuf_plane_pitch_attr[i];
+			*a++ = planes[i].stride;
+			if (has_modifier) {
+				*a++ = egl_dmabuf_plane_modifier_attr[i][0];
+				*a++ = dec->modifier & 0xffffffff;
+				*a++ = egl_dmabuf_plane_modifier_attr[i][1];
+				*a++ = dec->modifier >> 32;
+			}
 		}
 
-		attr[6 + 6*nplanes] = EGL_NONE;
+		*a = EGL_NONE;
 
 		image = dec->egl->eglCreateImageKHR(dec->egl->dpy, EGL_NO_CONTEXT,
 				EGL_LINUX_DMA_BUF_EXT, NULL, attr);
 	}
 
-#if !defined(HAVE_GBM_BO_MAP) || (HAVE_GBM_BO_MAP == 0)
-	/* Cleanup */
-	for (unsigned i = 0; i < nmems; i++)
-		close(planes[i].fd);
-#endif
+	if (is_dmabuf_mem && image != EGL_NO_IMAGE_KHR) {
+		image_cache_store(dec, mem, &key, image);
+		*cached = true;
+	}
 
 	return image;
 }
 
+bool
+video_eos(struct decoder *dec)
+{
+	/* the last sample may still be waiting in the mailbox */
+	return __atomic_load_n(&dec->eos, __ATOMIC_ACQUIRE) &&
+	       !__atomic_load_n(&dec->mailbox, __ATOMIC_ACQUIRE);
+}
+
+/* The appsink releases each sample when the pipeline clock reaches its
+ * running time: make it do so earlier by the time a frame drawn now takes
+ * to reach the screen, so that the sample in the mailbox is the one whose
+ * PTS best matches the predicted presentation time.
+ */
+static void
+update_render_delay(struct decoder *dec, uint64_t target)
+{
+	struct timespec ts;
+	int64_t now, delay;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	delay = CLAMP((int64_t)target - now, 0, 100 * GST_MSECOND);
+
+	if (dec->last_target && target > dec->last_target)
+		__atomic_store_n(&dec->render_interval,
+				 target - dec->last_target, __ATOMIC_RELAXED);
+	dec->last_target = target;
+
+	/* only bother the sink when the prediction moved noticeably */
+	if (llabs(delay - dec->render_delay) < GST_MSECOND)
+		return;
+
+	dec->render_delay = delay;
+	gst_base_sink_set_ts_offset(GST_BASE_SINK(dec->sink), -delay);
+}
+
 EGLImage
-video_frame(struct decoder *dec)
+video_frame(struct decoder *dec, uint64_t target)
 {
 	GstSample *samp;
 	GstBuffer *buf;
+	struct inflight_frame *cur;
 	EGLImage   frame = NULL;
+	bool       cached;
 
-	samp = gst_app_sink_pull_sample(GST_APP_SINK(dec->sink));
+	if (target)
+		update_render_delay(dec, target);
+
+	cur = current_frame(dec);
+
+	/* every slot holds a frame the GPU may still be reading: leave the
+	 * new sample in the mailbox (where a newer one may replace it) rather
+	 * than waiting for the GPU, and present the current frame again */
+	if (retire_frames(dec, false) == MAX_INFLIGHT_FRAMES) {
+		if (__atomic_load_n(&dec->mailbox, __ATOMIC_RELAXED))
+			dec->frames_throttled++;
+		return cur->image;
+	}
+
+	samp = __atomic_exchange_n(&dec->mailbox, NULL, __ATOMIC_ACQ_REL);
 	if (!samp) {
-		GST_DEBUG("got no appsink sample");
-		return NULL;
+		/* nothing new decoded since the last call, present the
+		 * current frame again */
+		if (cur && cur->image)
+			dec->frames_repeated++;
+		return cur ? cur->image : NULL;
+	}
+
+	if ((!dec->caps || gst_sample_get_caps(samp) != dec->caps) &&
+	    !update_caps(dec, gst_sample_get_caps(samp))) {
+		gst_sample_unref(samp);
+		return cur ? cur->image : NULL;
 	}
 
 	buf = gst_sample_get_buffer(samp);
+	frame_trace_begin(dec, GST_BUFFER_PTS(buf));
 
 	// TODO inline buffer_to_image??
-	frame = buffer_to_image(dec, buf);
-
-	// TODO in the zero-copy dmabuf case it would be nice to associate
-	// the eglimg w/ the buffer to avoid recreating it every frame..
+	frame = buffer_to_image(dec, buf, &cached);
+	frame_trace_stamp(FRAME_TRACE_IMPORTED);
 
-	set_last_frame(dec, frame, samp);
+	push_frame(dec, frame, cached, samp);
 
 	dec->frame++;
 
 	return frame;
 }
 
-void video_deinit(struct decoder *dec)
+unsigned
+video_frame_seq(struct decoder *dec)
 {
-#if HAVE_GBM_BO_MAP
-	unsigned int i;
-	for (i = 0; i< MAX_NUM_PLANES; i++) {
-		if (dec->gdm_bo_map.map[i] != NULL) {
-			close(dec->gdm_bo_map.fd[i]);
+	return dec->frame;
+}
 
-			gbm_bo_unmap(dec->gdm_bo_map.bo[i],
-				     dec->gdm_bo_map.map_data[i]);
-			
-			gbm_bo_destroy(dec->gdm_bo_map.bo[i]);
+void
+video_frame_size(struct decoder *dec, int *width, int *height)
+{
+	*width = GST_VIDEO_INFO_WIDTH(&dec->info);
+	*height = GST_VIDEO_INFO_HEIGHT(&dec->info);
+}
 
-		}
+void
+video_frame_done(struct decoder *dec)
+{
+	struct inflight_frame *cur = current_frame(dec);
+
+	if (!cur)
+		return;
+
+	/* fences signal in order: the one of the latest draw supersedes the
+	 * previous ones */
+	if (cur->fence)
+		dec->egl->eglDestroySyncKHR(dec->egl->dpy, cur->fence);
+	cur->fence = dec->egl->eglCreateSyncKHR(dec->egl->dpy,
+						EGL_SYNC_FENCE_KHR, NULL);
+}
+
+void
+video_set_wakeup_fd(struct decoder *dec, int fd)
+{
+	__atomic_store_n(&dec->wakeup_fd, fd, __ATOMIC_RELEASE);
+}
+
+void
+video_play(struct decoder *dec)
+{
+	if (!(dec->flags & VIDEO_FLAG_PREROLL))
+		return;
+
+	__atomic_and_fetch(&dec->flags, ~VIDEO_FLAG_PREROLL, __ATOMIC_RELEASE);
+	gst_element_set_state(dec->pipeline, GST_STATE_PLAYING);
+}
+
+/* Release everything tied to the EGL display: must be done on the render
+ * thread. */
+static void
+video_release(struct decoder *dec)
+{
+	printf("EGLImage cache: %u hits, %u misses over %u frames\n",
+	       dec->image_cache_hits, dec->image_cache_misses, dec->frame);
+	printf("Frames: %u zero-copy, %u copied\n",
+	       dec->frames_zero_copy, dec->frames_copied);
+	printf("Frames: %u dropped, %u repeated, %u throttled\n",
+	       dec->frames_dropped, dec->frames_repeated,
+	       dec->frames_throttled);
+
+	retire_frames(dec, true);
+
+#if HAVE_GBM_BO_MAP
+	printf("Staging BOs: high-water mark %u\n", dec->staging.high_water);
+	while (dec->staging.bos) {
+		struct staging_bo *sbo = dec->staging.bos;
 
-		dec->gdm_bo_map.fd[i] = -1;
-		dec->gdm_bo_map.bo[i] = NULL;
-		dec->gdm_bo_map.map[i] = NULL;
-		dec->gdm_bo_map.map_data[i] = NULL;
+		dec->staging.bos = sbo->next;
+		staging_bo_destroy(dec, sbo);
 	}
-	dec->gdm_bo_map.fd_index = 0;
 #endif
+}
 
-	set_last_frame(dec, NULL, NULL);
+/* Stop the pipeline and its thread: this may take a while, the streaming
+ * threads have to be joined */
+static void
+video_teardown(struct decoder *dec)
+{
 	gst_element_set_state(dec->pipeline, GST_STATE_NULL);
+	if (dec->mailbox)
+		gst_sample_unref(dec->mailbox);
+	gst_caps_replace(&dec->caps, NULL);
 	gst_object_unref(dec->sink);
 	gst_object_unref(dec->pipeline);
 	g_main_loop_quit(dec->loop);
 	g_main_loop_unref(dec->loop);
 	pthread_join(dec->gst_thread, 0);
+	g_source_destroy(dec->bus_watch);
+	g_source_unref(dec->bus_watch);
+	g_main_context_unref(dec->context);
 
 	free(dec);
 }
+
+static void *
+video_teardown_thread_func(void *args)
+{
+	video_teardown(args);
+	return NULL;
+}
+
+void video_deinit(struct decoder *dec)
+{
+	video_release(dec);
+	video_teardown(dec);
+}
+
+/* the thread of the last video_deinit_async(), see video_wait_teardown() */
+static pthread_t teardown_thread;
+static bool teardown_pending;
+
+void video_deinit_async(struct decoder *dec)
+{
+	video_release(dec);
+
+	/* one file lasts long enough for the previous teardown to be done */
+	video_wait_teardown();
+
+	if (pthread_create(&teardown_thread, NULL,
+			   video_teardown_thread_func, dec)) {
+		video_teardown(dec);
+		return;
+	}
+	teardown_pending = true;
+}
+
+void video_wait_teardown(void)
+{
+	if (!teardown_pending)
+		return;
+
+	pthread_join(teardown_thread, NULL);
+	teardown_pending = false;
+}
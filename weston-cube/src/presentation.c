@@ -0,0 +1,225 @@
+/*
+ * Copyright (c) 2019 STMicroelectronics. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "frame-trace.h"
+#include "presentation.h"
+#include "startup-trace.h"
+#include "telemetry.h"
+
+/* how long before a vblank the compositor latches the new frames (the
+ * default repaint window of weston) */
+#define REPAINT_WINDOW_NS	7000000
+
+#define NSEC_PER_SEC		1000000000ULL
+
+/* what is known about a commit when its feedback comes back */
+struct feedback {
+	uint64_t commit;
+	uint64_t frame;		/* telemetry_frame_id() */
+	uint64_t trace;		/* frame_trace_await_presentation() */
+};
+
+static struct {
+	struct wp_presentation *presentation;
+	clockid_t clock_id;
+
+	/* display model, from the vsync'ed presentations */
+	uint64_t refresh;
+	uint64_t last_vblank;
+	uint64_t last_seq;
+
+	uint64_t render_time;
+} pt = {
+	.clock_id = CLOCK_MONOTONIC,
+};
+
+static uint64_t
+clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void
+presentation_clock_id(void *data, struct wp_presentation *presentation,
+		      uint32_t clk_id)
+{
+	(void)data;
+	(void)presentation;
+
+	pt.clock_id = clk_id;
+}
+
+static const struct wp_presentation_listener presentation_listener = {
+	presentation_clock_id
+};
+
+static void
+feedback_sync_output(void *data, struct wp_presentation_feedback *feedback,
+		     struct wl_output *output)
+{
+	(void)data;
+	(void)feedback;
+	(void)output;
+}
+
+static void
+feedback_presented(void *data, struct wp_presentation_feedback *feedback,
+		   uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec,
+		   uint32_t refresh, uint32_t seq_hi, uint32_t seq_lo,
+		   uint32_t flags)
+{
+	struct feedback *fb = data;
+	uint64_t seq = ((uint64_t)seq_hi << 32) | seq_lo;
+	uint64_t when;
+
+	when = (((uint64_t)tv_sec_hi << 32) | tv_sec_lo) * NSEC_PER_SEC +
+		tv_nsec;
+	if (pt.clock_id != CLOCK_MONOTONIC)
+		when = when + clock_ns(CLOCK_MONOTONIC) - clock_ns(pt.clock_id);
+
+	/* only the vsync'ed presentations tell where the vblanks are; the
+	 * period is derived from the MSC when the compositor does not know
+	 * it (e.g. variable refresh rate) */
+	if (flags & WP_PRESENTATION_FEEDBACK_KIND_VSYNC) {
+		if (refresh)
+			pt.refresh = refresh;
+		else if (pt.last_vblank && seq > pt.last_seq &&
+			 when > pt.last_vblank)
+			pt.refresh = (when - pt.last_vblank) /
+				(seq - pt.last_seq);
+		pt.last_vblank = when;
+		pt.last_seq = seq;
+	}
+
+	telemetry_frame_presented(fb->frame,
+				  when > fb->commit ? when - fb->commit : 0);
+	frame_trace_presented(fb->trace, when);
+	startup_trace_presented(when);
+
+	wp_presentation_feedback_destroy(feedback);
+	free(fb);
+}
+
+static void
+feedback_discarded(void *data, struct wp_presentation_feedback *feedback)
+{
+	struct feedback *fb = data;
+
+	telemetry_frame_discarded(fb->frame);
+	frame_trace_presented(fb->trace, 0);
+
+	wp_presentation_feedback_destroy(feedback);
+	free(fb);
+}
+
+static const struct wp_presentation_feedback_listener feedback_listener = {
+	feedback_sync_output,
+	feedback_presented,
+	feedback_discarded
+};
+
+void
+presentation_init(struct wp_presentation *presentation)
+{
+	pt.presentation = presentation;
+	wp_presentation_add_listener(presentation, &presentation_listener,
+				     NULL);
+}
+
+void
+presentation_feedback(struct wl_surface *surface)
+{
+	struct wp_presentation_feedback *feedback;
+	struct feedback *fb;
+
+	if (!pt.presentation)
+		return;
+
+	fb = calloc(1, sizeof(*fb));
+	if (!fb)
+		return;
+
+	/* the commit itself is done by eglSwapBuffers(), right after */
+	fb->commit = clock_ns(CLOCK_MONOTONIC);
+	fb->frame = telemetry_frame_id();
+	fb->trace = frame_trace_await_presentation();
+
+	feedback = wp_presentation_feedback(pt.presentation, surface);
+	wp_presentation_feedback_add_listener(feedback, &feedback_listener, fb);
+}
+
+void
+presentation_render_time(uint64_t ns)
+{
+	pt.render_time = pt.render_time ?
+		(pt.render_time * 7 + ns) / 8 : ns;
+}
+
+/* first vblank at or after 't' */
+static uint64_t
+next_vblank(uint64_t t)
+{
+	uint64_t n;
+
+	if (t <= pt.last_vblank)
+		return pt.last_vblank;
+
+	n = (t - pt.last_vblank + pt.refresh - 1) / pt.refresh;
+
+	return pt.last_vblank + n * pt.refresh;
+}
+
+uint64_t
+presentation_wake_time(uint64_t now)
+{
+	uint64_t budget;
+
+	if (!pt.refresh || !pt.last_vblank)
+		return now;
+
+	/* leave the compositor its repaint window, and 50% of headroom to
+	 * the drawing */
+	budget = REPAINT_WINDOW_NS + pt.render_time * 3 / 2;
+
+	return next_vblank(now + budget) - budget;
+}
+
+uint64_t
+presentation_predict(uint64_t now)
+{
+	if (!pt.refresh || !pt.last_vblank)
+		return 0;
+
+	/* committed once drawn, then latched at the next repaint */
+	return next_vblank(now + pt.render_time + REPAINT_WINDOW_NS);
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2019 STMicroelectronics. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef PRESENTATION_H
+#define PRESENTATION_H
+
+#include <stdint.h>
+
+#include <wayland-client.h>
+
+#include "presentation-time-client-protocol.h"
+
+/* wp_presentation feedback: tells when the committed frames really reach
+ * the screen. Every presented frame updates a model of the display (its
+ * refresh period and the time of its last vblank), used to start drawing
+ * just in time for the next vblank and to predict when the frame being
+ * drawn will be visible. The commit-to-present latency and the presented
+ * and discarded counts go to the telemetry.
+ *
+ * All the times are CLOCK_MONOTONIC, in ns.
+ */
+
+void presentation_init(struct wp_presentation *presentation);
+
+/* ask for the feedback of the next commit of 'surface' */
+void presentation_feedback(struct wl_surface *surface);
+
+/* wall time of the last redraw, to know how long before the vblank the
+ * next one must start */
+void presentation_render_time(uint64_t ns);
+
+/* when to start drawing the next frame, 'now' if the display timing is
+ * unknown */
+uint64_t presentation_wake_time(uint64_t now);
+
+/* predicted presentation time of a frame drawn at 'now', 0 if unknown */
+uint64_t presentation_predict(uint64_t now);
+
+#endif
@@ -0,0 +1,336 @@
+/*
+ * Copyright (c) 2019 STMicroelectronics. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cube-mesh.h"
+#include "program-cache.h"
+
+/* bump when the file layout changes */
+#define CACHE_MAGIC		"CUBEPRG1"
+
+/* programs between program_cache_build() and program_cache_store() */
+#define MAX_PENDING		8
+
+struct cache_header {
+	char     magic[8];
+	uint32_t format;
+	uint32_t length;
+	/* how long building the program from source took */
+	uint32_t build_us;
+};
+
+struct pending_program {
+	GLuint   program;
+	uint64_t key;
+	uint64_t start;
+	bool     loaded;
+};
+
+static struct {
+	bool enabled;
+	char dir[PATH_MAX];
+	/* hash of the GL implementation and of the attribute locations, the
+	 * base of every key */
+	uint64_t gl_hash;
+
+	PFNGLGETPROGRAMBINARYOESPROC get_program_binary;
+	PFNGLPROGRAMBINARYOESPROC program_binary;
+
+	struct pending_program pending[MAX_PENDING];
+	unsigned next;
+
+	unsigned hits;
+	double saved_ms;
+} cache;
+
+static uint64_t
+time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* FNV-1a, including the terminating NUL so that "ab" + "c" and "a" + "bc"
+ * differ */
+static uint64_t
+hash_string(uint64_t hash, const char *s)
+{
+	if (!s)
+		s = "";
+
+	do {
+		hash ^= (unsigned char)*s;
+		hash *= 0x100000001b3ULL;
+	} while (*s++);
+
+	return hash;
+}
+
+static uint64_t
+program_key(const char *vs_src, const char *fs_src)
+{
+	return hash_string(hash_string(cache.gl_hash, vs_src), fs_src);
+}
+
+static void
+program_path(char *path, size_t size, uint64_t key)
+{
+	snprintf(path, size, "%s/%016" PRIx64 ".bin", cache.dir, key);
+}
+
+static struct pending_program *
+find_pending(GLuint program)
+{
+	unsigned i;
+
+	for (i = 0; i < MAX_PENDING; i++)
+		if (cache.pending[i].program == program)
+			return &cache.pending[i];
+
+	return NULL;
+}
+
+/* the oldest entry is reused when there is no room left: its program
+ * failed to link */
+static struct pending_program *
+add_pending(GLuint program, uint64_t key)
+{
+	struct pending_program *p = &cache.pending[cache.next];
+
+	cache.next = (cache.next + 1) % MAX_PENDING;
+	p->program = program;
+	p->key = key;
+	p->start = time_ns();
+	p->loaded = false;
+
+	return p;
+}
+
+static int
+make_dir(const char *path)
+{
+	if (mkdir(path, 0700) < 0 && errno != EEXIST)
+		return -1;
+
+	return 0;
+}
+
+void
+program_cache_init(void)
+{
+	const char *base = getenv("XDG_CACHE_HOME");
+	char path[PATH_MAX];
+	GLint formats = 0;
+
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS_OES, &formats);
+	if (formats <= 0)
+		return;
+
+	cache.get_program_binary =
+		(void *)eglGetProcAddress("glGetProgramBinaryOES");
+	cache.program_binary = (void *)eglGetProcAddress("glProgramBinaryOES");
+	if (!cache.get_program_binary || !cache.program_binary)
+		return;
+
+	if (base && base[0]) {
+		snprintf(path, sizeof(path), "%s", base);
+	} else if (getenv("HOME")) {
+		snprintf(path, sizeof(path), "%s/.cache", getenv("HOME"));
+	} else {
+		return;
+	}
+	snprintf(cache.dir, sizeof(cache.dir), "%s/weston-cube", path);
+	if (make_dir(path) || make_dir(cache.dir)) {
+		printf("Program cache: cannot create %s: %m\n", cache.dir);
+		return;
+	}
+
+	cache.gl_hash = hash_string(0xcbf29ce484222325ULL, CACHE_MAGIC);
+	cache.gl_hash = hash_string(cache.gl_hash,
+				    (const char *)glGetString(GL_VENDOR));
+	cache.gl_hash = hash_string(cache.gl_hash,
+				    (const char *)glGetString(GL_RENDERER));
+	cache.gl_hash = hash_string(cache.gl_hash,
+				    (const char *)glGetString(GL_VERSION));
+	/* the attribute locations are linked into the binaries */
+	cache.gl_hash = hash_string(cache.gl_hash, cube_attrib_layout());
+	cache.enabled = true;
+
+	printf("Program cache: %s\n", cache.dir);
+}
+
+GLuint
+program_cache_load(const char *vs_src, const char *fs_src)
+{
+	struct cache_header header;
+	struct pending_program *p;
+	char path[PATH_MAX];
+	uint64_t key, start;
+	void *binary = NULL;
+	GLuint program = 0;
+	GLint linked = 0;
+	double load_ms, build_ms;
+	FILE *f;
+
+	if (!cache.enabled)
+		return 0;
+
+	start = time_ns();
+	key = program_key(vs_src, fs_src);
+	program_path(path, sizeof(path), key);
+
+	f = fopen(path, "rb");
+	if (!f)
+		return 0;
+
+	if (fread(&header, sizeof(header), 1, f) != 1 ||
+	    memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) ||
+	    !header.length)
+		goto stale;
+
+	binary = malloc(header.length);
+	if (!binary || fread(binary, header.length, 1, f) != 1)
+		goto stale;
+
+	program = glCreateProgram();
+	cache.program_binary(program, header.format, binary, header.length);
+	glGetProgramiv(program, GL_LINK_STATUS, &linked);
+	if (!linked)
+		goto stale;
+
+	free(binary);
+	fclose(f);
+
+	p = add_pending(program, key);
+	p->loaded = true;
+
+	load_ms = (time_ns() - start) / 1e6;
+	build_ms = header.build_us / 1e3;
+	cache.hits++;
+	cache.saved_ms += build_ms - load_ms;
+	printf("Program cache: hit %016" PRIx64 ", %.1f ms instead of %.1f ms "
+	       "(%u hits, %.1f ms saved)\n", key, load_ms, build_ms,
+	       cache.hits, cache.saved_ms);
+
+	return program;
+
+stale:
+	/* typically a driver update: build it again, and replace it */
+	if (program)
+		glDeleteProgram(program);
+	free(binary);
+	fclose(f);
+	unlink(path);
+
+	return 0;
+}
+
+void
+program_cache_build(GLuint program, const char *vs_src, const char *fs_src)
+{
+	if (!cache.enabled)
+		return;
+
+	add_pending(program, program_key(vs_src, fs_src));
+}
+
+bool
+program_cache_loaded(GLuint program)
+{
+	struct pending_program *p = find_pending(program);
+
+	if (!p || !p->loaded)
+		return false;
+
+	p->program = 0;
+	return true;
+}
+
+void
+program_cache_store(GLuint program)
+{
+	struct pending_program *p = find_pending(program);
+	struct cache_header header;
+	char path[PATH_MAX], tmp[PATH_MAX + 4];
+	GLint length = 0;
+	GLsizei written = 0;
+	GLenum format;
+	void *binary;
+	FILE *f;
+
+	if (!cache.enabled || !p)
+		return;
+
+	header.build_us = (time_ns() - p->start) / 1000;
+	p->program = 0;
+
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH_OES, &length);
+	if (length <= 0)
+		return;
+
+	binary = malloc(length);
+	if (!binary)
+		return;
+
+	cache.get_program_binary(program, length, &written, &format, binary);
+	if (written <= 0)
+		goto out;
+
+	memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+	header.format = format;
+	header.length = written;
+
+	/* written aside then renamed, so that a concurrent instance never
+	 * reads a partial binary */
+	program_path(path, sizeof(path), p->key);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	f = fopen(tmp, "wb");
+	if (!f)
+		goto out;
+
+	if (fwrite(&header, sizeof(header), 1, f) != 1 ||
+	    fwrite(binary, written, 1, f) != 1) {
+		fclose(f);
+		unlink(tmp);
+		goto out;
+	}
+	if (fclose(f) || rename(tmp, path))
+		unlink(tmp);
+
+out:
+	free(binary);
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2019 STMicroelectronics. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef PROGRAM_CACHE_H
+#define PROGRAM_CACHE_H
+
+#include <stdbool.h>
+
+#include "simple-st-egl.h"
+
+/* Persistent cache of the linked programs, with GL_OES_get_program_binary:
+ * the binary of every program built from source is saved in
+ * $XDG_CACHE_HOME/weston-cube (~/.cache/weston-cube by default), under a
+ * hash of its shader sources, of the GL vendor, renderer and version and of
+ * the attribute locations.
+ * Later runs load it instead of compiling and linking the shaders again;
+ * a binary the driver rejects is silently rebuilt from source.
+ */
+
+/* with the context current, when GL_OES_get_program_binary is supported:
+ * until then, every program is built from source */
+void program_cache_init(void);
+
+/* a program linked from the cached binary of 'vs_src' and 'fs_src', 0 if
+ * there is none */
+GLuint program_cache_load(const char *vs_src, const char *fs_src);
+
+/* 'program' is about to be built from 'vs_src' and 'fs_src' */
+void program_cache_build(GLuint program, const char *vs_src,
+			 const char *fs_src);
+
+/* true if 'program' comes from program_cache_load(): it is already linked
+ * and has no shaders attached */
+bool program_cache_loaded(GLuint program);
+
+/* 'program' was successfully linked: save its binary */
+void program_cache_store(GLuint program);
+
+#endif
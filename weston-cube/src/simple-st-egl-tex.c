@@ -24,12 +24,17 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
-//#include <string.h>
+#include <string.h>
 #include <stdbool.h>
 //#include <math.h>
 #include <assert.h>
+#include <errno.h>
 #include <signal.h>
 #include <getopt.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 
 #include <linux/input.h>
 
@@ -49,6 +54,7 @@
 
 #include "xdg-shell-unstable-v6-client-protocol.h"
 #include "linux-dmabuf-unstable-v1-client-protocol.h"
+#include "presentation-time-client-protocol.h"
 #include <unistd.h>
 
 #ifdef HAVE_GST
@@ -58,12 +64,28 @@ GST_DEBUG_CATEGORY(cube_video_debug);
 
 #include "simple-st-egl.h"
 #include "cube-common.h"
+#include "cube-grid.h"
+#include "presentation.h"
+#include "startup-trace.h"
+#include "telemetry.h"
 #include "shared/platform.h"
 
 #define DRM_RENDER_NODE "/dev/dri/card0"
 
 #define CUBE_VERSION "20200908"
 
+/* redraw period with -i, when the compositor does not pace the drawing */
+#define REDRAW_INTERVAL_NS	16666667
+
+#ifndef ARRAY_LENGTH
+#define ARRAY_LENGTH(a) (sizeof (a) / sizeof (a)[0])
+#endif
+
+#define BENCHMARK_FRAMES	600
+/* frames drawn before measuring: shader compilation, first video
+ * samples, ... */
+#define BENCHMARK_WARMUP	30
+
 static int running = 1;
 
 static void
@@ -424,39 +446,12 @@ keyboard_handle_key(void *data, struct wl_keyboard *keyboard,
 			zxdg_toplevel_v6_set_maximized(d->window->xdg_toplevel);
 			//zxdg_toplevel_v6_set_fullscreen(d->window->xdg_toplevel,
 			//				NULL);
+	} else if (key == KEY_U && state) {
+		d->window->uber_shader = !d->window->uber_shader;
+		printf("Using %s shader\n",
+		       d->window->uber_shader ? "uber" : "per-face");
 	} else if (key == KEY_ESC && state)
 		running = 0;
-
-#ifdef DAMAGE_DEBUG
-	struct window *w = d->window;
-
-	if (key == KEY_X && state) {
-		w->update = &w->corner.x;
-	} else if (key == KEY_Y && state) {
-		w->update = &w->corner.y;
-	} else if (key == KEY_W && state) {
-		w->update = &w->rect.x;
-	} else if (key == KEY_H && state) {
-		w->update = &w->rect.y;
-	} else if (key == KEY_UP && state) {
-		*(w->update) += 1;
-	} else if (key == KEY_DOWN && state) {
-		*(w->update) -= 1;
-	} else if (key == KEY_PAGEUP && state) {
-		*(w->update) += 10;
-	} else if (key == KEY_PAGEDOWN && state) {
-		*(w->update) -= 10;
-	}
-
-	printf("{%ix%i}-[%ix%i]\n",
-	       (EGLint)w->corner.x, (EGLint)w->corner.y,
-	       (EGLint)w->rect.x,     (EGLint)w->rect.y);
-	printf("{%6.2fx%6.2f}-[%6.2fx%6.2f]\n",
-		   w->corner.x / w->geometry.width,
-		   w->corner.y / w->geometry.height,
-		   w->rect.x   / w->geometry.width,
-		   w->rect.y   / w->geometry.height);
-#endif
 }
 
 static void
@@ -573,7 +568,9 @@ registry_handle_global(void *data, struct wl_registry *registry,
 	} else if (strcmp(interface, "wl_shm") == 0) {
 		d->shm = wl_registry_bind(registry, name,
 					  &wl_shm_interface, 1);
+		startup_trace_begin("cursor theme");
 		d->cursor_theme = wl_cursor_theme_load(NULL, 32, d->shm);
+		startup_trace_end();
 		if (!d->cursor_theme) {
 			fprintf(stderr, "unable to load default theme\n");
 			return;
@@ -591,6 +588,11 @@ registry_handle_global(void *data, struct wl_registry *registry,
 					     &zwp_linux_dmabuf_v1_interface, 3);
 		zwp_linux_dmabuf_v1_add_listener(d->dmabuf, &dmabuf_listener,
 						 d);
+	} else if (strcmp(interface, "wp_presentation") == 0) {
+		d->presentation =
+			wl_registry_bind(registry, name,
+					 &wp_presentation_interface, 1);
+		presentation_init(d->presentation);
 	}
 }
 
@@ -608,6 +610,8 @@ static const struct wl_registry_listener registry_listener = {
 static void
 destroy_display(struct display *d)
 {
+	video_wait_teardown();
+
 	if (d->gbm.dev)
 		gbm_device_destroy(d->gbm.dev);
 
@@ -625,6 +629,9 @@ destroy_display(struct display *d)
 	if (d->dmabuf)
 		zwp_linux_dmabuf_v1_destroy(d->dmabuf);
 
+	if (d->presentation)
+		wp_presentation_destroy(d->presentation);
+
 	if (d->shell)
 		zxdg_shell_v6_destroy(d->shell);
 
@@ -661,16 +668,19 @@ create_display(char const *drm_render_node, struct window *w)
 	d->display = wl_display_connect(NULL);
 	assert(d->display);
 
+	startup_trace_begin("registry roundtrips");
 	d->registry = wl_display_get_registry(d->display);
 	wl_registry_add_listener(d->registry,
 				 &registry_listener, d);
 	wl_display_roundtrip(d->display);
 	if (d->dmabuf == NULL) {
+		startup_trace_end();
 		fprintf(stderr, "No zwp_linux_dmabuf global\n");
 		goto error;
 	}
 
 	wl_display_roundtrip(d->display);
+	startup_trace_end();
 
 	if (!d->modifiers_count) {
 		fprintf(stderr, "format XRGB8888 is not available\n");
@@ -694,13 +704,350 @@ error:
 
 
 
+/* Offscreen rendering for --benchmark: no Wayland connection, the
+ * frames are drawn in a framebuffer object (see init_offscreen()). */
+static struct display *
+create_headless_display(char const *drm_render_node, struct window *w)
+{
+	struct display *d = NULL;
+
+	d = calloc(1, sizeof *d);
+	if (d == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return NULL;
+	}
+
+	d->gbm.drm_fd = -1;
+
+	if (init_egl(d, w)) {
+		destroy_display(d);
+		return NULL;
+	}
+
+	/* only the video mode allocates buffers */
+	if (int_gbm(d, drm_render_node))
+		fprintf(stderr, "no GBM device, video mode disabled\n");
+
+	return d;
+}
+
+static double
+benchmark_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const char *
+mode_name(enum mode mod)
+{
+	switch (mod) {
+	case SMOOTH:
+		return "smooth";
+	case ONE_TEX:
+		return "tex1";
+	case THREE_TEX:
+		return "tex3";
+	case ONE_MAP_TEX:
+		return "tex6";
+	case VIDEO:
+		return "video";
+	}
+
+	return "unknown";
+}
+
+/* Print one JSON object on stdout for 'frames' frames of the current
+ * mode drawn as fast as possible. 'base_ms' is the frame time with a
+ * single cube, to tell the cost of each additional one. Returns the frame
+ * time, in ms. */
+static double
+benchmark_mode(struct window *w, int frames, double base_ms)
+{
+	struct display *d = w->display;
+	double start, seconds, frame_ms;
+	int i, n, cubes;
+
+	for (i = 0; i < BENCHMARK_WARMUP && running; i++)
+		w->redraw(w, NULL);
+
+	telemetry_reset();
+	start = benchmark_time();
+	for (n = 0; n < frames && running; n++)
+		w->redraw(w, NULL);
+	seconds = benchmark_time() - start;
+	frame_ms = n > 0 ? seconds * 1000 / n : 0;
+
+	cubes = cube_grid_enabled(w) ? w->grid_cols * w->grid_rows : 1;
+	printf("{\"mode\": \"%s\", \"width\": %d, \"height\": %d, "
+	       "\"vao\": %s, \"cubes\": %d, \"instanced\": %s, "
+	       "\"frames\": %d, \"seconds\": %.3f, \"fps\": %.2f, "
+	       "\"frame_ms\": %.3f, ",
+	       w->mod != VIDEO ? mode_name(w->mod) :
+	       w->uber_shader ? "video-uber" :
+	       w->video_prepass ? "video-prepass" : "video",
+	       w->geometry.width, w->geometry.height,
+	       d->egl.has_vertex_array_object ? "true" : "false",
+	       cubes, cube_grid_enabled(w) &&
+	       d->egl.has_instanced_arrays ? "true" : "false",
+	       n, seconds, seconds > 0 ? n / seconds : 0, frame_ms);
+	if (cubes > 1 && base_ms > 0)
+		printf("\"cube_us\": %.3f, ",
+		       (frame_ms - base_ms) * 1000 / (cubes - 1));
+	printf("\"telemetry\": ");
+	telemetry_write_json(stdout);
+	printf("}\n");
+	fflush(stdout);
+
+	return frame_ms;
+}
+
+/* free what the init_cube_*() of the current mode created */
+static void
+fini_cube(struct window *w)
+{
+	if (w->mod == SMOOTH)
+		fini_cube_smooth(w);
+	else if (w->mod == VIDEO)
+		fini_cube_video(w);
+	else
+		fini_cube_tex(w);
+}
+
+/* Draw 'frames' frames of each mode offscreen, as fast as possible, and
+ * print one JSON object per mode on stdout. The textured modes all use
+ * the first texture given, the video mode a synthetic source unless a
+ * file is given. With a grid of cubes, each mode is drawn with a single
+ * cube, then 4 times more at each step up to the grid size, to tell how
+ * the frame time scales with the number of cubes. */
+static void
+run_benchmark(struct window *w, int frames, const char *video)
+{
+	struct display *d = w->display;
+	int grid_cols = w->grid_cols, grid_rows = w->grid_rows;
+	double base_ms;
+	enum mode mod;
+	int i, side;
+
+	if (!video)
+		video = "videotestsrc is-live=false";
+
+	for (i = 1; i < 3; i++)
+		if (!w->tex_filename[i] && w->tex_filename[0])
+			w->tex_filename[i] = strdup(w->tex_filename[0]);
+
+	for (mod = SMOOTH; mod <= VIDEO && running; mod++) {
+		const char *skip = NULL;
+
+		if (mod != SMOOTH && mod != VIDEO && !w->tex_filename[0])
+			skip = "no texture file";
+		else if (mod == VIDEO &&
+			 (!d->egl.has_dma_buf_import || !d->gbm.dev))
+			skip = "no dmabuf import";
+
+		w->mod = mod;
+		w->redraw = NULL;
+		w->frames_cumul = 0;
+		if (!skip) {
+			if (mod == SMOOTH)
+				init_cube_smooth(w);
+			else if (mod == VIDEO)
+				init_cube_video(w, video);
+			else
+				init_cube_tex(w);
+			if (!w->redraw)
+				skip = "initialization failed";
+		}
+		if (skip) {
+			printf("{\"mode\": \"%s\", \"skipped\": \"%s\"}\n",
+			       mode_name(mod), skip);
+			fini_cube(w);
+			continue;
+		}
+
+		if (!grid_cols)
+			benchmark_mode(w, frames, 0);
+
+		base_ms = 0;
+		for (side = 1; grid_cols && running; side *= 2) {
+			w->grid_cols = MIN(side, grid_cols);
+			w->grid_rows = MIN(side, grid_rows);
+			if (side == 1)
+				base_ms = benchmark_mode(w, frames, 0);
+			else
+				benchmark_mode(w, frames, base_ms);
+			if (w->grid_cols == grid_cols &&
+			    w->grid_rows == grid_rows)
+				break;
+		}
+
+		/* each mode is measured on its own */
+		fini_cube(w);
+	}
+
+	cube_grid_fini();
+}
+
+static uint64_t
+time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static bool
+window_ready(struct window *w)
+{
+	if (w->wait_for_configure || !w->redraw)
+		return false;
+
+	/* paced by the frame callbacks, or by the timer and the decoder */
+	return !w->frame_sync || !w->callback;
+}
+
+static void
+drain_fd(int fd)
+{
+	uint64_t count;
+
+	if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		fprintf(stderr, "read: %s\n", strerror(errno));
+}
+
+/* Sleep until something happens on the Wayland connection, the redraw
+ * timer or the video decoder, and redraw the window when it is its turn.
+ * Events are read with wl_display_prepare_read() so that EGL can read its
+ * own queue while swapping, and input is dispatched between two frames.
+ * With frame callbacks, the timer delays the drawing to just before the
+ * next vblank when wp_presentation tells when it is.
+ */
+static int
+main_loop(struct window *w)
+{
+	struct display *d = w->display;
+	struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+	struct pollfd fds[3];
+	uint64_t now, wake = 0;
+	bool tick = false;
+	int timer_fd, ret = 0;
+
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if (timer_fd < 0) {
+		fprintf(stderr, "cannot create the redraw timer: %s\n",
+			strerror(errno));
+		return -1;
+	}
+
+	/* unsynchronized videos are redrawn when a frame is decoded, the
+	 * other modes at a fixed rate */
+	if (!w->frame_sync && w->mod != VIDEO) {
+		its.it_interval.tv_nsec = REDRAW_INTERVAL_NS;
+		its.it_value = its.it_interval;
+		timerfd_settime(timer_fd, 0, &its, NULL);
+	}
+
+	fds[0].fd = wl_display_get_fd(d->display);
+	fds[1].fd = timer_fd;
+	fds[1].events = POLLIN;
+	fds[2].fd = w->wakeup_fd;
+	fds[2].events = POLLIN;
+
+	while (running) {
+		while (wl_display_prepare_read(d->display) != 0) {
+			if (wl_display_dispatch_pending(d->display) < 0) {
+				ret = -1;
+				goto out;
+			}
+		}
+
+		if (window_ready(w)) {
+			now = time_ns();
+
+			/* once the compositor is done with the previous frame,
+			 * wait until the last moment to draw the next one */
+			if (w->frame_sync && !wake) {
+				wake = presentation_wake_time(now);
+				its.it_value.tv_sec = wake / 1000000000;
+				its.it_value.tv_nsec = wake % 1000000000;
+				if (wake > now)
+					timerfd_settime(timer_fd,
+							TFD_TIMER_ABSTIME,
+							&its, NULL);
+				else
+					tick = true;
+			}
+
+			if (tick) {
+				wl_display_cancel_read(d->display);
+				tick = false;
+				wake = 0;
+				w->redraw(w, NULL);
+				presentation_render_time(time_ns() - now);
+				continue;
+			}
+		}
+
+		fds[0].events = POLLIN;
+		if (wl_display_flush(d->display) < 0) {
+			if (errno != EAGAIN) {
+				wl_display_cancel_read(d->display);
+				ret = -1;
+				break;
+			}
+			fds[0].events |= POLLOUT;
+		}
+
+		if (poll(fds, ARRAY_LENGTH(fds), -1) < 0) {
+			wl_display_cancel_read(d->display);
+			if (errno == EINTR)
+				continue;
+			ret = -1;
+			break;
+		}
+
+		if (fds[0].revents & POLLIN) {
+			if (wl_display_read_events(d->display) < 0) {
+				ret = -1;
+				break;
+			}
+		} else {
+			wl_display_cancel_read(d->display);
+			if (fds[0].revents & (POLLERR | POLLHUP)) {
+				fprintf(stderr, "compositor connection lost\n");
+				ret = -1;
+				break;
+			}
+		}
+
+		if (fds[1].revents & POLLIN) {
+			drain_fd(timer_fd);
+			tick = true;
+		}
+		if (fds[2].revents & POLLIN) {
+			drain_fd(w->wakeup_fd);
+			tick = true;
+		}
+	}
+
+out:
+	close(timer_fd);
+
+	return ret;
+}
+
 static void
 signal_int(int signum)
 {
 	running = 0;
 }
 
-static const char *shortopts = "fodsi:1:3:6:v:c:bh";
+static const char *shortopts = "fodsi:1:3:6:v:c:bupBn:g:VG:Ih";
 
 static const struct option longopts[] = {
 	{"fullscreen",    no_argument,       0, 'f'},
@@ -715,6 +1062,14 @@ static const struct option longopts[] = {
 	{"animated",      no_argument,       0, 'a'},
 	{"cam-fps",       required_argument, 0, 'c'},
 	{"background",    no_argument,       0, 'b'},
+	{"uber-shader",   no_argument,       0, 'u'},
+	{"prepass",       no_argument,       0, 'p'},
+	{"benchmark",     no_argument,       0, 'B'},
+	{"frames",        required_argument, 0, 'n'},
+	{"size",          required_argument, 0, 'g'},
+	{"no-vao",        no_argument,       0, 'V'},
+	{"grid",          required_argument, 0, 'G'},
+	{"no-instancing", no_argument,       0, 'I'},
 	{"help",          no_argument,       0, 'h'},
 	{0, 0, 0, 0}
 };
@@ -722,7 +1077,7 @@ static const struct option longopts[] = {
 static void
 usage(int error_code)
 {
-	fprintf(stderr, "Usage: simple-st-egl-cube-tex [fosba136vch]\n"
+	fprintf(stderr, "Usage: simple-st-egl-cube-tex [fosba136vcbupBngVGIh]\n"
 			"\n"
 			"options:\n"
 			"  -f, --fullscreen          Run in fullscreen mode\n"
@@ -743,6 +1098,19 @@ usage(int error_code)
 			"  -c, --cam-fps=(fraction)  Only for camera. Specify Camera fps output\n"
 			"                            (i.e 15/1 default)\n"
 			"  -b, --background          Video frams as background\n"
+			"  -u, --uber-shader         Draw the video cube with a single\n"
+			"                            program and draw call ('u' toggles)\n"
+			"  -p, --prepass             Apply the video effects once per\n"
+			"                            decoded frame\n"
+			"  -B, --benchmark           Render every mode offscreen, without\n"
+			"                            a compositor, and print statistics\n"
+			"  -n, --frames=N            Frames drawn per benchmark mode\n"
+			"                            (" CUBE_STR(BENCHMARK_FRAMES) ")\n"
+			"  -g, --size=WxH            Benchmark rendering size (480x480)\n"
+			"  -V, --no-vao              Do not use vertex array objects\n"
+			"  -G, --grid=NxM            Draw a grid of NxM cubes; the\n"
+			"                            benchmark scales up to it\n"
+			"  -I, --no-instancing       Draw the grid one cube at a time\n"
 			"  -h, --help                This help text\n\n");
 
 	exit(error_code);
@@ -757,9 +1125,16 @@ main(int argc, char **argv)
 	char const *drm_render_node = DRM_RENDER_NODE;
 	int i, ret = 0, opt;
 	const char *video = NULL;
+	bool benchmark = false;
+	bool no_vao = false;
+	bool no_instancing = false;
+	int frames = BENCHMARK_FRAMES;
 
+	startup_trace_init();
 #ifdef HAVE_GST
+	startup_trace_begin("gst_init");
 	gst_init(&argc, &argv);
+	startup_trace_end();
 	GST_DEBUG_CATEGORY_INIT(cube_video_debug, "cube", 0,
 				"cube video pipeline");
 #endif
@@ -772,6 +1147,7 @@ main(int argc, char **argv)
 	window.background = 0;
 	window.cam_fps = strdup("15/1");
 	window.animated = false;
+	window.wakeup_fd = -1;
 
 	fprintf(stderr, "Version: simple-st-egl-cube-tex \"%s\"\n",
 		CUBE_VERSION);
@@ -795,6 +1171,12 @@ main(int argc, char **argv)
 		case 'b':
 			window.background = 1;
 			break;
+		case 'u':
+			window.uber_shader = true;
+			break;
+		case 'p':
+			window.video_prepass = true;
+			break;
 		case 'i':
 			window.frame_sync = 0;
 			break;
@@ -828,52 +1210,119 @@ main(int argc, char **argv)
 		case 'a':
 				window.animated = true;
 				break;
+		case 'B':
+				benchmark = true;
+				break;
+		case 'n':
+				frames = atoi(optarg);
+				if (frames <= 0)
+					usage(EXIT_FAILURE);
+				break;
+		case 'g':
+				if (sscanf(optarg, "%dx%d", &window.geometry.width,
+					   &window.geometry.height) != 2 ||
+				    window.geometry.width <= 0 ||
+				    window.geometry.height <= 0)
+					usage(EXIT_FAILURE);
+				window.window_size = window.geometry;
+				break;
+		case 'V':
+				no_vao = true;
+				break;
+		case 'G':
+				if (sscanf(optarg, "%dx%d", &window.grid_cols,
+					   &window.grid_rows) != 2 ||
+				    window.grid_cols <= 0 ||
+				    window.grid_rows <= 0)
+					usage(EXIT_FAILURE);
+				break;
+		case 'I':
+				no_instancing = true;
+				break;
 		default:
 				usage(EXIT_FAILURE);
 				break;
 		}
 	}
 
+	sigint.sa_handler = signal_int;
+	sigemptyset(&sigint.sa_mask);
+	sigint.sa_flags = SA_RESETHAND;
+
+	if (benchmark) {
+		display = create_headless_display(drm_render_node, &window);
+		if (!display)
+			return 1;
+		window.display = display;
+		display->window = &window;
+		if (no_vao)
+			display->egl.has_vertex_array_object = false;
+		if (no_instancing)
+			display->egl.has_instanced_arrays = false;
+
+		if (init_offscreen(&window)) {
+			destroy_display(display);
+			return 1;
+		}
+
+		sigaction(SIGINT, &sigint, NULL);
+		run_benchmark(&window, frames, video);
+
+		fini_offscreen(&window);
+		destroy_display(display);
+
+		return 0;
+	}
+
+	startup_trace_begin("create_display");
 	display = create_display(drm_render_node, &window);
+	startup_trace_end();
 	if (!display)
 		return 1;
 	window.display = display;
 	display->window = &window;
+	if (no_vao)
+		display->egl.has_vertex_array_object = false;
+	if (no_instancing)
+		display->egl.has_instanced_arrays = false;
+
+	/* only needed when the decoder, not the compositor, paces the
+	 * redraws */
+	if (!window.frame_sync)
+		window.wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
 
+	startup_trace_begin("create_surface");
 	create_surface(&window);
+	startup_trace_end();
+	startup_trace_begin("init_cube");
 	if (window.mod == SMOOTH)
 		init_cube_smooth(&window);
 	else if (window.mod == VIDEO)
 		init_cube_video(&window, video);
 	else
 		init_cube_tex(&window);
+	startup_trace_end();
 
 	display->cursor_surface =
 		wl_compositor_create_surface(display->compositor);
 
-	sigint.sa_handler = signal_int;
-	sigemptyset(&sigint.sa_mask);
-	sigint.sa_flags = SA_RESETHAND;
 	sigaction(SIGINT, &sigint, NULL);
 
-	/* The mainloop here is a little subtle.  Redrawing will cause
-	 * EGL to read events so we can just call
-	 * wl_display_dispatch_pending() to handle any events that got
-	 * queued up as a side effect. */
-	while (running && ret != -1) {
-		if (window.wait_for_configure) {
-			wl_display_dispatch(display->display);
-		} else {
-			wl_display_dispatch_pending(display->display);
-			window.redraw(&window, NULL);
-		}
-	}
+	ret = main_loop(&window);
 
 	fprintf(stderr, "simple-egl exiting\n");
+	/* the first frame may never have been reported as presented, or
+	 * even drawn */
+	startup_trace_finish();
+	fini_cube(&window);
+	cube_grid_fini();
 
 	wl_surface_destroy(display->cursor_surface);
 	destroy_surface(&window);
 	destroy_display(display);
+	/* only once the decoders, which write to it, are gone */
+	if (window.wakeup_fd >= 0)
+		close(window.wakeup_fd);
 
-	return 0;
+	return ret < 0 ? 1 : 0;
 }
@@ -38,6 +38,9 @@ struct seat;
 
 #define BUFFER_FORMAT DRM_FORMAT_XRGB8888
 
+/* oldest back buffer that can be partially redrawn */
+#define MAX_BUFFER_AGE	4
+
 enum mode {
 	SMOOTH,
 	ONE_TEX,
@@ -51,9 +54,15 @@ struct _egl {
 	EGLContext ctx;
 	EGLConfig conf;
 
+	bool has_dma_buf_import;
 	bool has_dma_buf_import_modifiers;
+	bool has_vertex_array_object;
+	bool has_parallel_shader_compile;
+	bool has_instanced_arrays;
+	bool has_texture_rg;
 
 	PFNEGLSWAPBUFFERSWITHDAMAGEEXTPROC swap_buffers_with_damage;
+	PFNEGLSETDAMAGEREGIONKHRPROC set_damage_region;
 	PFNEGLQUERYDMABUFMODIFIERSEXTPROC query_dma_buf_modifiers;
 	PFNEGLCREATEIMAGEKHRPROC eglCreateImageKHR;
 	PFNEGLDESTROYIMAGEKHRPROC eglDestroyImageKHR;
@@ -62,6 +71,17 @@ struct _egl {
 	PFNEGLDESTROYSYNCKHRPROC eglDestroySyncKHR;
 	PFNEGLCLIENTWAITSYNCKHRPROC eglClientWaitSyncKHR;
 	PFNGLEGLIMAGETARGETTEXTURE2DOESPROC glEGLImageTargetTexture2DOES;
+	PFNGLGENQUERIESEXTPROC glGenQueriesEXT;
+	PFNGLBEGINQUERYEXTPROC glBeginQueryEXT;
+	PFNGLENDQUERYEXTPROC glEndQueryEXT;
+	PFNGLGETQUERYOBJECTUIVEXTPROC glGetQueryObjectuivEXT;
+	PFNGLGETQUERYOBJECTUI64VEXTPROC glGetQueryObjectui64vEXT;
+	PFNGLGENVERTEXARRAYSOESPROC glGenVertexArraysOES;
+	PFNGLBINDVERTEXARRAYOESPROC glBindVertexArrayOES;
+	PFNGLDELETEVERTEXARRAYSOESPROC glDeleteVertexArraysOES;
+	/* from GL_EXT_instanced_arrays or GL_ANGLE_instanced_arrays */
+	PFNGLVERTEXATTRIBDIVISOREXTPROC glVertexAttribDivisorEXT;
+	PFNGLDRAWELEMENTSINSTANCEDEXTPROC glDrawElementsInstancedEXT;
 
 };
 struct _gbm {
@@ -75,6 +95,7 @@ struct display {
 	struct wl_compositor *compositor;
 	struct zxdg_shell_v6 *shell;
 	struct zwp_linux_dmabuf_v1 *dmabuf;
+	struct wp_presentation *presentation;
 	struct wl_seat *seat;
 	struct wl_pointer *pointer;
 	struct wl_touch *touch;
@@ -107,30 +128,38 @@ struct window {
 	struct display *display;
 	struct geometry geometry, window_size;
 	struct gl *gl;
-	uint32_t benchmark_time, frames, frames_cumul;
+	uint32_t frames_cumul;
 	struct wl_egl_window *native;
 	struct wl_surface *surface;
 	struct zxdg_surface_v6 *xdg_surface;
 	struct zxdg_toplevel_v6 *xdg_toplevel;
 	EGLSurface egl_surface;
 	struct wl_callback *callback;
+	int wakeup_fd;
 	int fullscreen, opaque, buffer_size, frame_sync, background;
 	char * cam_fps;
 	char * tex_filename[3];
 	bool wait_for_configure;
 	bool animated;
+	/* video cube drawn with one program, see cube-video.c */
+	bool uber_shader;
+	/* video effects computed once per decoded frame, see cube-video.c */
+	bool video_prepass;
+	/* grid of cubes drawn instead of one when set, see cube-grid.h */
+	int grid_cols, grid_rows;
 	struct point move, enter;
 	struct point pitch;
-	EGLint damage[4];
+	EGLint cube_box[4];
+	/* damage of the previous frames, see window_damage_region() */
+	EGLint damage[MAX_BUFFER_AGE][4];
+	unsigned damage_next, damage_count;
 	GLuint time_enter;
 	bool button_pressed;
+	bool headless;
+	GLuint offscreen_fbo, offscreen_tex;
 	enum mode mod;
 	void (*redraw)(void *data, struct wl_callback *callback);
 	void (*next_shader)(void *data);
-#ifdef DAMAGE_DEBUG
-	GLfloat *update;
-	struct point corner, rect;
-#endif
 };
 
 #endif
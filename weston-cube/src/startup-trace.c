@@ -0,0 +1,226 @@
+/*
+ * Copyright (c) 2019 STMicroelectronics. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "startup-trace.h"
+
+#define STARTUP_TRACE_EVENTS	64
+#define STARTUP_TRACE_DEPTH	8
+
+struct event {
+	const char *name;
+	uint64_t start, end;	/* end == start for instant events */
+	bool main_thread;
+};
+
+static struct {
+	bool enabled;
+	uint64_t origin;
+	pthread_t main_thread;
+	pthread_mutex_t lock;
+
+	struct event events[STARTUP_TRACE_EVENTS];
+	unsigned count;
+
+	/* phases begun and not ended yet (main thread only) */
+	struct event *stack[STARTUP_TRACE_DEPTH];
+	unsigned depth;
+
+	uint64_t first_swap;
+} trace = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+uint64_t
+startup_trace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void
+startup_trace_init(void)
+{
+	trace.origin = startup_trace_now();
+	trace.main_thread = pthread_self();
+	trace.enabled = true;
+}
+
+/* with trace.lock held */
+static struct event *
+add_event(const char *name, uint64_t start, uint64_t end)
+{
+	struct event *e;
+
+	if (!trace.enabled || trace.count == STARTUP_TRACE_EVENTS)
+		return NULL;
+
+	e = &trace.events[trace.count++];
+	e->name = name;
+	e->start = start;
+	e->end = end;
+	e->main_thread = pthread_equal(pthread_self(), trace.main_thread);
+
+	return e;
+}
+
+void
+startup_trace_begin(const char *name)
+{
+	struct event *e;
+
+	pthread_mutex_lock(&trace.lock);
+	e = add_event(name, startup_trace_now(), 0);
+	if (trace.depth < STARTUP_TRACE_DEPTH)
+		trace.stack[trace.depth] = e;
+	trace.depth++;
+	pthread_mutex_unlock(&trace.lock);
+}
+
+void
+startup_trace_end(void)
+{
+	struct event *e = NULL;
+
+	pthread_mutex_lock(&trace.lock);
+	if (trace.depth && --trace.depth < STARTUP_TRACE_DEPTH)
+		e = trace.stack[trace.depth];
+	if (e && trace.enabled)
+		e->end = startup_trace_now();
+	pthread_mutex_unlock(&trace.lock);
+}
+
+void
+startup_trace_add(const char *name, uint64_t start, uint64_t end)
+{
+	pthread_mutex_lock(&trace.lock);
+	add_event(name, start, end);
+	pthread_mutex_unlock(&trace.lock);
+}
+
+static void
+write_event(FILE *f, const struct event *e, bool first)
+{
+	uint64_t end = e->end ? e->end : e->start;
+
+	fprintf(f, "%s\n  {\"name\": \"%s\", \"cat\": \"startup\", "
+		"\"pid\": %d, \"tid\": %d, \"ts\": %.3f, ",
+		first ? "" : ",", e->name, (int)getpid(),
+		e->main_thread ? 1 : 2, (e->start - trace.origin) / 1e3);
+	if (end == e->start && e->end)
+		fprintf(f, "\"ph\": \"i\", \"s\": \"g\"}");
+	else
+		fprintf(f, "\"ph\": \"X\", \"dur\": %.3f}",
+			(end - e->start) / 1e3);
+}
+
+/* with trace.lock held */
+static void
+write_trace(void)
+{
+	const char *filename = getenv("CUBE_STARTUP_TRACE");
+	unsigned i;
+	FILE *f;
+
+	trace.enabled = false;
+
+	/* only the first swap and the first presented frame are printed,
+	 * the file with every phase is opt-in */
+	if (!filename || !filename[0])
+		return;
+
+	f = fopen(filename, "w");
+	if (!f) {
+		printf("startup trace: cannot write %s: %m\n", filename);
+		return;
+	}
+
+	fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+	for (i = 0; i < trace.count; i++)
+		write_event(f, &trace.events[i], i == 0);
+	fprintf(f, "\n]}\n");
+	fclose(f);
+
+	printf("startup trace: written to %s\n", filename);
+}
+
+void
+startup_trace_swapped(void)
+{
+	uint64_t now = startup_trace_now();
+
+	pthread_mutex_lock(&trace.lock);
+	if (trace.enabled && !trace.first_swap) {
+		trace.first_swap = now;
+		add_event("first swap", now, now);
+		printf("startup: first swap after %.1f ms\n",
+		       (now - trace.origin) / 1e6);
+	}
+	pthread_mutex_unlock(&trace.lock);
+}
+
+void
+startup_trace_presented(uint64_t when)
+{
+	pthread_mutex_lock(&trace.lock);
+	if (trace.enabled && trace.first_swap) {
+		add_event("first frame presented", when, when);
+		printf("startup: first frame presented after %.1f ms\n",
+		       (when - trace.origin) / 1e6);
+		write_trace();
+	}
+	pthread_mutex_unlock(&trace.lock);
+}
+
+void
+startup_trace_finish(void)
+{
+	uint64_t now = startup_trace_now();
+	unsigned i;
+
+	pthread_mutex_lock(&trace.lock);
+	if (!trace.enabled)
+		goto out;
+
+	/* a run that fails or is stopped before its first frame is the
+	 * one to look at: the phases still running end now */
+	if (!trace.first_swap)
+		printf("startup: no frame swapped after %.1f ms\n",
+		       (now - trace.origin) / 1e6);
+	for (i = 0; i < trace.depth && i < STARTUP_TRACE_DEPTH; i++)
+		if (trace.stack[i] && !trace.stack[i]->end)
+			trace.stack[i]->end = now;
+	write_trace();
+out:
+	pthread_mutex_unlock(&trace.lock);
+}
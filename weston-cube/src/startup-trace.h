@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2019 STMicroelectronics. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef STARTUP_TRACE_H
+#define STARTUP_TRACE_H
+
+#include <stdint.h>
+
+/* Startup phases, from the start of main() to the first frame on screen,
+ * written as a Chrome trace (chrome://tracing, Perfetto) to the file named
+ * by CUBE_STARTUP_TRACE, if set, once the first frame is presented or at
+ * startup_trace_finish(), whichever comes first. The time to the first
+ * swap and to the first presented frame is printed in any case. Tracing
+ * stops there, every call becomes a no-op.
+ *
+ * The times are CLOCK_MONOTONIC, in ns.
+ */
+
+/* first thing in main(): the origin of the trace */
+void startup_trace_init(void);
+uint64_t startup_trace_now(void);
+
+/* a phase of the main thread, the phases may nest */
+void startup_trace_begin(const char *name);
+void startup_trace_end(void);
+
+/* a phase measured by other means, e.g. on another thread */
+void startup_trace_add(const char *name, uint64_t start, uint64_t end);
+
+/* after each swap, and when a frame is presented: the trace is written
+ * once the first frame is presented. startup_trace_finish(), at exit,
+ * writes it otherwise (no presentation feedback, or no frame at all),
+ * the unfinished phases ending then. */
+void startup_trace_swapped(void);
+void startup_trace_presented(uint64_t when);
+void startup_trace_finish(void);
+
+#endif
@@ -0,0 +1,392 @@
+/*
+ * Copyright (c) 2019 STMicroelectronics. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cube-common.h"
+#include "telemetry.h"
+
+/* seconds between two reports */
+#define REPORT_INTERVAL		5
+/* GPU timer queries in flight, their results are read a few frames later */
+#define GPU_QUERIES		4
+
+#define NSEC_PER_SEC		1000000000ULL
+
+struct frame_sample {
+	uint64_t interval;	/* since the previous swap */
+	uint64_t cpu;		/* render thread CPU time */
+	uint64_t gpu;		/* 0 if unknown */
+	uint64_t latency;	/* commit to presentation, 0 if unknown */
+};
+
+struct percentiles {
+	uint64_t p50, p95, p99;
+};
+
+static struct {
+	const struct _egl *egl;
+	bool initialized;
+
+	struct frame_sample frames[TELEMETRY_FRAMES];
+	uint64_t count;
+	uint64_t dropped;
+	uint64_t refresh;
+	uint64_t presented, discarded;
+	uint64_t last_swap, cpu_begin;
+
+	uint64_t report_time, report_count, report_dropped;
+	uint64_t report_presented, report_discarded;
+	unsigned dump_seen;
+
+	GLuint queries[GPU_QUERIES];
+	uint64_t query_frame[GPU_QUERIES];
+	bool query_pending[GPU_QUERIES];
+	unsigned query_next;
+	bool query_active;
+} tm;
+
+static uint64_t
+clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static int
+compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* percentiles of one field of the frames [first, tm.count), skipping the
+ * unknown (0) values; returns the number of values used */
+static unsigned
+compute_percentiles(uint64_t first, size_t field, struct percentiles *p)
+{
+	static uint64_t values[TELEMETRY_FRAMES];
+	unsigned n = 0;
+	uint64_t i;
+
+	if (tm.count - first > TELEMETRY_FRAMES)
+		first = tm.count - TELEMETRY_FRAMES;
+
+	for (i = first; i < tm.count; i++) {
+		const char *s = (const char *)&tm.frames[i % TELEMETRY_FRAMES];
+		uint64_t v;
+
+		memcpy(&v, s + field, sizeof(v));
+		if (v)
+			values[n++] = v;
+	}
+
+	memset(p, 0, sizeof(*p));
+	if (!n)
+		return 0;
+
+	qsort(values, n, sizeof(values[0]), compare_u64);
+	p->p50 = values[(n - 1) * 50 / 100];
+	p->p95 = values[(n - 1) * 95 / 100];
+	p->p99 = values[(n - 1) * 99 / 100];
+
+	return n;
+}
+
+static void
+collect_gpu_times(void)
+{
+	const struct _egl *egl = tm.egl;
+	unsigned i;
+
+	for (i = 0; i < GPU_QUERIES; i++) {
+		GLuint available = 0;
+		GLuint64 elapsed = 0;
+		GLint disjoint = 0;
+
+		if (!tm.query_pending[i])
+			continue;
+
+		egl->glGetQueryObjectuivEXT(tm.queries[i],
+					    GL_QUERY_RESULT_AVAILABLE_EXT,
+					    &available);
+		if (!available)
+			continue;
+
+		egl->glGetQueryObjectui64vEXT(tm.queries[i],
+					      GL_QUERY_RESULT_EXT, &elapsed);
+		tm.query_pending[i] = false;
+
+		/* the GPU clock got disturbed (e.g. frequency change), the
+		 * result is meaningless */
+		glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+		if (disjoint || tm.count - tm.query_frame[i] > TELEMETRY_FRAMES)
+			continue;
+
+		tm.frames[tm.query_frame[i] % TELEMETRY_FRAMES].gpu = elapsed;
+	}
+}
+
+void
+telemetry_frame_begin(const struct _egl *egl)
+{
+	if (!tm.initialized) {
+		tm.egl = egl;
+		if (egl->glGenQueriesEXT)
+			egl->glGenQueriesEXT(GPU_QUERIES, tm.queries);
+		tm.report_time = clock_ns(CLOCK_MONOTONIC);
+		cube_dump_signal_init();
+		tm.initialized = true;
+	}
+
+	tm.cpu_begin = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+
+	if (!egl->glGenQueriesEXT)
+		return;
+
+	collect_gpu_times();
+
+	/* if the GPU is that late, skip measuring this frame */
+	if (tm.query_pending[tm.query_next])
+		return;
+
+	egl->glBeginQueryEXT(GL_TIME_ELAPSED_EXT, tm.queries[tm.query_next]);
+	tm.query_active = true;
+}
+
+void
+telemetry_frame_drawn(const struct _egl *egl)
+{
+	if (!tm.query_active)
+		return;
+
+	egl->glEndQueryEXT(GL_TIME_ELAPSED_EXT);
+	tm.query_pending[tm.query_next] = true;
+	tm.query_frame[tm.query_next] = tm.count;
+	tm.query_next = (tm.query_next + 1) % GPU_QUERIES;
+	tm.query_active = false;
+}
+
+static void
+print_percentiles(const char *name, uint64_t first, size_t field)
+{
+	struct percentiles p;
+
+	if (!compute_percentiles(first, field, &p))
+		return;
+
+	printf("  %-8s p50 %6.2f ms  p95 %6.2f ms  p99 %6.2f ms\n", name,
+	       p.p50 / 1e6, p.p95 / 1e6, p.p99 / 1e6);
+}
+
+static void
+report(uint64_t now)
+{
+	uint64_t frames = tm.count - tm.report_count;
+	double seconds = (now - tm.report_time) / 1e9;
+	struct percentiles p;
+
+	printf("%llu frames in %.1f seconds: %f fps, %llu dropped\n",
+	       (unsigned long long)frames, seconds, frames / seconds,
+	       (unsigned long long)(tm.dropped - tm.report_dropped));
+	print_percentiles("interval", tm.report_count,
+			  offsetof(struct frame_sample, interval));
+	print_percentiles("cpu", tm.report_count,
+			  offsetof(struct frame_sample, cpu));
+	print_percentiles("gpu", tm.report_count,
+			  offsetof(struct frame_sample, gpu));
+	if (tm.presented != tm.report_presented ||
+	    tm.discarded != tm.report_discarded) {
+		printf("  %llu presented, %llu discarded\n",
+		       (unsigned long long)(tm.presented - tm.report_presented),
+		       (unsigned long long)(tm.discarded - tm.report_discarded));
+		print_percentiles("latency", tm.report_count,
+				  offsetof(struct frame_sample, latency));
+	}
+
+	/* the typical interval is the refresh period, or the time it takes
+	 * to draw when rendering is slower than that */
+	if (compute_percentiles(tm.report_count,
+				offsetof(struct frame_sample, interval), &p))
+		tm.refresh = p.p50;
+
+	tm.report_time = now;
+	tm.report_count = tm.count;
+	tm.report_dropped = tm.dropped;
+	tm.report_presented = tm.presented;
+	tm.report_discarded = tm.discarded;
+}
+
+static void
+dump_csv(void)
+{
+	const char *path = getenv("CUBE_TELEMETRY");
+	uint64_t i, first = 0;
+	FILE *f;
+
+	if (!path || !path[0])
+		path = "/tmp/weston-cube-telemetry.csv";
+
+	f = fopen(path, "w");
+	if (!f) {
+		fprintf(stderr, "cannot write telemetry to %s\n", path);
+		return;
+	}
+
+	if (tm.count > TELEMETRY_FRAMES)
+		first = tm.count - TELEMETRY_FRAMES;
+
+	fprintf(f, "frame,interval_us,cpu_us,gpu_us,latency_us\n");
+	for (i = first; i < tm.count; i++) {
+		const struct frame_sample *s = &tm.frames[i % TELEMETRY_FRAMES];
+
+		fprintf(f, "%llu,%llu,%llu,", (unsigned long long)i,
+			(unsigned long long)s->interval / 1000,
+			(unsigned long long)s->cpu / 1000);
+		if (s->gpu)
+			fprintf(f, "%llu", (unsigned long long)s->gpu / 1000);
+		fprintf(f, ",");
+		if (s->latency)
+			fprintf(f, "%llu",
+				(unsigned long long)s->latency / 1000);
+		fprintf(f, "\n");
+	}
+	fclose(f);
+
+	printf("Telemetry: %llu frames written to %s\n",
+	       (unsigned long long)(tm.count - first), path);
+	telemetry_write_json(stdout);
+	printf("\n");
+}
+
+void
+telemetry_frame_end(void)
+{
+	struct frame_sample *s = &tm.frames[tm.count % TELEMETRY_FRAMES];
+	uint64_t now = clock_ns(CLOCK_MONOTONIC);
+
+	s->cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID) - tm.cpu_begin;
+	s->interval = tm.last_swap ? now - tm.last_swap : 0;
+	s->gpu = 0;
+	s->latency = 0;
+	tm.last_swap = now;
+
+	/* every refresh period missed is a frame that was not shown */
+	if (tm.refresh && s->interval > tm.refresh * 3 / 2)
+		tm.dropped += (s->interval + tm.refresh / 2) / tm.refresh - 1;
+
+	tm.count++;
+
+	if (now - tm.report_time >= REPORT_INTERVAL * NSEC_PER_SEC)
+		report(now);
+
+	if (cube_dump_requests() != tm.dump_seen) {
+		tm.dump_seen = cube_dump_requests();
+		dump_csv();
+	}
+}
+
+uint64_t
+telemetry_frame_id(void)
+{
+	return tm.count;
+}
+
+void
+telemetry_frame_presented(uint64_t frame, uint64_t latency)
+{
+	tm.presented++;
+	if (frame < tm.count && tm.count - frame <= TELEMETRY_FRAMES)
+		tm.frames[frame % TELEMETRY_FRAMES].latency = latency;
+}
+
+void
+telemetry_frame_discarded(uint64_t frame)
+{
+	(void)frame;
+
+	tm.discarded++;
+}
+
+void
+telemetry_reset(void)
+{
+	unsigned i;
+
+	/* the results of the queries still in flight are dropped */
+	for (i = 0; i < GPU_QUERIES; i++)
+		tm.query_pending[i] = false;
+
+	tm.count = 0;
+	tm.dropped = 0;
+	tm.refresh = 0;
+	tm.presented = 0;
+	tm.discarded = 0;
+	tm.last_swap = 0;
+	tm.report_time = clock_ns(CLOCK_MONOTONIC);
+	tm.report_count = 0;
+	tm.report_dropped = 0;
+	tm.report_presented = 0;
+	tm.report_discarded = 0;
+}
+
+static void
+write_percentiles(FILE *f, const char *name, size_t field, const char *sep)
+{
+	struct percentiles p;
+
+	fprintf(f, "\"%s\": ", name);
+	if (compute_percentiles(0, field, &p))
+		fprintf(f, "{\"p50\": %.3f, \"p95\": %.3f, \"p99\": %.3f}",
+			p.p50 / 1e6, p.p95 / 1e6, p.p99 / 1e6);
+	else
+		fprintf(f, "null");
+	fprintf(f, "%s", sep);
+}
+
+void
+telemetry_write_json(FILE *f)
+{
+	fprintf(f, "{\"frames\": %llu, \"dropped\": %llu, "
+		"\"presented\": %llu, \"discarded\": %llu, ",
+		(unsigned long long)tm.count, (unsigned long long)tm.dropped,
+		(unsigned long long)tm.presented,
+		(unsigned long long)tm.discarded);
+	write_percentiles(f, "interval_ms",
+			  offsetof(struct frame_sample, interval), ", ");
+	write_percentiles(f, "cpu_ms",
+			  offsetof(struct frame_sample, cpu), ", ");
+	write_percentiles(f, "gpu_ms",
+			  offsetof(struct frame_sample, gpu), ", ");
+	write_percentiles(f, "latency_ms",
+			  offsetof(struct frame_sample, latency), "}");
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2019 STMicroelectronics. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sub license,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdio.h>
+
+#include "simple-st-egl.h"
+
+/* Frame-time telemetry shared by all the drawing modes. For every frame it
+ * records the CPU time spent by the render thread, the interval since the
+ * previous swap, the GPU time when GL_EXT_disjoint_timer_query is
+ * available and the presentation latency when the compositor reports it,
+ * in a ring buffer of the last TELEMETRY_FRAMES frames.
+ *
+ * Percentiles and dropped frames are printed every few seconds; on SIGUSR1
+ * the ring is dumped as CSV to the file named by CUBE_TELEMETRY (defaults
+ * to /tmp/weston-cube-telemetry.csv).
+ */
+
+#define TELEMETRY_FRAMES	1024
+
+/* around the drawing of a frame: _begin() before the first GL call,
+ * _drawn() after the last one, _end() once the buffers are swapped */
+void telemetry_frame_begin(const struct _egl *egl);
+void telemetry_frame_drawn(const struct _egl *egl);
+void telemetry_frame_end(void);
+
+/* wp_presentation feedback of the frame telemetry_frame_id() returned
+ * while it was drawn: 'latency' is the commit-to-present time */
+uint64_t telemetry_frame_id(void);
+void telemetry_frame_presented(uint64_t frame, uint64_t latency);
+void telemetry_frame_discarded(uint64_t frame);
+
+/* forget the frames measured so far, e.g. between two benchmark runs */
+void telemetry_reset(void);
+
+/* statistics over the frames in the ring, as one JSON object (without a
+ * trailing newline) */
+void telemetry_write_json(FILE *f);
+
+#endif